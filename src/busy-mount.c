@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/fanotify.h>
+#include <glib.h>
+
+#include "busy-mount.h"
+#include "holders.h"
+
+struct BusyMount {
+    gchar *mount_point;
+    int fd;
+    guint watch_id;
+    guint count;
+    GHashTable *pids;   /* pid -> open files */
+    busy_mount_cb_t cb;
+    gpointer data;
+    gboolean in_cb;     /* unwatching is deferred until cb returns */
+    gboolean unwatched;
+};
+
+static void pid_add(BusyMount *bm, pid_t pid) {
+    gpointer key = GINT_TO_POINTER(pid);
+    guint n = GPOINTER_TO_UINT(g_hash_table_lookup(bm->pids, key));
+
+    g_hash_table_insert(bm->pids, key, GUINT_TO_POINTER(n + 1));
+    bm->count++;
+}
+
+static void pid_remove(BusyMount *bm, pid_t pid) {
+    gpointer key = GINT_TO_POINTER(pid);
+    guint n = GPOINTER_TO_UINT(g_hash_table_lookup(bm->pids, key));
+
+    /* opened before the count was taken, or counted once for two fds */
+    if (n == 0)
+        return;
+
+    if (n == 1)
+        g_hash_table_remove(bm->pids, key);
+    else
+        g_hash_table_insert(bm->pids, key, GUINT_TO_POINTER(n - 1));
+    bm->count--;
+}
+
+static void count_open_files(BusyMount *bm) {
+    GPtrArray *holders = holders_scan(bm->mount_point);
+    guint i;
+
+    g_hash_table_remove_all(bm->pids);
+    bm->count = 0;
+
+    for (i = 0; holders && i < holders->len; i++) {
+        const Holder *h = g_ptr_array_index(holders, i);
+
+        /* only descriptors ever produce a close */
+        if (h->fd >= 0)
+            pid_add(bm, h->pid);
+    }
+
+    if (holders)
+        g_ptr_array_unref(holders);
+}
+
+static void free_watch(BusyMount *bm) {
+    close(bm->fd);
+    g_hash_table_destroy(bm->pids);
+    g_free(bm->mount_point);
+    g_free(bm);
+}
+
+static gboolean events_cb(GIOChannel *source, GIOCondition cond,
+                          gpointer data) {
+    BusyMount *bm = data;
+    struct fanotify_event_metadata buf[64];
+    gboolean closed = FALSE;
+    ssize_t n;
+
+    while ((n = read(bm->fd, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata *md = buf;
+
+        for (; FAN_EVENT_OK(md, n); md = FAN_EVENT_NEXT(md, n)) {
+            if (md->vers != FANOTIFY_METADATA_VERSION)
+                break;
+            if (md->fd >= 0)
+                close(md->fd);
+
+            if (md->mask & FAN_Q_OVERFLOW) {
+                count_open_files(bm);
+                closed = TRUE;
+                continue;
+            }
+            if (md->mask & FAN_OPEN)
+                pid_add(bm, md->pid);
+            if (md->mask & FAN_CLOSE) {
+                pid_remove(bm, md->pid);
+                closed = TRUE;
+            }
+        }
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        fprintf(stderr, "Cannot read fanotify events: %s\n",
+                g_strerror(errno));
+        bm->watch_id = 0;
+        return FALSE;
+    }
+
+    if (closed && bm->cb) {
+        bm->in_cb = TRUE;
+        bm->cb(bm, bm->data);
+        bm->in_cb = FALSE;
+    }
+
+    /* unwatched from cb: the source goes away by returning FALSE */
+    if (bm->unwatched) {
+        free_watch(bm);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BusyMount *busy_mount_watch(const gchar *mount_point, busy_mount_cb_t cb,
+                            gpointer data) {
+    BusyMount *bm;
+    GIOChannel *ch;
+    int fd;
+
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+                       O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "fanotify_init failed: %s\n", g_strerror(errno));
+        return NULL;
+    }
+
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN | FAN_CLOSE,
+                      AT_FDCWD, mount_point) != 0) {
+        fprintf(stderr, "Cannot watch %s: %s\n", mount_point,
+                g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    bm = g_new0(BusyMount, 1);
+    bm->mount_point = g_strdup(mount_point);
+    bm->fd = fd;
+    bm->pids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    bm->cb = cb;
+    bm->data = data;
+
+    /* after the mark, so that nothing opened in between is missed */
+    count_open_files(bm);
+
+    ch = g_io_channel_unix_new(fd);
+    bm->watch_id = g_io_add_watch(ch, G_IO_IN, events_cb, bm);
+    g_io_channel_unref(ch);
+
+    return bm;
+}
+
+void busy_mount_unwatch(BusyMount *bm) {
+    if (!bm)
+        return;
+
+    if (bm->in_cb) {
+        bm->unwatched = TRUE;
+        return;
+    }
+
+    if (bm->watch_id)
+        g_source_remove(bm->watch_id);
+    free_watch(bm);
+}
+
+guint busy_mount_get_count(const BusyMount *bm) {
+    return bm->count;
+}
+
+GArray *busy_mount_get_pids(const BusyMount *bm) {
+    GArray *pids = g_array_new(FALSE, FALSE, sizeof(pid_t));
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, bm->pids);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        pid_t pid = GPOINTER_TO_INT(key);
+
+        g_array_append_val(pids, pid);
+    }
+    return pids;
+}
@@ -0,0 +1,37 @@
+#ifndef __BUSY_MOUNT_H__
+#define __BUSY_MOUNT_H__
+
+#include <sys/types.h>
+#include <glib.h>
+
+/*
+ * Open files of a busy mount, tracked with fanotify instead of polling.
+ *
+ * The files open when the watch starts are counted from /proc (see
+ * holders.h), opens and closes on the mount are followed from then on.
+ * The callback runs after every batch of closes, so an unmount waiting
+ * for the mount to become idle can be retried right away. Files opened
+ * twice or through inherited descriptors can make the count too high, so
+ * it is a hint: trying the unmount is the only reliable test.
+ *
+ * Needs CAP_SYS_ADMIN.
+ */
+
+typedef struct BusyMount BusyMount;
+
+typedef void (*busy_mount_cb_t)(BusyMount *bm, gpointer data);
+
+/* Start tracking the mount on mount_point, NULL if fanotify is not
+ * available */
+BusyMount *busy_mount_watch(const gchar *mount_point, busy_mount_cb_t cb,
+                            gpointer data);
+/* Stop tracking, also allowed from the callback */
+void busy_mount_unwatch(BusyMount *bm);
+
+/* Files known to be open on the mount */
+guint busy_mount_get_count(const BusyMount *bm);
+
+/* Processes having them open, freed with g_array_unref() */
+GArray *busy_mount_get_pids(const BusyMount *bm);
+
+#endif /* __BUSY_MOUNT_H__ */
@@ -64,6 +64,30 @@ void inform_usb_cable_attached(gboolean value)
         }
 }
 
+void inform_pre_unmount(const char *mount_point)
+{
+        DBusMessage *m;
+
+        if (ses_conn == NULL) {
+                return;
+        }
+        m = dbus_message_new_signal(PRE_UNMOUNT_SIGNAL_OP,
+                                    PRE_UNMOUNT_SIGNAL_IF,
+                                    PRE_UNMOUNT_SIGNAL_NAME);
+        if (m == NULL) {
+                ULOG_ERR_F("dbus_message_new_signal failed");
+                return;
+        }
+        if (!dbus_message_append_args(m, DBUS_TYPE_STRING, &mount_point,
+                                      DBUS_TYPE_INVALID)
+            || !dbus_connection_send(ses_conn, m, NULL)) {
+                ULOG_ERR_F("could not send %s", PRE_UNMOUNT_SIGNAL_NAME);
+        } else {
+                dbus_connection_flush(ses_conn);
+        }
+        dbus_message_unref(m);
+}
+
 void inform_slide_keyboard(gboolean value)
 {
         GError* err = NULL;
@@ -36,9 +36,6 @@
 extern "C" {
 #endif
 
-/* how often to poll whether MMC has open files */
-#define	MMC_USE_RECHECK_TIMEOUT 1000
-
 /* max. seconds to wait for RAM after the exit signal */
 #define RAM_WAITING_TIMEOUT 20
 
@@ -135,6 +132,7 @@ void inform_camera_out(gboolean value);
 void inform_camera_turned_out(gboolean value);
 void inform_slide_keyboard(gboolean value);
 void inform_usb_cable_attached(gboolean value);
+void inform_pre_unmount(const char *mount_point);
 void unshare_usb_shared_card(mmc_info_t *mmc);
 void show_usb_sharing_failed_dialog(mmc_info_t *in, mmc_info_t *ex,
                                     gboolean ext_failed);
@@ -25,50 +25,61 @@
 
 #include "ke-recv.h"
 #include "exec-func.h"
+#include "proc-spawn.h"
+#include "reaper.h"
 
-typedef void (*sighandler_t)(int);
+/* how long a job may ignore SIGTERM before it gets SIGKILL */
+#define EXEC_KILL_GRACE_MS 2000
 
-extern char** environ;
+typedef struct {
+        gchar *cmd;
+        gchar **args;
+        exec_lane_t lane;
+        exec_native_t native;   /* run in process instead of cmd */
+        exec_native_status_t native_status;
+        exec_native_deferred_t native_deferred;
+        guint timeout_ms;
+        exec_done_cb_t cb;
+        gpointer data;
 
-/* FIXME: space for two arguments only */
-static const char* load_args[] = {LOAD_USB_DRIVER_COMMAND,
-                                  NULL, NULL, NULL};
-static const char* unload_args[] = {UNLOAD_USB_DRIVER_COMMAND,
-                                    NULL, NULL, NULL};
+        GPid pid;
+        guint timeout_id;
+        gboolean timed_out;
+        gboolean running;
+        gint64 started;
+} exec_job_t;
+
+struct exec_join_t_ {
+        guint pending;
+        gboolean closed;
+        int status;             /* first failure, 0 if none */
+        exec_done_cb_t cb;
+        gpointer data;
+};
+
+/* queued and running jobs, in queuing order */
+static GQueue exec_queue = G_QUEUE_INIT;
+static guint exec_idle_id = 0;
 
 /**
  * Execute a command with arguments.
  * @param cmd command to execute
  * @param args NULL-terminated array of arguments
- * @return return code of the command or -1 on fork(), -2 on
- * exec() error, -3 if the child terminated abnormally, and
+ * @return return code of the command or -1 if it could not be
+ * started, -3 if the child terminated abnormally, and
  * -4 if waitpid() failed.
  * */
 int exec_prog(const char* cmd, const char* args[])
 {
         pid_t pid = -1, waitrc = -1;
         int status;
-        sighandler_t handler;
-
-        /* ignore SIGCHLD temporarily, so that waitpid()
-         * below works (strangely SIG_IGN didn't work) */
-        handler = signal(SIGCHLD, SIG_DFL);
-        if (handler == SIG_ERR) {
-                ULOG_ERR_F("signal() failed: %s", strerror(errno));
-                return -1;
-        }
 
-        pid = fork();
+        /* waitpid() on our own child works with any SIGCHLD handler
+         * installed, only SIG_IGN would make it fail with ECHILD */
+        pid = spawn_prog(cmd, args, NULL);
         if (pid < 0) {
-                ULOG_ERR_F("fork() failed");
-                signal(SIGCHLD, handler);
                 return -1;
-        } else if (pid == 0) {
-                execve(cmd, (char** const) args, environ);
-                ULOG_ERR_F("execve() error: %s", strerror(errno));
-                exit(-2);
         }
-        assert(pid > 0);
 
 waitpid_again:
         waitrc = waitpid(pid, &status, 0);
@@ -79,137 +90,289 @@ waitpid_again:
                 }
                 ULOG_ERR_F("waitpid() returned error: %s",
                            strerror(errno));
-                signal(SIGCHLD, handler);
                 return -4;
         }
         assert(waitrc == pid);
         if (WIFEXITED(status)) {
-                signal(SIGCHLD, handler);
                 return WEXITSTATUS(status);
         }
         ULOG_ERR_F("child terminated abnormally");
-        signal(SIGCHLD, handler);
         return -3;
 }
 
-gboolean run_normal_umount(const mmc_info_t *mmc, gboolean whole_card)
+static void exec_job_free(exec_job_t *job)
 {
-        const char* umount_args[] = {MMC_UMOUNT_COMMAND, NULL,
-                                     NULL, NULL};
-        int ret = -1;
-        umount_args[1] = mmc->mount_point;
-        if (whole_card) {
-                umount_args[2] = mmc->whole_device;
-        } 
+        g_free(job->cmd);
+        g_strfreev(job->args);
+        g_free(job);
+}
 
-        ret = exec_prog(MMC_UMOUNT_COMMAND, umount_args);
-        if (ret == 0) {
-                return TRUE;
-        } else {
-                return FALSE;
+static gboolean exec_start_next(gpointer data);
+
+/* Reports the job and moves on to the next ones */
+static void exec_job_done(exec_job_t *job, int status)
+{
+        g_queue_remove(&exec_queue, job);
+
+        ULOG_DEBUG_F("%s returned %d after %lld ms", job->cmd, status,
+                     (long long)(g_get_monotonic_time() - job->started)
+                     / 1000);
+        if (job->cb != NULL) {
+                job->cb(status, job->data);
+        }
+        exec_job_free(job);
+
+        if (!g_queue_is_empty(&exec_queue) && exec_idle_id == 0) {
+                exec_idle_id = g_idle_add(exec_start_next, NULL);
         }
 }
 
-static gboolean try_mount(const mmc_info_t *mmc)
+static void exec_child_exited(pid_t pid, int status, gpointer data)
 {
-        const char* mount_args[5] = {MMC_MOUNT_COMMAND, NULL, NULL,
-                                     NULL, NULL};
-        int ret = -1;
-        char* part_device = NULL;
-        const volume_list_t *l;
+        exec_job_t *job = data;
+        int ret;
 
-        /* find out the device name of the first partition */
-        for (l = &mmc->volumes; l != NULL; l = l->next) {
-                if (l->udi != NULL && l->volume_number == 1) {
-                        part_device = l->dev_name;
-                        break;
-                }
+        if (job->timeout_id != 0) {
+                g_source_remove(job->timeout_id);
+                job->timeout_id = 0;
         }
-        if (part_device == NULL) {
-                ULOG_ERR_F("device name for first partition not found");
-                return FALSE;
+
+        if (job->timed_out) {
+                ret = EXEC_TIMED_OUT;
+        } else if (status != -1 && WIFEXITED(status)) {
+                ret = WEXITSTATUS(status);
+        } else {
+                ULOG_ERR_F("%s terminated abnormally", job->cmd);
+                ret = -3;
         }
 
-        mount_args[1] = part_device;
-        mount_args[2] = mmc->whole_device;
-        mount_args[3] = mmc->mount_point;
-        ret = exec_prog(MMC_MOUNT_COMMAND, mount_args);
-        if (ret == 0) {
-                return TRUE;
+        exec_job_done(job, ret);
+}
+
+static gboolean exec_job_timeout(gpointer data)
+{
+        exec_job_t *job = data;
+
+        if (!job->timed_out) {
+                ULOG_ERR_F("%s did not finish in %u ms, terminating",
+                           job->cmd, job->timeout_ms);
+                job->timed_out = TRUE;
+                kill(job->pid, SIGTERM);
+                job->timeout_id = g_timeout_add(EXEC_KILL_GRACE_MS,
+                                                exec_job_timeout, job);
         } else {
-                ULOG_DEBUG_F("exec_prog returned %d", ret);
-                return FALSE;
+                ULOG_ERR_F("killing %s", job->cmd);
+                kill(job->pid, SIGKILL);
+                job->timeout_id = 0;
         }
+        return FALSE;
 }
 
-gboolean run_mount(const mmc_info_t *mmc)
+static void exec_deferred_done(int status, gpointer data)
 {
-        return try_mount(mmc);
+        exec_job_done(data, status);
 }
 
-gboolean load_usb_driver(const char **arg)
+/* Starts the job, FALSE if it is already done */
+static gboolean exec_job_start(exec_job_t *job)
 {
-        int ret = -1, i = 1, j = 0;
+        pid_t pid;
+
+        job->running = TRUE;
+        job->started = g_get_monotonic_time();
 
-        for (; arg[j] != NULL; ++i, ++j) {
-                load_args[i] = arg[j];
+        if (job->native != NULL) {
+                if (job->native((const char *const *)job->args)) {
+                        exec_job_done(job, 0);
+                        return FALSE;
+                }
+                ULOG_INFO_F("falling back to %s", job->cmd);
+        } else if (job->native_status != NULL) {
+                int status;
+
+                status = job->native_status((const char *const *)job->args);
+                if (status >= 0) {
+                        exec_job_done(job, status);
+                        return FALSE;
+                }
+                ULOG_INFO_F("falling back to %s", job->cmd);
+        } else if (job->native_deferred != NULL) {
+                /* running until func reports back, its own limits apply */
+                if (job->native_deferred((const char *const *)job->args,
+                                         exec_deferred_done, job)) {
+                        return TRUE;
+                }
+                ULOG_INFO_F("falling back to %s", job->cmd);
         }
-        load_args[i] = NULL;
 
-        ret = exec_prog(LOAD_USB_DRIVER_COMMAND, load_args);
-	if (ret != 0) {
+        pid = spawn_prog(job->cmd, (const char *const *)job->args, NULL);
+        if (pid < 0) {
+                exec_job_done(job, -1);
                 return FALSE;
-	} else {
-                return TRUE;
         }
+
+        job->pid = pid;
+        reaper_watch(pid, exec_child_exited, job);
+        if (job->timeout_ms > 0) {
+                job->timeout_id = g_timeout_add(job->timeout_ms,
+                                                exec_job_timeout, job);
+        }
+        return TRUE;
 }
 
-gboolean unload_usb_driver(const char **arg)
+/*
+ * Starts every job whose turn has come: the first job of each card lane,
+ * as long as no EXEC_LANE_DEFAULT job is queued before it, or a
+ * EXEC_LANE_DEFAULT job once everything before it is done.
+ */
+static gboolean exec_start_next(gpointer data)
 {
-        int ret = -1, i = 1, j = 0;
+        guint busy_lanes = 0;
+        GList *l;
+
+        exec_idle_id = 0;
+        for (l = exec_queue.head; l != NULL; l = l->next) {
+                exec_job_t *job = l->data;
 
-        for (; arg && arg[j] != NULL; ++i, ++j) {
-                unload_args[i] = arg[j];
+                if (job->lane == EXEC_LANE_DEFAULT) {
+                        if (l == exec_queue.head && !job->running
+                            && !exec_job_start(job)) {
+                                /* done already, the rest is rescheduled */
+                                return FALSE;
+                        }
+                        break;
+                }
+                if (busy_lanes & (1 << job->lane)) {
+                        continue;
+                }
+                busy_lanes |= 1 << job->lane;
+                if (!job->running && !exec_job_start(job)) {
+                        return FALSE;
+                }
         }
-        unload_args[i] = NULL;
+        return FALSE;
+}
 
-        ret = exec_prog(UNLOAD_USB_DRIVER_COMMAND, unload_args);
-	if (ret != 0) {
-                return FALSE;
-	} else {
-                return TRUE;
+static void exec_queue_job(exec_job_t *job)
+{
+        g_queue_push_tail(&exec_queue, job);
+
+        /* started from the main loop so that cb never runs from here */
+        if (exec_idle_id == 0) {
+                exec_idle_id = g_idle_add(exec_start_next, NULL);
         }
 }
 
-gboolean enable_pcsuite(void)
+static exec_job_t *exec_job_new(const char* cmd, const char* args[],
+                                guint timeout_ms, exec_done_cb_t cb,
+                                gpointer data)
 {
-        static const char *args[] = {ENABLE_PCSUITE_COMMAND, NULL};
-        int ret;
-        ret = exec_prog(args[0], args);
-        return ret != 0 ? FALSE : TRUE;
+        exec_job_t *job = g_new0(exec_job_t, 1);
+
+        job->cmd = g_strdup(cmd);
+        job->args = g_strdupv((gchar **)args);
+        job->timeout_ms = timeout_ms;
+        job->cb = cb;
+        job->data = data;
+        return job;
 }
 
-gboolean disable_pcsuite(void)
+void exec_prog_async(const char* cmd, const char* args[], guint timeout_ms,
+                     exec_done_cb_t cb, gpointer data)
 {
-        static const char *args[] = {DISABLE_PCSUITE_COMMAND, NULL};
-        int ret;
-        ret = exec_prog(args[0], args);
-        return ret != 0 ? FALSE : TRUE;
+        exec_queue_job(exec_job_new(cmd, args, timeout_ms, cb, data));
 }
 
-gboolean usb_driver_is_used(void)
+void exec_native_async(exec_native_t func, const char* cmd,
+                       const char* args[], guint timeout_ms,
+                       exec_done_cb_t cb, gpointer data)
 {
-        static const char *args[] = {USB_DRIVER_IS_USED_COMMAND, NULL};
-        int ret;
+        exec_native_async_on(EXEC_LANE_DEFAULT, func, cmd, args, timeout_ms,
+                             cb, data);
+}
 
-        ret = exec_prog(args[0], args);
-        if (ret < 0) {
-                ULOG_ERR_F("exec_prog() failed");
-                return FALSE;
-        } else if (ret > 0) {
-                return TRUE;
-	} else {
-                return FALSE;
+void exec_native_async_on(exec_lane_t lane, exec_native_t func,
+                          const char* cmd, const char* args[],
+                          guint timeout_ms, exec_done_cb_t cb, gpointer data)
+{
+        exec_job_t *job = exec_job_new(cmd, args, timeout_ms, cb, data);
+
+        job->lane = lane;
+        job->native = func;
+        exec_queue_job(job);
+}
+
+void exec_native_status_async_on(exec_lane_t lane,
+                                 exec_native_status_t func,
+                                 const char* cmd, const char* args[],
+                                 guint timeout_ms, exec_done_cb_t cb,
+                                 gpointer data)
+{
+        exec_job_t *job = exec_job_new(cmd, args, timeout_ms, cb, data);
+
+        job->lane = lane;
+        job->native_status = func;
+        exec_queue_job(job);
+}
+
+void exec_native_deferred_async_on(exec_lane_t lane,
+                                   exec_native_deferred_t func,
+                                   const char* cmd, const char* args[],
+                                   guint timeout_ms, exec_done_cb_t cb,
+                                   gpointer data)
+{
+        exec_job_t *job = exec_job_new(cmd, args, timeout_ms, cb, data);
+
+        job->lane = lane;
+        job->native_deferred = func;
+        exec_queue_job(job);
+}
+
+static gboolean exec_join_finish(gpointer data)
+{
+        exec_join_t *join = data;
+
+        if (join->cb != NULL) {
+                join->cb(join->status, join->data);
         }
+        g_free(join);
+        return FALSE;
+}
+
+exec_join_t *exec_join_new(exec_done_cb_t cb, gpointer data)
+{
+        exec_join_t *join = g_new0(exec_join_t, 1);
+
+        join->cb = cb;
+        join->data = data;
+        return join;
+}
+
+exec_join_t *exec_join_add(exec_join_t *join)
+{
+        assert(!join->closed);
+        join->pending++;
+        return join;
 }
 
+void exec_join_done(int status, gpointer data)
+{
+        exec_join_t *join = data;
+
+        assert(join->pending > 0);
+        if (status != 0 && join->status == 0) {
+                join->status = status;
+        }
+        if (--join->pending == 0 && join->closed) {
+                exec_join_finish(join);
+        }
+}
+
+void exec_join_close(exec_join_t *join)
+{
+        join->closed = TRUE;
+        if (join->pending == 0) {
+                /* like the jobs, never call back from here */
+                g_idle_add(exec_join_finish, join);
+        }
+}
@@ -30,74 +30,143 @@
 extern "C" {
 #endif
 
-#define MMC_MOUNT_COMMAND "/usr/sbin/osso-mmc-mount.sh"
-#define MMC_UMOUNT_COMMAND "/usr/sbin/osso-mmc-umount.sh"
 #define MMC_CORRUPTED_SCRIPT "/usr/sbin/osso-mmc-corrupted.sh"
 #define MMC_NOT_CORRUPTED_SCRIPT "/usr/sbin/osso-mmc-not-corrupted.sh"
-#define LOAD_USB_DRIVER_COMMAND "/usr/sbin/osso-usb-mass-storage-enable.sh"
-#define UNLOAD_USB_DRIVER_COMMAND "/usr/sbin/osso-usb-mass-storage-disable.sh"
-#define USB_DRIVER_IS_USED_COMMAND "/usr/sbin/osso-usb-mass-storage-is-used.sh"
-#define ENABLE_PCSUITE_COMMAND "/usr/sbin/pcsuite-enable.sh"
-#define DISABLE_PCSUITE_COMMAND "/usr/sbin/pcsuite-disable.sh"
+
+/* Status passed to exec_done_cb_t when the job hit its time limit */
+#define EXEC_TIMED_OUT -5
 
 int exec_prog(const char* cmd, const char* args[]);
 
 /**
-  Execute umount command.
-  @param mmc memory card
-  @param whole_card whether the whole card (all partitions)
-         should be unmounted.
-  @return true on success.
+  Lanes of the asynchronous job queue. Jobs of one lane run one after
+  the other, card lanes run concurrently with each other. A
+  EXEC_LANE_DEFAULT job waits for everything queued before it and holds
+  back everything queued after it, so on that lane the queue behaves as
+  one strict FIFO.
 */
-gboolean run_normal_umount(const mmc_info_t *mmc, gboolean whole_card);
+typedef enum {
+        EXEC_LANE_DEFAULT = 0,
+        EXEC_LANE_INT_MMC,
+        EXEC_LANE_EXT_MMC
+} exec_lane_t;
 
 /**
-  Execute umount with the -l option.
+  Completion callback of the asynchronous functions.
+  @param status return code of the command, or -1 if it could not be
+  started, -3 if the child terminated abnormally, and
+  EXEC_TIMED_OUT if it was killed after its time limit.
+  @param data user data given with the job.
 */
-void run_lazy_umount(void);
+typedef void (*exec_done_cb_t)(int status, gpointer data);
 
 /**
-  Execute mount command.
-  @param mmc memory card
-  @return true on success.
+  Execute a command without blocking the main loop. Jobs run one at a
+  time in the order they were queued, so e.g. a PC Suite disable never
+  overtakes the enable before it. Only jobs on the card lanes (see
+  exec_lane_t) run concurrently. The callback is always called from the
+  main loop, never from within this function.
+  @param cmd command to execute
+  @param args NULL-terminated array of arguments, copied
+  @param timeout_ms time limit after which the command is terminated
+         (SIGTERM, then SIGKILL), 0 for none
+  @param cb called when the job is done, may be NULL
+  @param data passed to cb
 */
-gboolean run_mount(const mmc_info_t *mmc);
+void exec_prog_async(const char* cmd, const char* args[], guint timeout_ms,
+                     exec_done_cb_t cb, gpointer data);
 
 /**
-  Load the USB driver for listed devices.
-  Logs errors in case of failure.
-  @param arg device names in a NULL-terminated array.
-  @return true on success.
+  In-process replacement of a queued command.
+  @param args the argument vector of the command, args[0] included
+  @return TRUE on success, FALSE to run the command instead.
 */
-gboolean load_usb_driver(const char **arg);
+typedef gboolean (*exec_native_t)(const char *const args[]);
 
 /**
-  Unload the USB driver for listed devices.
-  Logs errors in case of failure.
-  @param arg device names in a NULL-terminated array, or NULL to unload
-  them all.
-  @return true on success.
+  In-process replacement of a command with meaningful exit codes.
+  @param args the argument vector of the command, args[0] included
+  @return the exit code the command would have, or a negative value to
+  run the command instead.
 */
-gboolean unload_usb_driver(const char **arg);
+typedef int (*exec_native_status_t)(const char *const args[]);
 
 /**
-  Enable PC Suite mode.
-  Logs errors in case of failure.
-  @return true on success.
+  In-process replacement of a command that finishes later.
+  @param args the argument vector of the command, args[0] included
+  @param done to be called with the exit code once finished, never from
+  within func
+  @param done_data passed to done
+  @return TRUE if done will be called, FALSE to run the command instead.
 */
-gboolean enable_pcsuite(void);
+typedef gboolean (*exec_native_deferred_t)(const char *const args[],
+                                           exec_done_cb_t done,
+                                           gpointer done_data);
+
+/**
+  Like exec_prog_async(), but first tries to do the job in process with
+  func, from the main loop when the job's turn comes. The command is only
+  run if func returns FALSE, so the job keeps its place in the queue.
+  @param func in-process implementation of cmd
+  @param cmd command to execute if func fails
+  @param args NULL-terminated array of arguments, copied
+  @param timeout_ms time limit of the command, 0 for none
+  @param cb called when the job is done, may be NULL
+  @param data passed to cb
+*/
+void exec_native_async(exec_native_t func, const char* cmd,
+                       const char* args[], guint timeout_ms,
+                       exec_done_cb_t cb, gpointer data);
+
+/**
+  exec_native_async() on the given lane. func may be NULL to only run
+  the command.
+*/
+void exec_native_async_on(exec_lane_t lane, exec_native_t func,
+                          const char* cmd, const char* args[],
+                          guint timeout_ms, exec_done_cb_t cb, gpointer data);
+
+/**
+  exec_native_async_on() for a func reporting an exit code.
+*/
+void exec_native_status_async_on(exec_lane_t lane,
+                                 exec_native_status_t func,
+                                 const char* cmd, const char* args[],
+                                 guint timeout_ms, exec_done_cb_t cb,
+                                 gpointer data);
+
+/**
+  exec_native_async_on() for a func finishing asynchronously. The time
+  limit only applies to the command, func must bound its own work.
+*/
+void exec_native_deferred_async_on(exec_lane_t lane,
+                                   exec_native_deferred_t func,
+                                   const char* cmd, const char* args[],
+                                   guint timeout_ms, exec_done_cb_t cb,
+                                   gpointer data);
+
+/**
+  Join of several asynchronous jobs: its callback is called once all
+  jobs added to it are done and it has been closed. The status is that of
+  the first failed job, 0 if all succeeded. The join is freed after the
+  callback.
+*/
+typedef struct exec_join_t_ exec_join_t;
+
+exec_join_t *exec_join_new(exec_done_cb_t cb, gpointer data);
 
 /**
-  Disable PC Suite mode.
-  Logs errors in case of failure.
-  @return true on success.
+  Count one more job. Pass the return value as the data of
+  exec_join_done(), given as the job's callback.
 */
-gboolean disable_pcsuite(void);
+exec_join_t *exec_join_add(exec_join_t *join);
+void exec_join_done(int status, gpointer data);
 
 /**
-  @return true if USB driver is used, false otherwise.
+  No more jobs will be added. The callback is called from the main loop,
+  even if all jobs are done already.
 */
-gboolean usb_driver_is_used(void);
+void exec_join_close(exec_join_t *join);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,202 @@
+/**
+  @file fsm.c
+  Small table driven state machine engine with per-transition statistics.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <osso-log.h>
+
+#include "fsm.h"
+
+/* Latency percentiles are taken over this many most recent transitions of
+ * each row */
+#define FSM_LATENCY_SAMPLES 64
+
+typedef struct {
+        guint count;
+        guint failures;
+        guint32 samples[FSM_LATENCY_SAMPLES];   /* ring, microseconds */
+} fsm_edge_t;
+
+struct fsm {
+        const fsm_def_t *def;
+        gpointer ctx;
+        gint state;
+        guint unhandled;
+        fsm_edge_t *edges;      /* one per transition row */
+};
+
+fsm_t *fsm_new(const fsm_def_t *def, gint initial, gpointer ctx)
+{
+        fsm_t *fsm = g_new0(fsm_t, 1);
+
+        fsm->def = def;
+        fsm->ctx = ctx;
+        fsm->state = initial;
+        fsm->edges = g_new0(fsm_edge_t, def->n_transitions);
+
+        return fsm;
+}
+
+void fsm_free(fsm_t *fsm)
+{
+        if (fsm == NULL)
+                return;
+
+        g_free(fsm->edges);
+        g_free(fsm);
+}
+
+gint fsm_get_state(const fsm_t *fsm)
+{
+        return fsm->state;
+}
+
+void fsm_set_state(fsm_t *fsm, gint state)
+{
+        fsm->state = state;
+}
+
+const fsm_def_t *fsm_get_def(const fsm_t *fsm)
+{
+        return fsm->def;
+}
+
+guint fsm_get_unhandled(const fsm_t *fsm)
+{
+        return fsm->unhandled;
+}
+
+static const gchar *state_name(const fsm_def_t *def, gint state)
+{
+        if (state >= 0 && (guint)state < def->n_states)
+                return def->states[state];
+        return "?";
+}
+
+static const fsm_transition_t *find_transition(const fsm_t *fsm, gint event)
+{
+        const fsm_def_t *def = fsm->def;
+        guint i;
+
+        for (i = 0; i < def->n_transitions; i++) {
+                const fsm_transition_t *t = &def->transitions[i];
+
+                if (t->event != event)
+                        continue;
+                if (t->state != FSM_ANY && t->state != fsm->state)
+                        continue;
+                if (t->guard != NULL &&
+                    !t->guard(fsm->ctx, fsm->state, event))
+                        continue;
+                return t;
+        }
+
+        return NULL;
+}
+
+gboolean fsm_dispatch(fsm_t *fsm, gint event)
+{
+        const fsm_def_t *def = fsm->def;
+        const fsm_transition_t *t;
+        fsm_edge_t *edge;
+        gboolean ok = TRUE;
+        gint64 start;
+        gint from, next;
+
+        if (event < 0 || (guint)event >= def->n_events) {
+                ULOG_ERR_F("%s: unknown event %d", def->name, event);
+                return FALSE;
+        }
+
+        start = g_get_monotonic_time();
+        from = fsm->state;
+
+        if (def->events[event].entry != NULL)
+                def->events[event].entry(fsm->ctx, from, event);
+
+        t = find_transition(fsm, event);
+        if (t == NULL) {
+                ULOG_WARN_F("%s: %s in %s not handled", def->name,
+                            def->events[event].name, state_name(def, from));
+                fsm->unhandled++;
+                return FALSE;
+        }
+
+        if (t->action != NULL)
+                ok = t->action(fsm->ctx, from, event);
+        next = ok ? t->next : t->fail;
+        if (next != FSM_SAME)
+                fsm->state = next;
+
+        edge = &fsm->edges[t - def->transitions];
+        edge->samples[edge->count % FSM_LATENCY_SAMPLES] =
+                (guint32)MIN(g_get_monotonic_time() - start, G_MAXUINT32);
+        edge->count++;
+        if (!ok)
+                edge->failures++;
+
+        ULOG_DEBUG_F("%s: %s in %s -> %s%s", def->name,
+                     def->events[event].name, state_name(def, from),
+                     state_name(def, fsm->state), ok ? "" : " (failed)");
+
+        return ok;
+}
+
+static int compare_guint32(const void *a, const void *b)
+{
+        guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+/* Nearest rank */
+static guint percentile(const guint32 *sorted, guint n, guint p)
+{
+        guint rank = (n * p + 99) / 100;
+
+        return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void fsm_get_edge_stats(const fsm_t *fsm, guint index,
+                        fsm_edge_stats_t *stats)
+{
+        const fsm_edge_t *edge;
+        guint32 sorted[FSM_LATENCY_SAMPLES];
+        guint n;
+
+        memset(stats, 0, sizeof(*stats));
+        if (index >= fsm->def->n_transitions)
+                return;
+
+        edge = &fsm->edges[index];
+        stats->count = edge->count;
+        stats->failures = edge->failures;
+
+        n = MIN(edge->count, FSM_LATENCY_SAMPLES);
+        if (n == 0)
+                return;
+
+        memcpy(sorted, edge->samples, n * sizeof(sorted[0]));
+        qsort(sorted, n, sizeof(sorted[0]), compare_guint32);
+        stats->p50_us = percentile(sorted, n, 50);
+        stats->p99_us = percentile(sorted, n, 99);
+}
@@ -0,0 +1,99 @@
+/**
+  @file fsm.h
+  Small table driven state machine engine with per-transition statistics.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef FSM_H_
+#define FSM_H_
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Matches every state in fsm_transition_t.state */
+#define FSM_ANY -1
+/* Keep the current state in fsm_transition_t.next and .fail */
+#define FSM_SAME -1
+
+typedef gboolean (*fsm_guard_t)(gpointer ctx, gint state, gint event);
+/* Returns FALSE if the action failed */
+typedef gboolean (*fsm_action_t)(gpointer ctx, gint state, gint event);
+
+/* The first row matching the current state and the event, and whose guard
+ * (if any) passes, is taken. FSM_ANY rows should come last for their
+ * event. */
+typedef struct {
+        gint state;
+        gint event;
+        fsm_guard_t guard;
+        fsm_action_t action;
+        gint next;              /* state after a successful action */
+        gint fail;              /* state if the action failed */
+} fsm_transition_t;
+
+typedef struct {
+        const gchar *name;
+        /* run on every occurrence of the event before the transition,
+         * whatever the state; may be NULL */
+        fsm_action_t entry;
+} fsm_event_t;
+
+typedef struct {
+        const gchar *name;      /* used in logs */
+        const gchar * const *states;
+        guint n_states;
+        const fsm_event_t *events;
+        guint n_events;
+        const fsm_transition_t *transitions;
+        guint n_transitions;
+} fsm_def_t;
+
+typedef struct {
+        guint count;
+        guint failures;
+        /* of the most recent transitions, in microseconds */
+        guint p50_us;
+        guint p99_us;
+} fsm_edge_stats_t;
+
+typedef struct fsm fsm_t;
+
+fsm_t *fsm_new(const fsm_def_t *def, gint initial, gpointer ctx);
+void fsm_free(fsm_t *fsm);
+
+gint fsm_get_state(const fsm_t *fsm);
+/* Forces the state without running any action, e.g. on start up */
+void fsm_set_state(fsm_t *fsm, gint state);
+
+/* Runs the event; returns FALSE if no row matched or the action failed */
+gboolean fsm_dispatch(fsm_t *fsm, gint event);
+
+const fsm_def_t *fsm_get_def(const fsm_t *fsm);
+/* Statistics of the transition table row 'index' */
+void fsm_get_edge_stats(const fsm_t *fsm, guint index,
+                        fsm_edge_stats_t *stats);
+/* Events that matched no row */
+guint fsm_get_unhandled(const fsm_t *fsm);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* FSM_H_ */
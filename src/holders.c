@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <glib.h>
+
+#include "holders.h"
+
+/* below this many processes a single thread is faster */
+#define PARALLEL_MIN_PIDS 64
+#define MAX_THREADS 4
+
+typedef struct {
+    const GArray *pids;
+    guint first, step;
+    dev_t dev;
+    GPtrArray *found;
+} ScanJob;
+
+static void holder_free(gpointer p) {
+    Holder *h = p;
+
+    g_free(h->comm);
+    g_free(h->path);
+    g_free(h);
+}
+
+static gchar *read_comm(const gchar *pid_dir) {
+    gchar *path = g_build_filename(pid_dir, "comm", NULL);
+    gchar *comm = NULL;
+
+    if (g_file_get_contents(path, &comm, NULL, NULL))
+        g_strstrip(comm);
+
+    g_free(path);
+    return comm ? comm : g_strdup("?");
+}
+
+/* Add a holder if the link below pid_dir points to something on dev */
+static void check_link(GPtrArray *holders, pid_t pid, const gchar *pid_dir,
+                       const gchar *link, gint fd, dev_t dev) {
+    gchar *path = g_build_filename(pid_dir, link, NULL);
+    struct stat st;
+
+    /* stat() follows the magic link even for deleted files */
+    if (stat(path, &st) == 0 && st.st_dev == dev) {
+        Holder *h = g_new0(Holder, 1);
+        gchar *target = g_file_read_link(path, NULL);
+
+        h->pid = pid;
+        h->fd = fd;
+        h->comm = read_comm(pid_dir);
+        h->path = target ? target : g_strdup(link);
+        g_ptr_array_add(holders, h);
+    }
+
+    g_free(path);
+}
+
+/* Mapped files, e.g. libraries and media played through mmap */
+static void check_maps(GPtrArray *holders, pid_t pid, const gchar *pid_dir,
+                       dev_t dev) {
+    gchar *path = g_build_filename(pid_dir, "maps", NULL);
+    gchar *contents = NULL, **lines;
+    GHashTable *seen;
+    gchar *comm = NULL;
+    guint i;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+
+    seen = g_hash_table_new(g_str_hash, g_str_equal);
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        /* "start-end perms offset maj:min inode path" */
+        guint maj, min;
+        gulong inode;
+        int path_at = 0;
+        const gchar *file;
+        Holder *h;
+
+        if (sscanf(lines[i], "%*s %*s %*s %x:%x %lu %n", &maj, &min, &inode,
+                   &path_at) < 3 || inode == 0 || path_at == 0)
+            continue;
+        if (maj != major(dev) || min != minor(dev))
+            continue;
+
+        file = lines[i] + path_at;
+        if (g_hash_table_contains(seen, file))
+            continue;
+        g_hash_table_add(seen, (gpointer)file);
+
+        if (!comm)
+            comm = read_comm(pid_dir);
+
+        h = g_new0(Holder, 1);
+        h->pid = pid;
+        h->fd = -1;
+        h->comm = g_strdup(comm);
+        h->path = g_strdup(file);
+        g_ptr_array_add(holders, h);
+    }
+
+    g_hash_table_destroy(seen);
+    g_strfreev(lines);
+    g_free(comm);
+    g_free(contents);
+    g_free(path);
+}
+
+static void scan_pid(GPtrArray *holders, pid_t pid, dev_t dev) {
+    static const gchar *const links[] = { "cwd", "root", "exe", NULL };
+    gchar *pid_dir = g_strdup_printf("/proc/%d", (int)pid);
+    gchar *fd_dir = g_build_filename(pid_dir, "fd", NULL);
+    const gchar *name;
+    GDir *d;
+    guint i;
+
+    for (i = 0; links[i]; i++)
+        check_link(holders, pid, pid_dir, links[i], -1, dev);
+
+    /* other users' processes are only readable with privileges */
+    d = g_dir_open(fd_dir, 0, NULL);
+    while (d && (name = g_dir_read_name(d))) {
+        gchar *link = g_build_filename("fd", name, NULL);
+
+        check_link(holders, pid, pid_dir, link, atoi(name), dev);
+        g_free(link);
+    }
+
+    if (d)
+        g_dir_close(d);
+
+    check_maps(holders, pid, pid_dir, dev);
+    g_free(fd_dir);
+    g_free(pid_dir);
+}
+
+static gpointer scan_thread(gpointer data) {
+    ScanJob *job = data;
+    guint i;
+
+    for (i = job->first; i < job->pids->len; i += job->step)
+        scan_pid(job->found, g_array_index(job->pids, pid_t, i), job->dev);
+    return NULL;
+}
+
+static gint compare_holders(gconstpointer a, gconstpointer b) {
+    const Holder *x = *(const Holder *const *)a;
+    const Holder *y = *(const Holder *const *)b;
+
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    return x->fd - y->fd;
+}
+
+GPtrArray *holders_scan(const gchar *mount_point) {
+    GPtrArray *holders;
+    GArray *pids;
+    ScanJob jobs[MAX_THREADS];
+    GThread *threads[MAX_THREADS];
+    const gchar *name;
+    struct stat st;
+    guint n, i, j;
+    GDir *proc;
+
+    if (stat(mount_point, &st) != 0) {
+        fprintf(stderr, "Cannot stat %s: %s\n", mount_point,
+                g_strerror(errno));
+        return NULL;
+    }
+
+    proc = g_dir_open("/proc", 0, NULL);
+    if (!proc)
+        return NULL;
+
+    pids = g_array_new(FALSE, FALSE, sizeof(pid_t));
+    while ((name = g_dir_read_name(proc))) {
+        gchar *end;
+        glong value = strtol(name, &end, 10);
+        pid_t pid = (pid_t)value;
+
+        if (*end != '\0' || value <= 0 || pid == getpid())
+            continue;
+        g_array_append_val(pids, pid);
+    }
+    g_dir_close(proc);
+
+    /* the processes are dealt out to the threads in turn */
+    n = pids->len < PARALLEL_MIN_PIDS ? 1 :
+        CLAMP(g_get_num_processors(), 1, MAX_THREADS);
+    for (i = 0; i < n; i++) {
+        jobs[i].pids = pids;
+        jobs[i].first = i;
+        jobs[i].step = n;
+        jobs[i].dev = st.st_dev;
+        jobs[i].found = g_ptr_array_new();
+        threads[i] = i == 0 ? NULL :
+                     g_thread_try_new("holders", scan_thread, &jobs[i], NULL);
+    }
+    /* the caller's thread takes the first share and any that failed */
+    scan_thread(&jobs[0]);
+
+    holders = g_ptr_array_new_with_free_func(holder_free);
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            if (threads[i])
+                g_thread_join(threads[i]);
+            else
+                scan_thread(&jobs[i]);
+        }
+        for (j = 0; j < jobs[i].found->len; j++)
+            g_ptr_array_add(holders, g_ptr_array_index(jobs[i].found, j));
+        g_ptr_array_unref(jobs[i].found);
+    }
+    g_ptr_array_sort(holders, compare_holders);
+
+    g_array_unref(pids);
+    return holders;
+}
+
+void holders_log(const gchar *what, const GPtrArray *holders) {
+    guint i;
+
+    for (i = 0; holders && i < holders->len; i++) {
+        const Holder *h = g_ptr_array_index(holders, i);
+
+        fprintf(stderr, "%s: %s[%d] holds %s\n", what, h->comm, (int)h->pid,
+                h->path);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef __HOLDERS_H__
+#define __HOLDERS_H__
+
+#include <sys/types.h>
+#include <glib.h>
+
+/*
+ * Processes keeping a mount busy, found through /proc: open files, current
+ * and root directories, executables and mapped files on the filesystem of
+ * the mount. This is what lsof reports, without its per-process cost;
+ * large process tables are scanned by several threads.
+ */
+
+typedef struct {
+    pid_t pid;
+    gchar *comm;
+    gchar *path;    /* the file held, as /proc shows it */
+    gint fd;        /* -1 for the cwd, root, executable and mappings */
+} Holder;
+
+/* Holders of the filesystem mounted on mount_point ordered by pid, freed
+ * with g_ptr_array_unref(). NULL if mount_point cannot be examined. */
+GPtrArray *holders_scan(const gchar *mount_point);
+
+/* Log each holder to stderr, prefixed with what it blocks */
+void holders_log(const gchar *what, const GPtrArray *holders);
+
+#endif /* __HOLDERS_H__ */
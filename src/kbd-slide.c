@@ -30,11 +30,14 @@
 
 #include "events.h"
 #include "kbd-slide.h"
+#include "probe-cache.h"
 
 /* Path to the input device directory */
 #define DEV_INPUT_PATH "/dev/input"
 /* Prefix for event files */
 #define EVENT_FILE_PREFIX "event"
+/* Group in the probe cache, see probe-cache.h */
+#define PROBE_CACHE_GROUP "kbd-slide"
 
 static struct libevdev *kbd_slide_dev = NULL;
 static GIOChannel *kbd_slide_iochan = NULL;
@@ -89,6 +92,20 @@ kbd_slide_find_evdev()
     gboolean result = FALSE;
     gchar *dev_path = NULL;
 
+    /* The device found by an earlier instance during this boot */
+    dev_path = probe_cache_get_path(PROBE_CACHE_GROUP, "Device");
+    if (dev_path != NULL)
+    {
+        if (kbd_slide_set_input_dev(dev_path))
+        {
+            g_free(dev_path);
+            return kbd_slide_add_handler();
+        }
+
+        g_free(dev_path);
+        probe_cache_remove_group(PROBE_CACHE_GROUP);
+    }
+
     if ((dir = opendir(DEV_INPUT_PATH)) == NULL)
     {
         perror(__func__);
@@ -110,6 +127,8 @@ kbd_slide_find_evdev()
         if (kbd_slide_set_input_dev(dev_path))
         {
             result = kbd_slide_add_handler();
+            probe_cache_set_path(PROBE_CACHE_GROUP, "Device", dev_path);
+            probe_cache_save();
             g_free(dev_path);
             break;
         }
@@ -225,6 +225,26 @@ static void send_enable_mass_storage()
     	ULOG_DEBUG_F("leaving");
 }
 
+static void send_enable_mass_storage_ro()
+{
+	DBusMessage* m = NULL, *reply = NULL;
+	DBusError err;
+    	ULOG_DEBUG_F("entering");
+	assert(sys_conn != NULL);
+	dbus_error_init(&err);
+	  m = dbus_message_new_method_call("com.nokia.ke_recv",
+			ENABLE_MASS_STORAGE_RO_OP,
+			"com.nokia.ke_recv",
+			"dummy");
+	reply = dbus_connection_send_with_reply_and_block(sys_conn, m,
+			20000, &err);
+    	if (reply == NULL) {
+       	   ULOG_CRIT_F("dbus_connection_send failed: %s", err.message);
+           exit(1);
+        }
+    	ULOG_DEBUG_F("leaving");
+}
+
 static void send_swap_off(int mode)
 {
 	DBusMessage* m = NULL, *reply = NULL;
@@ -392,7 +412,8 @@ int main(int argc, char* argv[])
                    "ec - cancel eject USB\n"
                    "p - enable PC Suite\n"
                    "c - enable charging mode\n"
-                   "m - enable USB mass storage\n");
+                   "m - enable USB mass storage\n"
+                   "mr - enable read-only USB mass storage\n");
             exit(1);
     }
     ULOG_OPEN("ke_recv_test");
@@ -431,7 +452,11 @@ int main(int argc, char* argv[])
                 send_enable_pcsuite();
                 break;
             case 'm':
-                send_enable_mass_storage();
+                if (argv[1][1] == 'r') {
+                        send_enable_mass_storage_ro();
+                } else {
+                        send_enable_mass_storage();
+                }
                 break;
             case 'a':
                 if (argv[1][1] == 't') {
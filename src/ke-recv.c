@@ -25,11 +25,19 @@
 
 #include "ke-recv.h"
 #include "exec-func.h"
+#include "usb-mode.h"
 #include "gui.h"
 #include "events.h"
 #include "camera.h"
 #include "kbd-slide.h"
 #include "udev-helper.h"
+#include "fsm.h"
+#include "reaper.h"
+#include "usb-gadget.h"
+#include "usb-share.h"
+#include "umount-engine.h"
+#include "holders.h"
+#include "mount-table.h"
 #include <hildon-mime.h>
 #include <libgen.h>
 
@@ -51,7 +59,18 @@ static DBusMessage* the_message = NULL;
 osso_context_t *osso;
 
 
-static usb_state_t usb_state = S_INVALID_USB_STATE;
+/* One instance of the USB state machine per udev-helper port */
+typedef struct {
+        uh_port_t *port;        /* NULL if udev-helper is not available */
+        fsm_t *fsm;             /* states are usb_state_t */
+} usb_port_t;
+
+static usb_port_t *usb_ports = NULL;
+static guint n_usb_ports = 0;
+/* D-Bus requests and the USB dialog are not tied to a port, they act on
+ * the first one */
+#define PRIMARY_USB_PORT (&usb_ports[0])
+
 static dbus_uint32_t usb_dialog = -1;
 extern gboolean device_locked;
 gboolean desktop_started = FALSE;
@@ -62,7 +81,7 @@ static GMainLoop *mainloop;
 
 /* Header declarations */
 void send_error(const char* s);
-static void handle_usb_event(usb_event_t e);
+static void handle_usb_event(usb_port_t *p, usb_event_t e);
 
 
 
@@ -129,7 +148,7 @@ static void action_invoked(unsigned int id, const char *act)
 #endif
         if (usb_dialog == id) {
                 ULOG_DEBUG_F("USB dialog action: '%s'", act);
-                handle_usb_event(E_EJECT_CANCELLED);
+                handle_usb_event(PRIMARY_USB_PORT, E_EJECT_CANCELLED);
         } else {
                 ULOG_DEBUG_F("unknown dialog id: %u", id);
         }
@@ -238,7 +257,8 @@ sig_handler(DBusConnection *c, DBusMessage *m, void *data)
                         usb_state_t state = get_usb_state();
                         if (state == S_PERIPHERAL) {
                                 /* possibly USB-share cards */
-                                handle_usb_event(E_ENTER_PERIPHERAL_MODE);
+                                handle_usb_event(PRIMARY_USB_PORT,
+                                                 E_ENTER_PERIPHERAL_MODE);
                         }
 #endif
 	        }
@@ -296,10 +316,10 @@ void send_error(const char* n)
         dbus_message_unref(e);
 }
 
-static usb_state_t map_usb_mode(gint usb_mode) {
+static usb_state_t map_usb_mode(usb_port_t *p, gint usb_mode) {
     if (usb_mode == USB_MODE_UNKNOWN) {
         ULOG_ERR_F("'usb_device mode' is UNKNOWN, not changing the state");
-        return usb_state;
+        return fsm_get_state(p->fsm);
     } else if ((usb_mode == USB_MODE_A_PERIPHERAL) ||
         (usb_mode == USB_MODE_B_PERIPHERAL)) {
         return S_PERIPHERAL_WAIT;
@@ -315,45 +335,54 @@ static usb_state_t map_usb_mode(gint usb_mode) {
         /* return S_PERIPHERAL_WAIT; */
     }
 
-	return usb_state;
+	return fsm_get_state(p->fsm);
+}
+
+static usb_state_t get_port_usb_state(usb_port_t *p)
+{
+    gint usb_mode = USB_MODE_UNKNOWN, supply_mode;
+    if (p->port != NULL)
+        uh_port_query_state(p->port, &usb_mode, &supply_mode);
+    return map_usb_mode(p, usb_mode);
 }
 
 usb_state_t get_usb_state(void)
 {
-    gint usb_mode, supply_mode;
-    uh_query_state(&usb_mode, &supply_mode);
-    return map_usb_mode(usb_mode);
+    return get_port_usb_state(PRIMARY_USB_PORT);
 }
 
-static usb_state_t check_usb_cable(void)
+static usb_state_t check_usb_cable(usb_port_t *p)
 {
         usb_state_t state;
 
-        state = get_usb_state();
+        state = get_port_usb_state(p);
         if (state == S_HOST) {
-                handle_usb_event(E_ENTER_HOST_MODE);
+                handle_usb_event(p, E_ENTER_HOST_MODE);
         } else if (state == S_PERIPHERAL_WAIT) {
 #if 0
                 if (getenv("TA_IMAGE"))
                         /* in TA image, we don't wait for user's decision */
-                        handle_usb_event(E_ENTER_PCSUITE_MODE);
+                        handle_usb_event(p, E_ENTER_PCSUITE_MODE);
                 else
 #endif
-                /*handle_usb_event(E_ENTER_PERIPHERAL_WAIT_MODE);*/
+                /*handle_usb_event(p, E_ENTER_PERIPHERAL_WAIT_MODE);*/
 
                 /* Just go to PC suite mode right away */
-                handle_usb_event(E_ENTER_PCSUITE_MODE);
+                handle_usb_event(p, E_ENTER_PCSUITE_MODE);
         } else if (state == S_CABLE_DETACHED) {
-                handle_usb_event(E_CABLE_DETACHED);
+                handle_usb_event(p, E_CABLE_DETACHED);
         }
         return state;
 }
 
 
-static void uh_callback(gint usb_mode, gint supply_mode, gpointer data) {
-    ULOG_WARN_F("uh_callback: mode = %d", usb_mode);
-	check_usb_cable();
-    //usb_state_t = map_usb_mode(usb_mode);
+static void uh_callback(uh_port_t *port, gint usb_mode, gint supply_mode,
+                        gpointer data) {
+    usb_port_t *p = data;
+    ULOG_WARN_F("uh_callback: %s: mode = %d", uh_port_get_name(port),
+                usb_mode);
+	check_usb_cable(p);
+    //usb_state_t = map_usb_mode(p, usb_mode);
     // TODO: call appropriate mode change function
 }
 
@@ -365,7 +394,7 @@ static DBusHandlerResult eject_handler(DBusConnection *c,
         ULOG_DEBUG_F("entered");
         the_connection = c;
         the_message = m;
-        handle_usb_event(E_EJECT);
+        handle_usb_event(PRIMARY_USB_PORT, E_EJECT);
         /* invalidate */
         the_connection = NULL;
         the_message = NULL;
@@ -379,7 +408,7 @@ static DBusHandlerResult cancel_eject_handler(DBusConnection *c,
         ULOG_DEBUG_F("entered");
         the_connection = c;
         the_message = m;
-        handle_usb_event(E_EJECT_CANCELLED);
+        handle_usb_event(PRIMARY_USB_PORT, E_EJECT_CANCELLED);
         /* invalidate */
         the_connection = NULL;
         the_message = NULL;
@@ -393,7 +422,7 @@ static DBusHandlerResult enable_pcsuite_handler(DBusConnection *c,
         ULOG_DEBUG_F("entered");
         the_connection = c;
         the_message = m;
-        handle_usb_event(E_ENTER_PCSUITE_MODE);
+        handle_usb_event(PRIMARY_USB_PORT, E_ENTER_PCSUITE_MODE);
         send_reply();
         /* invalidate */
         the_connection = NULL;
@@ -408,7 +437,7 @@ static DBusHandlerResult enable_charging_handler(DBusConnection *c,
         ULOG_DEBUG_F("entered");
         the_connection = c;
         the_message = m;
-        handle_usb_event(E_ENTER_CHARGING_MODE);
+        handle_usb_event(PRIMARY_USB_PORT, E_ENTER_CHARGING_MODE);
         send_reply();
         /* invalidate */
         the_connection = NULL;
@@ -423,7 +452,7 @@ static DBusHandlerResult enable_mass_storage_handler(DBusConnection *c,
         ULOG_DEBUG_F("entered");
         the_connection = c;
         the_message = m;
-        handle_usb_event(E_ENTER_MASS_STORAGE_MODE);
+        handle_usb_event(PRIMARY_USB_PORT, E_ENTER_MASS_STORAGE_MODE);
         send_reply();
         /* invalidate */
         the_connection = NULL;
@@ -431,6 +460,30 @@ static DBusHandlerResult enable_mass_storage_handler(DBusConnection *c,
         return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+static DBusHandlerResult enable_mass_storage_ro_handler(DBusConnection *c,
+                                                        DBusMessage *m,
+                                                        void *data)
+{
+        gint state;
+
+        ULOG_DEBUG_F("entered");
+        the_connection = c;
+        the_message = m;
+        handle_usb_event(PRIMARY_USB_PORT, E_ENTER_MASS_STORAGE_RO_MODE);
+        /* tell the caller if nothing was shared or the state was wrong */
+        state = fsm_get_state(PRIMARY_USB_PORT->fsm);
+        if (state == S_MASS_STORAGE_RO
+            || state == S_PCSUITE_MASS_STORAGE_RO) {
+                send_reply();
+        } else {
+                send_error("not shared");
+        }
+        /* invalidate */
+        the_connection = NULL;
+        the_message = NULL;
+        return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 static void set_usb_mode_key(const char *mode)
 {
         GError* err = NULL;
@@ -444,226 +497,687 @@ static void set_usb_mode_key(const char *mode)
         }
 }
 
-static void handle_usb_event(usb_event_t e)
+/*
+ * USB state machine. Every event first runs its entry action (whatever the
+ * state), then the first matching row of usb_transitions[]. FSM_ANY rows
+ * catch the event in every other state. The ctx of all actions is the
+ * usb_port_t.
+ */
+
+static const gchar * const usb_state_names[] = {
+        [S_INVALID_USB_STATE] = "S_INVALID_USB_STATE",
+        [S_CABLE_DETACHED] = "S_CABLE_DETACHED",
+        [S_PERIPHERAL_WAIT] = "S_PERIPHERAL_WAIT",
+        [S_HOST] = "S_HOST",
+        [S_EJECTING] = "S_EJECTING",
+        [S_EJECTED] = "S_EJECTED",
+        [S_MASS_STORAGE] = "S_MASS_STORAGE",
+        [S_CHARGING] = "S_CHARGING",
+        [S_PCSUITE] = "S_PCSUITE",
+        [S_PCSUITE_MASS_STORAGE] = "S_PCSUITE_MASS_STORAGE",
+        [S_MASS_STORAGE_RO] = "S_MASS_STORAGE_RO",
+        [S_PCSUITE_MASS_STORAGE_RO] = "S_PCSUITE_MASS_STORAGE_RO",
+};
+
+static gboolean usb_detached_entry(gpointer ctx, gint state, gint event)
+{
+        set_usb_mode_key("idle");
+        inform_usb_cable_attached(FALSE);
+        return TRUE;
+}
+
+static gboolean usb_host_entry(gpointer ctx, gint state, gint event)
+{
+        set_usb_mode_key("host");
+        inform_usb_cable_attached(TRUE);
+        return TRUE;
+}
+
+static gboolean usb_peripheral_wait_entry(gpointer ctx, gint state,
+                                          gint event)
 {
-        switch (e) {
-                case E_CABLE_DETACHED:
-                        set_usb_mode_key("idle");
-                        inform_usb_cable_attached(FALSE);
-                        if (usb_state == S_HOST) {
-                                ULOG_DEBUG_F("E_CABLE_DETACHED in S_HOST");
 #if 0 // MWTODO
-                                dismantle_usb_mount_timeout();
-                                unmount_usb_volumes();
+        /* clear the name */
+        free(usb_device_name);
+        usb_device_name = NULL;
+        update_usb_device_name_key();
 #endif
-                        } else if (usb_state == S_MASS_STORAGE || usb_state == S_PCSUITE || usb_state == S_PCSUITE_MASS_STORAGE) {
-                                if (usb_state == S_MASS_STORAGE || usb_state == S_PCSUITE_MASS_STORAGE) {
-                                        ULOG_DEBUG_F("E_CABLE_DETACHED in"
-                                                     " S_MASS_STORAGE");
+
+        set_usb_mode_key("peripheral");
+        inform_usb_cable_attached(TRUE);
+        return TRUE;
+}
+
+static const fsm_event_t usb_events[] = {
+        [E_CABLE_DETACHED] = { "E_CABLE_DETACHED", usb_detached_entry },
+        [E_EJECT] = { "E_EJECT", NULL },
+        [E_EJECT_CANCELLED] = { "E_EJECT_CANCELLED", NULL },
+        [E_ENTER_HOST_MODE] = { "E_ENTER_HOST_MODE", usb_host_entry },
+        [E_ENTER_PERIPHERAL_WAIT_MODE] = { "E_ENTER_PERIPHERAL_WAIT_MODE",
+                                           usb_peripheral_wait_entry },
+        [E_ENTER_MASS_STORAGE_MODE] = { "E_ENTER_MASS_STORAGE_MODE", NULL },
+        [E_ENTER_CHARGING_MODE] = { "E_ENTER_CHARGING_MODE", NULL },
+        [E_ENTER_PCSUITE_MODE] = { "E_ENTER_PCSUITE_MODE", NULL },
+        [E_ENTER_MASS_STORAGE_RO_MODE] = { "E_ENTER_MASS_STORAGE_RO_MODE",
+                                           NULL },
+};
+
+/* The event is not expected in this state */
+static gboolean usb_improper(gpointer ctx, gint state, gint event)
+{
+        ULOG_WARN_F("%s in %s!", usb_events[event].name,
+                    usb_state_names[state]);
+        return TRUE;
+}
+
+/* Same, for method calls that expect a reply */
+static gboolean usb_improper_reply(gpointer ctx, gint state, gint event)
+{
+        usb_improper(ctx, state, event);
+        send_error("improper state");
+        return FALSE;
+}
+
+static gboolean usb_detached_host(gpointer ctx, gint state, gint event)
+{
 #if 0 // MWTODO
-                                        handle_event(E_DETACHED, &ext_mmc, NULL);
-                                        if (int_mmc_enabled) {
-                                                handle_event(E_DETACHED, &int_mmc,
-                                                             NULL);
-                                        }
-                                        if (ext_mmc.whole_device != NULL
-                                            || int_mmc.whole_device != NULL) {
-                                                display_dialog(
-                                                        MSG_USB_DISCONNECTED);
-                                        }
+        dismantle_usb_mount_timeout();
+        unmount_usb_volumes();
 #endif
+        return TRUE;
+}
+
+static void usb_cards_returned(int status, gpointer data)
+{
+        if (status != 0) {
+                ULOG_WARN_F("not all cards came back from USB: %d",
+                            status);
+        }
+        display_dialog(MSG_USB_DISCONNECTED);
+}
+
+static gboolean usb_detached_mass_storage(gpointer ctx, gint state,
+                                          gint event)
+{
 #if 0 // MWTODO
-                                        display_dialog(
-                                                MSG_USB_DISCONNECTED);
+        exec_join_t *join;
+
+        if (ext_mmc.whole_device == NULL
+            && (!int_mmc_enabled || int_mmc.whole_device == NULL)) {
+                return TRUE;
+        }
+
+        /* both cards are released, checked and mounted at the same time,
+         * the notification waits for the two */
+        join = exec_join_new(usb_cards_returned, NULL);
+        if (ext_mmc.whole_device != NULL) {
+                run_usb_return(&ext_mmc, join);
+        }
+        if (int_mmc_enabled && int_mmc.whole_device != NULL) {
+                run_usb_return(&int_mmc, join);
+        }
+        exec_join_close(join);
 #endif
-                                }
-                                if (usb_state == S_PCSUITE || usb_state == S_PCSUITE_MASS_STORAGE) {
-                                        ULOG_INFO_F("E_CABLE_DETACHED in S_PCSUITE");
-                                        if (!disable_pcsuite()) {
-                                                ULOG_ERR_F("disable_pcsuite() failed");
-                                        }
-                                }
-                        } else if (usb_state == S_EJECTED) {
-                                ULOG_DEBUG_F("E_CABLE_DETACHED in S_EJECTED");
-                        } else if (usb_state == S_EJECTING) {
-                                ULOG_INFO_F("E_CABLE_DETACHED in S_EJECTING");
+        return TRUE;
+}
+
+static void pcsuite_disabled(int status, gpointer data)
+{
+        if (status != 0) {
+                ULOG_ERR_F("disable_pcsuite() failed: %d", status);
+        }
+}
+
+/* The scripts run in the background, only their queuing is timed */
+static gboolean usb_detached_pcsuite(gpointer ctx, gint state, gint event)
+{
+        disable_pcsuite(pcsuite_disabled, NULL);
+        return TRUE;
+}
+
+static gboolean usb_detached_pcsuite_mass_storage(gpointer ctx, gint state,
+                                                  gint event)
+{
+        gboolean ok;
+
+        ok = usb_detached_mass_storage(ctx, state, event);
+        return usb_detached_pcsuite(ctx, state, event) && ok;
+}
+
+static gboolean usb_detached_ejecting(gpointer ctx, gint state, gint event)
+{
 #if 0 // MWTODO
-                                dismantle_usb_unmount_pending();
-                                unmount_usb_volumes();
+        dismantle_usb_unmount_pending();
+        unmount_usb_volumes();
 #endif
-                        } else if (usb_state == S_PERIPHERAL_WAIT) {
-                                ULOG_INFO_F("E_CABLE_DETACHED in "
-                                            "S_PERIPHERAL_WAIT");
-                                /* in case e_plugged_helper failed when we
-                                 * tried enabling mass storage, we need to
-                                 * remount the cards */
-                                usb_state = S_MASS_STORAGE;
+        return TRUE;
+}
+
+static gboolean usb_detached_peripheral_wait(gpointer ctx, gint state,
+                                             gint event)
+{
+        /* in case e_plugged_helper failed when we tried enabling mass
+         * storage, we need to remount the cards */
 #if 0 // MWTODO
-                                handle_event(E_DETACHED, &ext_mmc, NULL);
-                                if (int_mmc_enabled) {
-                                        handle_event(E_DETACHED, &int_mmc,
-                                                     NULL);
-                                }
+        handle_event(E_DETACHED, &ext_mmc, NULL);
+        if (int_mmc_enabled) {
+                handle_event(E_DETACHED, &int_mmc, NULL);
+        }
 #endif
-                        } else if (usb_state == S_CHARGING) {
-                                ULOG_INFO_F("E_CABLE_DETACHED in "
-                                            "S_CHARGING");
-                        } else {
-                                ULOG_WARN_F("E_CABLE_DETACHED in %d!",
-                                            usb_state);
-                        }
-                        usb_state = S_CABLE_DETACHED;
-                        break;
-                case E_EJECT:
-                        if (usb_state == S_HOST) {
-                                ULOG_DEBUG_F("E_EJECT in S_HOST");
+        return TRUE;
+}
+
+static gboolean usb_eject_host(gpointer ctx, gint state, gint event)
+{
 #if 0 // MWTODO
-                                dismantle_usb_mount_timeout();
+        dismantle_usb_mount_timeout();
 #endif
-                                send_reply();
+        send_reply();
 #if 0 // MWTODO
-                                usb_state = try_eject();
+        usb_state = try_eject();
 #endif
-                        } else if (usb_state == S_EJECTING) {
-                                ULOG_DEBUG_F("E_EJECT in S_EJECTING");
-                                send_reply();
+        return TRUE;
+}
+
+static gboolean usb_eject_ejecting(gpointer ctx, gint state, gint event)
+{
+        send_reply();
 #if 0 // MWTODO
-                                if (usb_pending_timer_id == 0) {
-                                        usb_state = try_eject();
-                                } else {
-                                        ULOG_DEBUG_F(
-                                            "polling already set up");
-                                }
+        if (usb_pending_timer_id == 0) {
+                usb_state = try_eject();
+        } else {
+                ULOG_DEBUG_F("polling already set up");
+        }
 #endif
-                        } else {
-                                ULOG_WARN_F("E_EJECT in %d", usb_state);
-                                send_error("improper state");
-                        }
-                        break;
-                case E_EJECT_CANCELLED:
-                        if (usb_state == S_EJECTING) {
-                                ULOG_DEBUG_F("E_EJECT_CANCELLED in"
-                                             " S_EJECTING");
+        return TRUE;
+}
+
+static gboolean usb_eject_cancelled(gpointer ctx, gint state, gint event)
+{
 #if 0 // MWTODO
-                                dismantle_usb_unmount_pending();
+        dismantle_usb_unmount_pending();
 #endif
-                                send_reply();
+        send_reply();
 
-                                /* possibly re-mount already unmounted
-                                 * volumes */
+        /* possibly re-mount already unmounted volumes */
 #if 0 // MW TODO
-                                mount_usb_volumes();
+        mount_usb_volumes();
 #endif
+        return TRUE;
+}
 
-                                usb_state = S_HOST;
-                        } else {
-                                ULOG_WARN_F("E_EJECT_CANCELLED in %d",
-                                            usb_state);
-                                send_error("improper state");
-                        }
-                        break;
-                case E_ENTER_HOST_MODE:
-                        set_usb_mode_key("host");
-                        inform_usb_cable_attached(TRUE);
-                        if (usb_state == S_CABLE_DETACHED) {
-                                ULOG_DEBUG_F("E_ENTER_HOST_MODE in "
-                                             "S_CABLE_DETACHED");
-                                /* mounting happens later when the volumes
-                                 * are detected */
-#if 0 // MWTODO
-                                setup_usb_mount_timeout(15);
-#endif
-                                usb_state = S_HOST;
-                        } else {
-                                ULOG_WARN_F("E_ENTER_HOST_MODE in %d!",
-                                            usb_state);
-                        }
-                        break;
-                case E_ENTER_PERIPHERAL_WAIT_MODE:
+static gboolean usb_enter_host(gpointer ctx, gint state, gint event)
+{
+        /* mounting happens later when the volumes are detected */
 #if 0 // MWTODO
-                        /* clear the name */
-                        free(usb_device_name);
-                        usb_device_name = NULL;
-                        update_usb_device_name_key();
+        setup_usb_mount_timeout(15);
 #endif
+        return TRUE;
+}
 
-                        set_usb_mode_key("peripheral");
-                        inform_usb_cable_attached(TRUE);
-                        if (usb_state == S_CABLE_DETACHED ||
-                            usb_state == S_PERIPHERAL_WAIT) {
-                                /* we could be in S_PERIPHERAL_WAIT already
-                                 * because of the device lock */
-                                ULOG_DEBUG_F("E_ENTER_PERIPHERAL_WAIT_MODE"
-                                             " in S_CABLE_DETACHED or "
-                                             "S_PERIPHERAL_WAIT");
-                                usb_state = S_PERIPHERAL_WAIT;
-                        } else {
-                                ULOG_WARN_F("E_ENTER_PERIPHERAL_WAIT_MODE"
-                                            " in %d!", usb_state);
-                        }
-                        break;
-                case E_ENTER_MASS_STORAGE_MODE:
-                        if (usb_state == S_PERIPHERAL_WAIT ||
-                            usb_state == S_CHARGING ||
-                            usb_state == S_PCSUITE) {
-                                usb_state_t orig = usb_state;
-                                if (usb_state == S_PCSUITE)
-                                        usb_state = S_PCSUITE_MASS_STORAGE;
-                                else
-                                        usb_state = S_MASS_STORAGE;
+/* Failing means no card was USB shared or the cable was disconnected, and
+ * there is no real state change */
+static gboolean usb_enter_mass_storage(gpointer ctx, gint state, gint event)
+{
 #if 0 // MWTODO: this actually sets up mass storage
-                                if (!e_plugged_helper()) {
+        if (!e_plugged_helper()) {
+                ULOG_DEBUG_F("no card was USB shared"
+                             " or cable disconnected");
+                return FALSE;
+        }
 #endif
-                                if (FALSE) {
-                                        ULOG_DEBUG_F("no card was USB shared"
-                                                     " or cable disconnected");
-                                        /* no real state change if no card was
-                                         * successful */
-                                        usb_state = orig;
-                                }
-                        } else {
-                                ULOG_WARN_F("E_ENTER_MASS_STORAGE_MODE in %d!",
-                                            usb_state);
-                        }
-                        break;
-                case E_ENTER_PCSUITE_MODE:
-                        if (usb_state == S_PERIPHERAL_WAIT ||
-                            usb_state == S_CHARGING ||
-                            usb_state == S_CABLE_DETACHED ||
-                            usb_state == S_MASS_STORAGE) {
-                                if (usb_state == S_MASS_STORAGE)
-                                        usb_state = S_PCSUITE_MASS_STORAGE;
-                                else
-                                        usb_state = S_PCSUITE;
-                                if (!enable_pcsuite()) {
-                                        ULOG_ERR_F("Couldn't enable PC Suite");
-                                }
-                        } else {
-                                ULOG_WARN_F("E_ENTER_PCSUITE_MODE in %d!",
-                                            usb_state);
-                        }
-                        break;
-                case E_ENTER_CHARGING_MODE:
-                        if (usb_state == S_PERIPHERAL_WAIT) {
-                                usb_state = S_CHARGING;
-                        } else {
-                                ULOG_WARN_F("E_ENTER_CHARGING_MODE in %d!",
-                                            usb_state);
-                        }
-                        break;
-                default:
-                        ULOG_ERR_F("unknown event %d", e);
+        return TRUE;
+}
+
+/* The cards stay mounted, read-only, while the host reads them. Failing
+ * means nothing could be remounted and shared. */
+static gboolean usb_enter_mass_storage_ro(gpointer ctx, gint state,
+                                          gint event)
+{
+        if (!usb_share_ro_enable()) {
+                ULOG_WARN_F("nothing could be shared read-only");
+                return FALSE;
+        }
+        return TRUE;
+}
+
+/* Both cards are released and remounted at the same time, the
+ * notification waits for the two */
+static gboolean usb_detached_mass_storage_ro(gpointer ctx, gint state,
+                                             gint event)
+{
+        exec_join_t *join;
+
+        join = exec_join_new(usb_cards_returned, NULL);
+        run_usb_share_return(join);
+        exec_join_close(join);
+        return TRUE;
+}
+
+static gboolean usb_detached_pcsuite_mass_storage_ro(gpointer ctx,
+                                                     gint state, gint event)
+{
+        usb_detached_mass_storage_ro(ctx, state, event);
+        return usb_detached_pcsuite(ctx, state, event);
+}
+
+static void pcsuite_enabled(int status, gpointer data)
+{
+        if (status != 0) {
+                ULOG_ERR_F("Couldn't enable PC Suite: %d", status);
+        }
+}
+
+static gboolean usb_enter_pcsuite(gpointer ctx, gint state, gint event)
+{
+        enable_pcsuite(pcsuite_enabled, NULL);
+        return TRUE;
+}
+
+/* There is one gadget, bound to the first UDC. Only the primary port
+ * drives it, so that a second port cannot enable or tear down the PC
+ * Suite network that the first one uses. */
+static gboolean usb_port_lacks_gadget(gpointer ctx, gint state, gint event)
+{
+        return ctx != PRIMARY_USB_PORT;
+}
+
+static const fsm_transition_t usb_transitions[] = {
+        /* state, event, guard, action, next, next if the action failed */
+        { S_HOST, E_CABLE_DETACHED, NULL, usb_detached_host,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_MASS_STORAGE, E_CABLE_DETACHED, NULL, usb_detached_mass_storage,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_PCSUITE, E_CABLE_DETACHED, NULL, usb_detached_pcsuite,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_PCSUITE_MASS_STORAGE, E_CABLE_DETACHED, NULL,
+          usb_detached_pcsuite_mass_storage,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_MASS_STORAGE_RO, E_CABLE_DETACHED, NULL,
+          usb_detached_mass_storage_ro,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_PCSUITE_MASS_STORAGE_RO, E_CABLE_DETACHED, NULL,
+          usb_detached_pcsuite_mass_storage_ro,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_EJECTED, E_CABLE_DETACHED, NULL, NULL,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_EJECTING, E_CABLE_DETACHED, NULL, usb_detached_ejecting,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_PERIPHERAL_WAIT, E_CABLE_DETACHED, NULL,
+          usb_detached_peripheral_wait,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { S_CHARGING, E_CABLE_DETACHED, NULL, NULL,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+        { FSM_ANY, E_CABLE_DETACHED, NULL, usb_improper,
+          S_CABLE_DETACHED, S_CABLE_DETACHED },
+
+        { S_HOST, E_EJECT, NULL, usb_eject_host, FSM_SAME, FSM_SAME },
+        { S_EJECTING, E_EJECT, NULL, usb_eject_ejecting, FSM_SAME, FSM_SAME },
+        { FSM_ANY, E_EJECT, NULL, usb_improper_reply, FSM_SAME, FSM_SAME },
+
+        { S_EJECTING, E_EJECT_CANCELLED, NULL, usb_eject_cancelled,
+          S_HOST, S_HOST },
+        { FSM_ANY, E_EJECT_CANCELLED, NULL, usb_improper_reply,
+          FSM_SAME, FSM_SAME },
+
+        { S_CABLE_DETACHED, E_ENTER_HOST_MODE, NULL, usb_enter_host,
+          S_HOST, S_HOST },
+        { FSM_ANY, E_ENTER_HOST_MODE, NULL, usb_improper,
+          FSM_SAME, FSM_SAME },
+
+        /* we could be in S_PERIPHERAL_WAIT already because of the device
+         * lock */
+        { S_CABLE_DETACHED, E_ENTER_PERIPHERAL_WAIT_MODE, NULL, NULL,
+          S_PERIPHERAL_WAIT, S_PERIPHERAL_WAIT },
+        { S_PERIPHERAL_WAIT, E_ENTER_PERIPHERAL_WAIT_MODE, NULL, NULL,
+          S_PERIPHERAL_WAIT, S_PERIPHERAL_WAIT },
+        { FSM_ANY, E_ENTER_PERIPHERAL_WAIT_MODE, NULL, usb_improper,
+          FSM_SAME, FSM_SAME },
+
+        { S_PERIPHERAL_WAIT, E_ENTER_MASS_STORAGE_MODE, NULL,
+          usb_enter_mass_storage, S_MASS_STORAGE, FSM_SAME },
+        { S_CHARGING, E_ENTER_MASS_STORAGE_MODE, NULL,
+          usb_enter_mass_storage, S_MASS_STORAGE, FSM_SAME },
+        { S_PCSUITE, E_ENTER_MASS_STORAGE_MODE, NULL,
+          usb_enter_mass_storage, S_PCSUITE_MASS_STORAGE, FSM_SAME },
+        { FSM_ANY, E_ENTER_MASS_STORAGE_MODE, NULL, usb_improper,
+          FSM_SAME, FSM_SAME },
+
+        { S_PERIPHERAL_WAIT, E_ENTER_MASS_STORAGE_RO_MODE, NULL,
+          usb_enter_mass_storage_ro, S_MASS_STORAGE_RO, FSM_SAME },
+        { S_CHARGING, E_ENTER_MASS_STORAGE_RO_MODE, NULL,
+          usb_enter_mass_storage_ro, S_MASS_STORAGE_RO, FSM_SAME },
+        { S_PCSUITE, E_ENTER_MASS_STORAGE_RO_MODE, NULL,
+          usb_enter_mass_storage_ro, S_PCSUITE_MASS_STORAGE_RO, FSM_SAME },
+        { FSM_ANY, E_ENTER_MASS_STORAGE_RO_MODE, NULL, usb_improper,
+          FSM_SAME, FSM_SAME },
+
+        /* A host on another port leaves it as it is */
+        { FSM_ANY, E_ENTER_PCSUITE_MODE, usb_port_lacks_gadget, NULL,
+          FSM_SAME, FSM_SAME },
+        /* The state changes even if PC Suite could not be enabled */
+        { S_PERIPHERAL_WAIT, E_ENTER_PCSUITE_MODE, NULL, usb_enter_pcsuite,
+          S_PCSUITE, S_PCSUITE },
+        { S_CHARGING, E_ENTER_PCSUITE_MODE, NULL, usb_enter_pcsuite,
+          S_PCSUITE, S_PCSUITE },
+        { S_CABLE_DETACHED, E_ENTER_PCSUITE_MODE, NULL, usb_enter_pcsuite,
+          S_PCSUITE, S_PCSUITE },
+        { S_MASS_STORAGE, E_ENTER_PCSUITE_MODE, NULL, usb_enter_pcsuite,
+          S_PCSUITE_MASS_STORAGE, S_PCSUITE_MASS_STORAGE },
+        { S_MASS_STORAGE_RO, E_ENTER_PCSUITE_MODE, NULL, usb_enter_pcsuite,
+          S_PCSUITE_MASS_STORAGE_RO, S_PCSUITE_MASS_STORAGE_RO },
+        /* check_usb_cable() asks again on every cable event, the share
+         * stays until the cable goes */
+        { S_PCSUITE_MASS_STORAGE_RO, E_ENTER_PCSUITE_MODE, NULL, NULL,
+          FSM_SAME, FSM_SAME },
+        { FSM_ANY, E_ENTER_PCSUITE_MODE, NULL, usb_improper,
+          FSM_SAME, FSM_SAME },
+
+        { S_PERIPHERAL_WAIT, E_ENTER_CHARGING_MODE, NULL, NULL,
+          S_CHARGING, S_CHARGING },
+        { FSM_ANY, E_ENTER_CHARGING_MODE, NULL, usb_improper,
+          FSM_SAME, FSM_SAME },
+};
+
+static const fsm_def_t usb_fsm_def = {
+        .name = "usb",
+        .states = usb_state_names,
+        .n_states = G_N_ELEMENTS(usb_state_names),
+        .events = usb_events,
+        .n_events = G_N_ELEMENTS(usb_events),
+        .transitions = usb_transitions,
+        .n_transitions = G_N_ELEMENTS(usb_transitions),
+};
+
+static void handle_usb_event(usb_port_t *p, usb_event_t e)
+{
+        fsm_dispatch(p->fsm, e);
+}
+
+static const gchar *usb_port_name(const usb_port_t *p)
+{
+        return p->port != NULL ? uh_port_get_name(p->port) : "usb";
+}
+
+/* Replies with one (port, state, event, next state, count, failures,
+ * p50 us, p99 us) struct per transition table row of every port, then
+ * one (port, uevents, coalesced, callbacks) struct per udev-helper port */
+static DBusHandlerResult usb_fsm_stats_handler(DBusConnection *c,
+                                               DBusMessage *m,
+                                               void *data)
+{
+        DBusMessage *reply;
+        DBusMessageIter iter, array, entry;
+        guint i, j;
+
+        reply = dbus_message_new_method_return(m);
+        if (reply == NULL) {
+                ULOG_ERR_F("couldn't create reply");
+                return DBUS_HANDLER_RESULT_NEED_MEMORY;
+        }
+
+        dbus_message_iter_init_append(reply, &iter);
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+                                         "(ssssuuuu)", &array);
+        for (i = 0; i < n_usb_ports; i++) {
+                const char *port = usb_port_name(&usb_ports[i]);
+
+                for (j = 0; j < G_N_ELEMENTS(usb_transitions); j++) {
+                        const fsm_transition_t *t = &usb_transitions[j];
+                        fsm_edge_stats_t stats;
+                        const char *from, *event, *to;
+                        dbus_uint32_t v[4];
+                        int k;
+
+                        fsm_get_edge_stats(usb_ports[i].fsm, j, &stats);
+                        from = t->state == FSM_ANY ? "*" :
+                                usb_state_names[t->state];
+                        event = usb_events[t->event].name;
+                        to = t->next == FSM_SAME ? "=" :
+                                usb_state_names[t->next];
+                        v[0] = stats.count;
+                        v[1] = stats.failures;
+                        v[2] = stats.p50_us;
+                        v[3] = stats.p99_us;
+
+                        dbus_message_iter_open_container(&array,
+                                DBUS_TYPE_STRUCT, NULL, &entry);
+                        dbus_message_iter_append_basic(&entry,
+                                DBUS_TYPE_STRING, &port);
+                        dbus_message_iter_append_basic(&entry,
+                                DBUS_TYPE_STRING, &from);
+                        dbus_message_iter_append_basic(&entry,
+                                DBUS_TYPE_STRING, &event);
+                        dbus_message_iter_append_basic(&entry,
+                                DBUS_TYPE_STRING, &to);
+                        for (k = 0; k < 4; k++)
+                                dbus_message_iter_append_basic(&entry,
+                                        DBUS_TYPE_UINT32, &v[k]);
+                        dbus_message_iter_close_container(&array, &entry);
+                }
+        }
+        dbus_message_iter_close_container(&iter, &array);
+
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(suuu)",
+                                         &array);
+        for (i = 0; i < n_usb_ports; i++) {
+                const char *port;
+                dbus_uint32_t v[3];
+                int k;
+
+                if (usb_ports[i].port == NULL)
+                        continue;
+                port = uh_port_get_name(usb_ports[i].port);
+                uh_port_get_stats(usb_ports[i].port, &v[0], &v[1], &v[2]);
+
+                dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+                                                 NULL, &entry);
+                dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+                                               &port);
+                for (k = 0; k < 3; k++)
+                        dbus_message_iter_append_basic(&entry,
+                                DBUS_TYPE_UINT32, &v[k]);
+                dbus_message_iter_close_container(&array, &entry);
+        }
+        dbus_message_iter_close_container(&iter, &array);
+
+        if (!dbus_connection_send(c, reply, NULL)) {
+                ULOG_ERR_F("sending failed");
+        }
+        dbus_message_unref(reply);
+        return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult mmc_holders_handler(DBusConnection *c,
+                                             DBusMessage *m,
+                                             void *data)
+{
+        DBusMessage *reply;
+        DBusMessageIter iter, array, entry;
+        const char *mount_point = NULL;
+        const MountEntry *mount;
+        GPtrArray *holders;
+        dbus_uint32_t last = 0;
+        guint i;
+
+        if (!dbus_message_get_args(m, NULL, DBUS_TYPE_STRING, &mount_point,
+                                   DBUS_TYPE_INVALID)) {
+                the_connection = c;
+                the_message = m;
+                send_error("mount point argument missing");
+                the_connection = NULL;
+                the_message = NULL;
+                return DBUS_HANDLER_RESULT_HANDLED;
+        }
+
+        /* the scan reads the files of every process synchronously, so
+         * only mounts of a block device are looked at, and never "/" */
+        mount = mount_table_mount_of(mount_point);
+        if (mount == NULL || mount->rdev == 0
+            || strcmp(mount->mount_point, "/") == 0) {
+                the_connection = c;
+                the_message = m;
+                send_error("not a mount point of a device");
+                the_connection = NULL;
+                the_message = NULL;
+                return DBUS_HANDLER_RESULT_HANDLED;
+        }
+
+        holders = holders_scan(mount_point);
+        if (holders == NULL) {
+                the_connection = c;
+                the_message = m;
+                send_error(mount_point);
+                the_connection = NULL;
+                the_message = NULL;
+                return DBUS_HANDLER_RESULT_HANDLED;
+        }
+        holders_log(mount_point, holders);
+
+        reply = dbus_message_new_method_return(m);
+        if (reply == NULL) {
+                ULOG_ERR_F("couldn't create reply");
+                g_ptr_array_unref(holders);
+                return DBUS_HANDLER_RESULT_NEED_MEMORY;
+        }
+
+        dbus_message_iter_init_append(reply, &iter);
+        /* no paths: any caller on the system bus gets the reply, and
+         * the file names may be other users' */
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(us)",
+                                         &array);
+        for (i = 0; i < holders->len; i++) {
+                const Holder *h = g_ptr_array_index(holders, i);
+                dbus_uint32_t pid = h->pid;
+
+                /* sorted by pid, one entry per process */
+                if (i > 0 && pid == last) {
+                        continue;
+                }
+                last = pid;
+                dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+                                                 NULL, &entry);
+                dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32,
+                                               &pid);
+                dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+                                               &h->comm);
+                dbus_message_iter_close_container(&array, &entry);
+        }
+        dbus_message_iter_close_container(&iter, &array);
+        g_ptr_array_unref(holders);
+
+        if (!dbus_connection_send(c, reply, NULL)) {
+                ULOG_ERR_F("sending failed");
+        }
+        dbus_message_unref(reply);
+        return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult mount_info_handler(DBusConnection *c,
+                                            DBusMessage *m,
+                                            void *data)
+{
+        DBusMessage *reply;
+        const char *name = NULL;
+        const MountEntry *e;
+
+        if (!dbus_message_get_args(m, NULL, DBUS_TYPE_STRING, &name,
+                                   DBUS_TYPE_INVALID)) {
+                the_connection = c;
+                the_message = m;
+                send_error("device or mount point argument missing");
+                the_connection = NULL;
+                the_message = NULL;
+                return DBUS_HANDLER_RESULT_HANDLED;
+        }
+
+        e = mount_table_find_device(name);
+        if (e == NULL) {
+                e = mount_table_mount_of(name);
+        }
+        if (e == NULL) {
+                the_connection = c;
+                the_message = m;
+                send_error(name);
+                the_connection = NULL;
+                the_message = NULL;
+                return DBUS_HANDLER_RESULT_HANDLED;
+        }
+
+        reply = dbus_message_new_method_return(m);
+        if (reply == NULL) {
+                ULOG_ERR_F("couldn't create reply");
+                return DBUS_HANDLER_RESULT_NEED_MEMORY;
+        }
+        dbus_message_append_args(reply, DBUS_TYPE_STRING, &e->device,
+                                 DBUS_TYPE_STRING, &e->mount_point,
+                                 DBUS_TYPE_STRING, &e->fstype,
+                                 DBUS_TYPE_INVALID);
+
+        if (!dbus_connection_send(c, reply, NULL)) {
+                ULOG_ERR_F("sending failed");
+        }
+        dbus_message_unref(reply);
+        return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Logs the transitions that were taken, e.g. on exit */
+static void log_usb_fsm_stats(const usb_port_t *p)
+{
+        fsm_edge_stats_t stats;
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS(usb_transitions); i++) {
+                const fsm_transition_t *t = &usb_transitions[i];
+
+                fsm_get_edge_stats(p->fsm, i, &stats);
+                if (stats.count == 0)
+                        continue;
+                ULOG_INFO_L("usb port %s %s in %s: %u times, %u failed, "
+                            "p50 %u us, p99 %u us", usb_port_name(p),
+                            usb_events[t->event].name,
+                            t->state == FSM_ANY ? "*" :
+                            usb_state_names[t->state],
+                            stats.count, stats.failures,
+                            stats.p50_us, stats.p99_us);
         }
 }
 
 static gboolean init_usb_cable_status(gpointer data)
 {
-    check_usb_cable();
-    usb_state = get_usb_state();
-    handle_usb_event(E_ENTER_PCSUITE_MODE);
+    guint i;
+
+    for (i = 0; i < n_usb_ports; i++) {
+        usb_port_t *p = &usb_ports[i];
+
+        check_usb_cable(p);
+        fsm_set_state(p->fsm, get_port_usb_state(p));
+        handle_usb_event(p, E_ENTER_PCSUITE_MODE);
+    }
     return TRUE;
 }
 
+/* One state machine per port, or a single one without a port if
+ * udev-helper could not be set up */
+static void init_usb_ports(gboolean uh_ok)
+{
+        guint i;
+
+        n_usb_ports = uh_ok ? uh_get_port_count() : 0;
+        if (n_usb_ports == 0) {
+                usb_ports = g_new0(usb_port_t, 1);
+                n_usb_ports = 1;
+        } else {
+                usb_ports = g_new0(usb_port_t, n_usb_ports);
+                for (i = 0; i < n_usb_ports; i++)
+                        usb_ports[i].port = uh_get_port(i);
+        }
+
+        for (i = 0; i < n_usb_ports; i++)
+                usb_ports[i].fsm = fsm_new(&usb_fsm_def, S_INVALID_USB_STATE,
+                                           &usb_ports[i]);
+}
+
 static void sigterm(int signo)
 {
         g_main_loop_quit(mainloop);
@@ -673,6 +1187,7 @@ static void sigterm(int signo)
 int main(int argc, char* argv[])
 {
         gboolean uh_ok = FALSE;
+        guint i;
 
         DBusError error;
         DBusConnection *conn = NULL;
@@ -684,10 +1199,19 @@ int main(int argc, char* argv[])
         if (signal(SIGTERM, sigterm) == SIG_ERR) {
                 ULOG_CRIT_L("signal() failed");
         }
+        /* before libosso or anything else gets to start threads */
+        if (!reaper_init()) {
+                ULOG_CRIT_L("reaper_init() failed");
+        }
 
         mainloop = g_main_loop_new(NULL, TRUE);
         ULOG_OPEN(APPL_NAME);
 
+        if (!mount_table_init()) {
+                ULOG_WARN_L("mount_table_init() failed, mountinfo is read "
+                            "on every query");
+        }
+
         dbus_error_init(&error);
 
         if (setlocale(LC_ALL, "") == NULL) {
@@ -779,20 +1303,43 @@ int main(int argc, char* argv[])
         vtable.message_function = enable_mass_storage_handler;
         register_op(sys_conn, &vtable, ENABLE_MASS_STORAGE_OP, NULL);
 
+        /* D-Bus interface for read-only USB mass storage mode */
+        vtable.message_function = enable_mass_storage_ro_handler;
+        register_op(sys_conn, &vtable, ENABLE_MASS_STORAGE_RO_OP, NULL);
+
         /* D-Bus interface for charging mode selection */
         vtable.message_function = enable_charging_handler;
         register_op(sys_conn, &vtable, ENABLE_CHARGING_OP, NULL);
 
+        /* D-Bus interface for USB state machine statistics */
+        vtable.message_function = usb_fsm_stats_handler;
+        register_op(sys_conn, &vtable, USB_FSM_STATS_OP, NULL);
+
+        /* D-Bus interface for finding what keeps a card busy */
+        vtable.message_function = mmc_holders_handler;
+        register_op(sys_conn, &vtable, MMC_HOLDERS_OP, NULL);
+        vtable.message_function = mount_info_handler;
+        register_op(sys_conn, &vtable, MOUNT_INFO_OP, NULL);
+
         if (uh_init() != 0) {
             ULOG_WARN_L("uh_init() failed, usb otg events will not work");
         } else {
             uh_ok = TRUE;
         }
 
+        umount_engine_set_notify(inform_pre_unmount);
+
+        init_usb_ports(uh_ok);
+        /* before the first mode switch, which then only rebinds the UDC */
+        if (!usb_gadget_prestage()) {
+                ULOG_INFO_L("no configfs gadgets, using the gadget scripts");
+        }
         init_usb_cable_status(NULL);
 
-        if (uh_ok) {
-            uh_set_callback((UhCallback)uh_callback, NULL);
+        for (i = 0; i < n_usb_ports; i++) {
+                if (usb_ports[i].port != NULL)
+                        uh_port_set_callback(usb_ports[i].port, uh_callback,
+                                             &usb_ports[i]);
         }
 
         kbd_slide_monitor_start();
@@ -800,6 +1347,19 @@ int main(int argc, char* argv[])
         g_main_loop_run(mainloop);
         ULOG_DEBUG_L("Returned from the main loop");
 
+        for (i = 0; i < n_usb_ports; i++) {
+                guint events, absorbed, callbacks;
+                log_usb_fsm_stats(&usb_ports[i]);
+                if (usb_ports[i].port == NULL)
+                        continue;
+                uh_port_get_stats(usb_ports[i].port, &events, &absorbed,
+                                  &callbacks);
+                ULOG_INFO_L("usb port %s uevents: %u, coalesced: %u, "
+                            "callbacks: %u",
+                            uh_port_get_name(usb_ports[i].port),
+                            events, absorbed, callbacks);
+        }
+
         kbd_slide_monitor_stop();
 
         exit(0);
@@ -122,6 +122,12 @@ extern "C" {
 #define LOWMEM_OFF_SIGNAL_IF "com.nokia.ke_recv.lowmem_off"
 #define LOWMEM_OFF_SIGNAL_OP "/com/nokia/ke_recv/lowmem_off"
 
+/* sent on the session bus before a card is unmounted, with its mount
+ * point, so that applications close their files on it */
+#define PRE_UNMOUNT_SIGNAL_NAME "pre_unmount"
+#define PRE_UNMOUNT_SIGNAL_IF "com.nokia.ke_recv.pre_unmount"
+#define PRE_UNMOUNT_SIGNAL_OP "/com/nokia/ke_recv/pre_unmount"
+
 /* user lowmem signal */
 #define USER_LOWMEM_OFF_SIGNAL_OP "/com/nokia/ke_recv/user_lowmem_off"
 #define USER_LOWMEM_OFF_SIGNAL_IF "com.nokia.ke_recv.user_lowmem_off"
@@ -153,8 +159,19 @@ extern "C" {
 /* PC suite, mass storage, charging request */
 #define ENABLE_PCSUITE_OP "/com/nokia/ke_recv/enable_pcsuite"
 #define ENABLE_MASS_STORAGE_OP "/com/nokia/ke_recv/enable_mass_storage"
+#define ENABLE_MASS_STORAGE_RO_OP "/com/nokia/ke_recv/enable_mass_storage_ro"
 #define ENABLE_CHARGING_OP "/com/nokia/ke_recv/enable_charging"
 
+/* USB state machine transition statistics and uevent settle counters */
+#define USB_FSM_STATS_OP "/com/nokia/ke_recv/usb_fsm_stats"
+
+/* Processes holding files on a mount, argument: mount point of a block
+ * device other than "/". Replies a(us) of pid and command name. */
+#define MMC_HOLDERS_OP "/com/nokia/ke_recv/mmc_holders"
+
+/* Device, mount point and type of a mount, argument: device or mount point */
+#define MOUNT_INFO_OP "/com/nokia/ke_recv/mount_info"
+
 #define INVALID_DIALOG_RESPONSE -666
 
 typedef enum {
@@ -167,7 +184,9 @@ typedef enum {
         S_MASS_STORAGE,
         S_CHARGING,
         S_PCSUITE,
-        S_PCSUITE_MASS_STORAGE
+        S_PCSUITE_MASS_STORAGE,
+        S_MASS_STORAGE_RO,
+        S_PCSUITE_MASS_STORAGE_RO
 } usb_state_t;
 
 typedef enum {
@@ -176,10 +195,11 @@ typedef enum {
         E_EJECT_CANCELLED,
         E_ENTER_HOST_MODE,
         E_ENTER_PERIPHERAL_WAIT_MODE,
-        /* the three next ones are for USB plugin's requests */
+        /* the four next ones are for USB plugin's requests */
         E_ENTER_MASS_STORAGE_MODE,
         E_ENTER_CHARGING_MODE,
-        E_ENTER_PCSUITE_MODE
+        E_ENTER_PCSUITE_MODE,
+        E_ENTER_MASS_STORAGE_RO_MODE
 } usb_event_t;
 
 typedef enum {
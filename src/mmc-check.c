@@ -32,78 +32,40 @@
 
 #include <osso-log.h>
 #include "ke-recv.h"
+#include "proc-spawn.h"
+#include "reaper.h"
 #include <gtk/gtk.h>
 #include <hildon/hildon-banner.h>
-#include <signal.h>
-
-extern char **environ;
 
 static pid_t child_pid = -1;
 static int pipe_fd = -1;
 static HildonBanner *hildon_banner = NULL;
 static int quick_check = 0;
+static int exit_code = 2;
+static GMainLoop *quick_loop = NULL;
 
-static void sig_handler(int signo)
+/** Called from the main loop when dosfsck has exited. */
+static void check_child_exited(pid_t pid, int status, gpointer data)
 {
-        pid_t ret = -1;
-        int child_status = -1;
-        assert(signo == SIGCHLD);
-
-        ret = waitpid(child_pid, &child_status, 0);
-        if (ret == -1) {
-                exit(1);
-        }
-        if (WIFEXITED(child_status)) {
-                if (WEXITSTATUS(child_status) == 1) {
-                        exit(3);
-                } else if (WEXITSTATUS(child_status) == 2) {
-                        exit(4);
+        if (status == -1) {
+                exit_code = 1;
+        } else if (WIFEXITED(status)) {
+                if (WEXITSTATUS(status) == 1) {
+                        exit_code = 3;
+                } else if (WEXITSTATUS(status) == 2) {
+                        exit_code = 4;
+                } else {
+                        exit_code = 0;
                 }
-                exit(0);
         } else {
-                exit(2);
+                exit_code = 2;
         }
-}
 
-/** Executes a program with arguments in a child process.
-  (Does not catch the SIGCHLD signal.)
-  @param cmd program to execute.
-  @param args array of command line arguments; the last element
-  must be NULL.
-  @return On success, PID of the child; on error, -1.
-*/
-static int no_wait_exec(const char* cmd, const char* args[])
-{
-        pid_t pid = -1;
-        int fd[2];
-        ULOG_DEBUG_F("entered");
-        assert(cmd != NULL);
-        if (pipe(fd) < 0) {
-                ULOG_ERR_F("pipe() failed");
-                return -1;
-        }
-        pid = fork();
-        if (pid < 0) {
-                ULOG_ERR_F("fork() failed");
-                return -1;
-        } else if (pid == 0) {
-                close(fd[0]);
-                if (dup2(fd[1], STDERR_FILENO) != STDERR_FILENO) {
-                        ULOG_ERR_F("dup2() failed");
-                }
-                close(fd[1]);
-                execve(cmd, (char** const) args, environ);
-                /* On success, execve() does not return */
-                ULOG_ERR_F("execve() returned error: %s",
-                           strerror(errno));
-                exit(2);
+        if (quick_loop != NULL) {
+                g_main_loop_quit(quick_loop);
+        } else {
+                gtk_main_quit();
         }
-        ULOG_DEBUG_F("after fork (pid=%d)", pid);
-        assert(pid > 0);
-        child_pid = pid;
-        close(fd[1]);  /* close the writing end */
-        pipe_fd = fd[0];
-        return pid;
 }
 
 /** Reads the output of dosfsck */
@@ -154,7 +116,9 @@ static gboolean start_repair(const char *dev)
                 args[2] = dev;
         }
 
-        if (no_wait_exec(args[0], args) > 0) {
+        child_pid = spawn_prog(args[0], args, &pipe_fd);
+        if (child_pid > 0) {
+                reaper_watch(child_pid, check_child_exited, NULL);
                 if (!quick_check) {
                         /* set up reading from the pipe */
                         GError* err = NULL;
@@ -177,8 +141,6 @@ static gboolean start_repair(const char *dev)
 
 int main(int argc, char* argv[])
 {
-        struct sigaction sa;
-
         ULOG_OPEN("mmc-check");
         ULOG_DEBUG_L("entered");
 
@@ -190,11 +152,8 @@ int main(int argc, char* argv[])
                 quick_check = 1;
         }
 
-        sa.sa_handler = sig_handler;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = SA_RESTART;
-        if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-                ULOG_CRIT_L("could not set SIGCHLD handler");
+        if (!reaper_init()) {
+                ULOG_CRIT_L("could not set up SIGCHLD handling");
                 exit(1);
         }
 
@@ -225,13 +184,14 @@ int main(int argc, char* argv[])
         if (start_repair(argv[1])) {
                 if (quick_check) {
                         ULOG_DEBUG_L("waiting for child");
-                        sleep(20000);  /* FIXME */
+                        quick_loop = g_main_loop_new(NULL, FALSE);
+                        g_main_loop_run(quick_loop);
                 } else {
                         ULOG_DEBUG_L("going to main loop");
                         gtk_main();
-                        ULOG_WARN_L("returned from main loop");
+                        ULOG_DEBUG_L("returned from main loop");
                 }
-                exit(0);
+                exit(exit_code);
         } else {
                 ULOG_CRIT_L("could not start repairing/checking");
                 exit(1);
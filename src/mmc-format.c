@@ -30,12 +30,12 @@
 
 #include "mmc-format.h"
 #include "exec-func.h"
+#include "proc-spawn.h"
+#include "reaper.h"
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <linux/fs.h>
 
-extern char **environ;
-
 /* volume label */
 const char* mmc_volume_label = NULL;
 
@@ -45,50 +45,9 @@ const char* mmc_dev_file_with_part = NULL;
 
 static pid_t child_pid = -1;
 static int pipe_fd = -1;
-static gboolean ignore_child = FALSE;
+static int exit_code = 2;
 static HildonBanner *hildon_banner = NULL;
 
-/** Executes a program with arguments in a child process.
-  (Does not catch the SIGCHLD signal.)
-  @param cmd program to execute.
-  @param args array of command line arguments; the last element
-  must be NULL.
-  @return On success, PID of the child; on error, -1.
-*/
-static int no_wait_exec(const char* cmd, const char* args[])
-{
-        pid_t pid = -1;
-        int fd[2];
-        ULOG_DEBUG_F("entered");
-        assert(cmd != NULL);
-        if (pipe(fd) < 0) {
-                ULOG_ERR_F("pipe() failed");
-                return -1;
-        }
-        pid = fork();
-        if (pid < 0) {
-                ULOG_ERR_F("fork() failed");
-                return -1;
-        } else if (pid == 0) {
-                close(fd[0]);
-                if (dup2(fd[1], STDERR_FILENO) != STDERR_FILENO) {
-                        ULOG_ERR_F("dup2() failed");
-                }
-                close(fd[1]);
-                /* On success, execve() does not return */
-                execve(cmd, (char** const) args, environ);
-                ULOG_ERR_F("execve() returned error: %s",
-                           strerror(errno));
-                exit(-2);
-        }
-        ULOG_DEBUG_F("after fork (pid=%d)", pid);
-        assert(pid > 0);
-        child_pid = pid;
-        close(fd[1]);  /* close the writing end */
-        pipe_fd = fd[0];
-        return pid;
-}
-
 /** Reads the hash marks output by mkdosfs */
 static gboolean gio_func(GIOChannel* ch, GIOCondition cond, gpointer p)
 {
@@ -141,9 +100,7 @@ static gboolean prepare_partition()
         int ret = -1;
 
         args[1] = mmc_dev_file_without_part;
-        ignore_child = TRUE;
         ret = exec_prog(MMC_PARTITIONING_COMMAND, args);
-        ignore_child = FALSE;
 
         if (ret == 0) {
                 return TRUE;
@@ -153,6 +110,23 @@ static gboolean prepare_partition()
         }
 }
 
+/** Called from the main loop when mkdosfs has exited. */
+static void format_child_exited(pid_t pid, int status, gpointer data)
+{
+        if (status == -1) {
+                printf("%s: waitpid() failed\n", __func__);
+                exit_code = 1;
+        } else if (WIFEXITED(status)) {
+                printf("%s: child returned: %d\n", __func__,
+                       WEXITSTATUS(status));
+                exit_code = WEXITSTATUS(status) == 0 ? 0 : 2;
+        } else {
+                printf("%s: child terminated abnormally\n", __func__);
+                exit_code = 2;
+        }
+        gtk_main_quit();
+}
+
 /** Starts the formatting.
   @return true on success, false on error.
 */
@@ -207,7 +181,9 @@ static gboolean start_format()
         }
         args[5] = blk_sz_buf;
 
-        if (no_wait_exec(args[0], args) > 0) {
+        child_pid = spawn_prog(args[0], args, &pipe_fd);
+        if (child_pid > 0) {
+                reaper_watch(child_pid, format_child_exited, NULL);
                 /* set up reading from the pipe */
                 GError* err = NULL;
                 GIOChannel* ch = g_io_channel_unix_new(pipe_fd);
@@ -224,42 +200,8 @@ static gboolean start_format()
         }
 }
 
-/** Handler for SIGCHLD.
-  @param signo not used
-*/
-static void sig_handler(int signo)
-{
-        pid_t ret = -1;
-        int child_status = -1;
-        assert(signo == SIGCHLD);
-        if (ignore_child) {
-                printf("%s: child from exec_prog\n", __func__);
-                return;
-        }
-
-        ret = waitpid(child_pid, &child_status, 0);
-        if (ret == -1) {
-                printf("%s: waitpid() failed\n", __func__);
-                exit(1);
-        }
-        if (WIFEXITED(child_status)) {
-                printf("%s: child returned: %d\n", __func__,
-                       WEXITSTATUS(child_status));
-                if (WEXITSTATUS(child_status) != 0) {
-                        exit(2);
-                }
-                sync();  /* sync before exit */
-                exit(0);
-        } else {
-                printf("%s: child terminated abnormally\n", __func__);
-                exit(2);
-        }
-}
-
 int main(int argc, char* argv[])
 {
-        struct sigaction sa;
-
         ULOG_OPEN(MMC_FORMAT_PROG_NAME);
         ULOG_DEBUG_L("entered");
 
@@ -268,11 +210,8 @@ int main(int argc, char* argv[])
                             " <volume label>");
                 exit(1);
         }
-        sa.sa_handler = sig_handler;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = SA_RESTART;
-        if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-                ULOG_CRIT_L("could not set SIGCHLD handler");
+        if (!reaper_init()) {
+                ULOG_CRIT_L("could not set up SIGCHLD handling");
                 exit(1);
         }
         if (setlocale(LC_ALL, "") == NULL) {
@@ -311,9 +250,11 @@ int main(int argc, char* argv[])
         if (start_format()) {
                 ULOG_DEBUG_L("going to main loop");
                 gtk_main();
-                ULOG_WARN_L("returned from main loop");
-                sync();  /* sync before exit */
-                exit(0);
+                ULOG_DEBUG_L("returned from main loop");
+                if (exit_code == 0) {
+                        sync();  /* sync before exit */
+                }
+                exit(exit_code);
         } else {
                 ULOG_CRIT_L("could not start formatting");
                 exit(1);
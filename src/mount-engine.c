@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <glib.h>
+
+#include "mount-engine.h"
+#include "mount-table.h"
+#include "proc-spawn.h"
+#include "reaper.h"
+
+typedef struct {
+    gchar *device;
+    gchar *mount_point;
+    const gchar *fstype;
+    unsigned long flags;    /* added to the policy's, e.g. MS_RDONLY */
+    gint status;
+    mount_engine_cb_t cb;
+    gpointer data;
+} MountOp;
+
+/* Parsed MOUNT_OPTS_FILE, kept until the file changes */
+static struct {
+    gboolean loaded;
+    gboolean usable;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    GHashTable *vars;
+} policy;
+
+/*
+ * The policy file is sourced by mmc-mount. Plain "name=value" lines are
+ * all it is expected to have; anything needing a shell makes it unusable
+ * here.
+ */
+static gboolean parse_policy(const gchar *contents, GHashTable *vars) {
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gboolean ok = TRUE;
+    guint i;
+
+    for (i = 0; ok && lines[i]; i++) {
+        gchar *line = g_strstrip(lines[i]), *eq, *value;
+        gsize len;
+        const gchar *p;
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        eq = strchr(line, '=');
+        ok = eq && eq != line;
+        for (p = line; ok && p < eq; p++)
+            ok = *p == '_' || g_ascii_isalnum(*p);
+        if (ok && g_ascii_isdigit(*line))
+            ok = FALSE;
+        if (!ok)
+            break;
+
+        value = eq + 1;
+        len = strlen(value);
+        if (len >= 2 && (value[0] == '"' || value[0] == '\'') &&
+            value[len - 1] == value[0]) {
+            value[len - 1] = '\0';
+            value++;
+        } else if (strpbrk(value, " \t\"'")) {
+            ok = FALSE;
+            break;
+        }
+        if (strpbrk(value, "$`\\")) {
+            ok = FALSE;
+            break;
+        }
+
+        *eq = '\0';
+        g_hash_table_replace(vars, g_strdup(line), g_strdup(value));
+    }
+
+    if (!ok)
+        fprintf(stderr, "%s: cannot parse '%s'\n", MOUNT_OPTS_FILE,
+                lines[i]);
+    g_strfreev(lines);
+    return ok;
+}
+
+static gboolean load_policy(void) {
+    gchar *contents = NULL;
+    struct stat st;
+
+    if (stat(MOUNT_OPTS_FILE, &st) != 0) {
+        fprintf(stderr, "Cannot stat %s: %s\n", MOUNT_OPTS_FILE,
+                g_strerror(errno));
+        policy.loaded = FALSE;
+        return FALSE;
+    }
+
+    if (policy.loaded && policy.dev == st.st_dev && policy.ino == st.st_ino &&
+        policy.size == st.st_size &&
+        policy.mtime.tv_sec == st.st_mtim.tv_sec &&
+        policy.mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return policy.usable;
+
+    if (policy.vars)
+        g_hash_table_remove_all(policy.vars);
+    else
+        policy.vars = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            g_free);
+
+    policy.loaded = TRUE;
+    policy.dev = st.st_dev;
+    policy.ino = st.st_ino;
+    policy.size = st.st_size;
+    policy.mtime = st.st_mtim;
+    policy.usable = g_file_get_contents(MOUNT_OPTS_FILE, &contents, NULL,
+                                        NULL) &&
+                    parse_policy(contents, policy.vars);
+
+    g_free(contents);
+    return policy.usable;
+}
+
+static const gchar *policy_get(const gchar *name) {
+    const gchar *value = g_hash_table_lookup(policy.vars, name);
+
+    return value ? value : "";
+}
+
+/* Like mmc-mount: anything but "0" checks, unset included */
+static gboolean policy_fsck(void) {
+    return strcmp(policy_get("user_fsck"), "0") != 0;
+}
+
+static guint16 le16(const guchar *p) {
+    return p[0] | p[1] << 8;
+}
+
+static guint32 le32(const guchar *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (guint32)p[3] << 24;
+}
+
+/* ext2/3/4 superblock fields, at EXT_SB */
+#define EXT_SB 1024
+#define EXT_MAGIC 0xEF53
+#define EXT3_COMPAT_HAS_JOURNAL 0x0004
+/* what ext3 knows: filetype, recover, journal_dev, meta_bg */
+#define EXT3_INCOMPAT_SUPP 0x001E
+/* sparse_super, large_file, btree_dir */
+#define EXT3_RO_COMPAT_SUPP 0x0007
+
+static const gchar *probe_ext(const guchar *sb) {
+    if (le16(sb + 56) != EXT_MAGIC)
+        return NULL;
+
+    if ((le32(sb + 96) & ~EXT3_INCOMPAT_SUPP) ||
+        (le32(sb + 100) & ~EXT3_RO_COMPAT_SUPP))
+        return "ext4";
+    if (le32(sb + 92) & EXT3_COMPAT_HAS_JOURNAL)
+        return "ext3";
+    return "ext2";
+}
+
+static gboolean probe_fat(const guchar *bs) {
+    guint16 sector_size = le16(bs + 11);
+    guchar cluster_sectors = bs[13];
+
+    if (bs[510] != 0x55 || bs[511] != 0xAA)
+        return FALSE;
+    if (bs[0] != 0xEB && bs[0] != 0xE9)
+        return FALSE;
+    if (sector_size < 512 || sector_size > 4096 ||
+        (sector_size & (sector_size - 1)))
+        return FALSE;
+    if (cluster_sectors == 0 || (cluster_sectors & (cluster_sectors - 1)))
+        return FALSE;
+
+    /* number of FATs and reserved sectors */
+    return (bs[16] == 1 || bs[16] == 2) && le16(bs + 14) != 0;
+}
+
+const gchar *mount_engine_probe(const gchar *device) {
+    guchar buf[EXT_SB + 1024];
+    const gchar *type = NULL;
+    ssize_t n;
+    int fd;
+
+    fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", device, g_strerror(errno));
+        return NULL;
+    }
+    n = pread(fd, buf, sizeof(buf), 0);
+    close(fd);
+
+    if (n != sizeof(buf))
+        return NULL;
+
+    if (memcmp(buf + 3, "NTFS    ", 8) == 0)
+        type = "ntfs";
+    else if (memcmp(buf + 3, "EXFAT   ", 8) == 0)
+        type = "exfat";
+    else if (probe_fat(buf))
+        type = "vfat";
+    else
+        type = probe_ext(buf + EXT_SB);
+
+    return type;
+}
+
+/* Whether mount(8) would hand fstype to a helper, e.g. ntfs-3g */
+static gboolean has_mount_helper(const gchar *fstype) {
+    static const gchar *const dirs[] = { "/sbin", "/usr/sbin" };
+    static const gchar *const suffixes[] = { "", "-3g", "-fuse" };
+    gboolean found = FALSE;
+    guint i, j;
+
+    for (i = 0; !found && i < G_N_ELEMENTS(dirs); i++) {
+        for (j = 0; !found && j < G_N_ELEMENTS(suffixes); j++) {
+            gchar *path = g_strdup_printf("%s/mount.%s%s", dirs[i], fstype,
+                                          suffixes[j]);
+
+            found = access(path, X_OK) == 0;
+            g_free(path);
+        }
+    }
+    return found;
+}
+
+/* Whether the kernel has a driver for fstype loaded */
+static gboolean kernel_has_fs(const gchar *fstype) {
+    gchar *contents = NULL, **lines;
+    gboolean found = FALSE;
+    guint i;
+
+    if (!g_file_get_contents("/proc/filesystems", &contents, NULL, NULL))
+        return FALSE;
+
+    /* "nodev\tproc" or "\tvfat" */
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; !found && lines[i]; i++) {
+        const gchar *name = strchr(lines[i], '\t');
+
+        found = name && strcmp(name + 1, fstype) == 0;
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+    return found;
+}
+
+/* Split mount(8) style options into flags and data for mount(2) */
+static void parse_options(const gchar *options, unsigned long *flags,
+                          GString *data) {
+    static const struct {
+        const gchar *name;
+        unsigned long set, clear;
+    } known[] = {
+        { "ro", MS_RDONLY, 0 },
+        { "rw", 0, MS_RDONLY },
+        { "nosuid", MS_NOSUID, 0 },
+        { "suid", 0, MS_NOSUID },
+        { "nodev", MS_NODEV, 0 },
+        { "dev", 0, MS_NODEV },
+        { "noexec", MS_NOEXEC, 0 },
+        { "exec", 0, MS_NOEXEC },
+        { "noatime", MS_NOATIME, 0 },
+        { "atime", 0, MS_NOATIME },
+        { "nodiratime", MS_NODIRATIME, 0 },
+        { "diratime", 0, MS_NODIRATIME },
+        { "relatime", MS_RELATIME, 0 },
+        { "norelatime", 0, MS_RELATIME },
+        { "strictatime", MS_STRICTATIME, 0 },
+        { "sync", MS_SYNCHRONOUS, 0 },
+        { "async", 0, MS_SYNCHRONOUS },
+        { "dirsync", MS_DIRSYNC, 0 },
+    };
+    /* only meaningful to mount(8) and fstab */
+    static const gchar *const ignored[] = {
+        "defaults", "auto", "noauto", "user", "nouser", "users", "owner",
+        "nofail", "_netdev", NULL
+    };
+    gchar **opts = g_strsplit(options, ",", -1);
+    guint i, j;
+
+    for (i = 0; opts[i]; i++) {
+        gboolean found = FALSE;
+
+        if (*opts[i] == '\0' || g_str_has_prefix(opts[i], "x-") ||
+            g_strv_contains(ignored, opts[i]))
+            continue;
+
+        for (j = 0; !found && j < G_N_ELEMENTS(known); j++) {
+            if (strcmp(opts[i], known[j].name) == 0) {
+                *flags = (*flags & ~known[j].clear) | known[j].set;
+                found = TRUE;
+            }
+        }
+        if (found)
+            continue;
+
+        if (data->len > 0)
+            g_string_append_c(data, ',');
+        g_string_append(data, opts[i]);
+    }
+
+    g_strfreev(opts);
+}
+
+/* Value of key in MOUNT_USER_DIRS_FILE, with $HOME expanded */
+static gchar *user_dir(const gchar *contents, const gchar *key) {
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gchar *dir = NULL;
+    guint i;
+
+    for (i = 0; !dir && lines[i]; i++) {
+        gchar *line = g_strstrip(lines[i]), *value;
+        gsize len;
+
+        if (!g_str_has_prefix(line, key) || line[strlen(key)] != '=')
+            continue;
+
+        value = line + strlen(key) + 1;
+        len = strlen(value);
+        if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+            value[len - 1] = '\0';
+            value++;
+        }
+        if (g_str_has_prefix(value, "$HOME/"))
+            dir = g_strconcat("/home/user", value + 5, NULL);
+        else if (*value == '/')
+            dir = g_strdup(value);
+    }
+
+    g_strfreev(lines);
+    return dir;
+}
+
+/* The directories osso-mmc-mount.sh creates on a writable mount */
+static void create_user_dirs(const gchar *mount_point) {
+    static const gchar *const mydocs_keys[] = {
+        "XDG_DOCUMENTS_DIR", "XDG_PICTURES_DIR", "XDG_MUSIC_DIR",
+        "XDG_VIDEOS_DIR", "NOKIA_CAMERA_DIR", NULL
+    };
+    static const gchar *const mmc_keys[] = { "NOKIA_MMC_CAMERA_DIR", NULL };
+    static const gchar *const fallback[] = {
+        ".sounds", ".videos", ".documents", ".images", ".camera", NULL
+    };
+    const gchar *const *keys;
+    gchar *contents = NULL;
+    guint i;
+
+    if (strcmp(mount_point, "/home/user/MyDocs") == 0)
+        keys = mydocs_keys;
+    else if (strcmp(mount_point, "/media/mmc1") == 0)
+        keys = mmc_keys;
+    else
+        return;
+
+    if (access(mount_point, W_OK) != 0) {
+        fprintf(stderr, "'%s' is not writable\n", mount_point);
+        return;
+    }
+
+    if (g_file_get_contents(MOUNT_USER_DIRS_FILE, &contents, NULL, NULL)) {
+        for (i = 0; keys[i]; i++) {
+            gchar *dir = user_dir(contents, keys[i]);
+
+            if (dir && g_mkdir_with_parents(dir, 0755) != 0)
+                fprintf(stderr, "Cannot create %s: %s\n", dir,
+                        g_strerror(errno));
+            g_free(dir);
+        }
+        g_free(contents);
+    } else if (keys == mydocs_keys) {
+        for (i = 0; fallback[i]; i++) {
+            gchar *dir = g_build_filename(mount_point, fallback[i], NULL);
+
+            g_mkdir_with_parents(dir, 0755);
+            g_free(dir);
+        }
+    }
+
+    if (keys == mydocs_keys)
+        utimensat(AT_FDCWD, mount_point, NULL, 0);
+}
+
+static gint do_mount(const gchar *device, const gchar *mount_point,
+                     const gchar *fstype, unsigned long extra_flags) {
+    unsigned long flags = 0;
+    gchar *options, *type_opts;
+    GString *data;
+    gint ret;
+
+    if (g_mkdir_with_parents(mount_point, 0755) != 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", mount_point,
+                g_strerror(errno));
+        return MOUNT_ENGINE_FAILED;
+    }
+
+    type_opts = g_strconcat(fstype, "_opts", NULL);
+    options = g_strjoin(",", "rw", policy_get("common_opts"),
+                        policy_get("user_opts"), policy_get(type_opts), NULL);
+    data = g_string_new(NULL);
+    parse_options(options, &flags, data);
+    flags |= extra_flags;
+
+    ret = MOUNT_ENGINE_RW;
+    if (mount(device, mount_point, fstype, flags, data->str) != 0) {
+        /* write protected card */
+        if (!(flags & MS_RDONLY) && (errno == EROFS || errno == EACCES) &&
+            mount(device, mount_point, fstype, flags | MS_RDONLY,
+                  data->str) == 0) {
+            ret = MOUNT_ENGINE_RO;
+        } else {
+            fprintf(stderr, "Cannot mount %s (%s, %s) on %s: %s\n", device,
+                    fstype, options, mount_point, g_strerror(errno));
+            ret = MOUNT_ENGINE_FAILED;
+        }
+    } else if (flags & MS_RDONLY) {
+        ret = MOUNT_ENGINE_RO;
+    }
+
+    if (ret != MOUNT_ENGINE_FAILED)
+        mount_table_invalidate();
+
+    fprintf(stderr, "mounting %s %s fs %s to %s, rc: %d\n", device,
+            ret == MOUNT_ENGINE_RO ? "read-only" : "read-write", fstype,
+            mount_point, ret);
+
+    if (ret == MOUNT_ENGINE_RW)
+        create_user_dirs(mount_point);
+
+    g_string_free(data, TRUE);
+    g_free(options);
+    g_free(type_opts);
+    return ret;
+}
+
+static void log_fsck(const gchar *line) {
+    FILE *f = fopen(MOUNT_FSCK_LOG, "a");
+
+    if (!f) {
+        fprintf(stderr, "Cannot open %s: %s\n", MOUNT_FSCK_LOG,
+                g_strerror(errno));
+        return;
+    }
+    fputs(line, f);
+    fclose(f);
+}
+
+static gboolean op_finish(gpointer data) {
+    MountOp *op = data;
+
+    if (op->cb)
+        op->cb(op->status, op->data);
+    g_free(op->device);
+    g_free(op->mount_point);
+    g_free(op);
+    return FALSE;
+}
+
+static gboolean op_mount(gpointer data) {
+    MountOp *op = data;
+
+    op->status = do_mount(op->device, op->mount_point, op->fstype,
+                          op->flags);
+    return op_finish(op);
+}
+
+static void fsck_done(pid_t pid, int status, gpointer data) {
+    MountOp *op = data;
+    gint code = status != -1 && WIFEXITED(status) ? WEXITSTATUS(status)
+                                                   : -1;
+
+    log_fsck("\n");
+    fprintf(stderr, "%s -a %s returned %d\n", MOUNT_FSCK_COMMAND,
+            op->device, code);
+
+    /* do not make things worse by writing; a missing checker or the
+     * like (8) still mounts as mmc-mount did */
+    if (code > 0 && (code & MOUNT_FSCK_UNCORRECTED))
+        op->flags |= MS_RDONLY;
+    op_mount(op);
+}
+
+/* Runs MOUNT_FSCK_COMMAND like mmc-mount did, FALSE if it did not start */
+static gboolean start_fsck(MountOp *op) {
+    const gchar *args[] = { MOUNT_FSCK_COMMAND, "-a", op->device, NULL };
+    gchar stamp[32], *line;
+    time_t now = time(NULL);
+    pid_t pid;
+
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    line = g_strdup_printf("%s  fsck -a %s\n", stamp, op->device);
+    log_fsck(line);
+    g_free(line);
+
+    pid = spawn_prog_logged(MOUNT_FSCK_COMMAND, args, MOUNT_FSCK_LOG);
+    if (pid < 0)
+        return FALSE;
+
+    reaper_watch(pid, fsck_done, op);
+    return TRUE;
+}
+
+gboolean mount_engine_start(const gchar *device, const gchar *mount_point,
+                            const gchar *fstype, gboolean check,
+                            mount_engine_cb_t cb, gpointer data) {
+    MountOp *op;
+
+    if (access(MOUNT_BLACKLIST_HOOK, X_OK) == 0 || !load_policy())
+        return FALSE;
+
+    op = g_new0(MountOp, 1);
+    op->device = g_strdup(device);
+    op->mount_point = g_strdup(mount_point);
+    op->cb = cb;
+    op->data = data;
+
+    /* neither checked nor mounted twice */
+    if (mount_table_is_mounted(device)) {
+        fprintf(stderr, "%s is already mounted\n", device);
+        op->status = MOUNT_ENGINE_RW;
+        g_idle_add(op_finish, op);
+        return TRUE;
+    }
+
+    if (!fstype || !*fstype)
+        fstype = mount_engine_probe(device);
+    else if (strcmp(fstype, "fat") == 0)
+        fstype = "vfat";
+    else
+        fstype = g_intern_string(fstype);
+    /* mount(8) would have used the helper or loaded the module */
+    if (fstype && (has_mount_helper(fstype) || !kernel_has_fs(fstype))) {
+        fprintf(stderr, "%s: no native %s support, leaving it to mount(8)\n",
+                device, fstype);
+        fstype = NULL;
+    }
+    if (!fstype) {
+        g_free(op->device);
+        g_free(op->mount_point);
+        g_free(op);
+        return FALSE;
+    }
+    op->fstype = fstype;
+
+    if (check && policy_fsck() && start_fsck(op))
+        return TRUE;
+
+    g_idle_add(op_mount, op);
+    return TRUE;
+}
@@ -0,0 +1,56 @@
+#ifndef __MOUNT_ENGINE_H__
+#define __MOUNT_ENGINE_H__
+
+#include <glib.h>
+
+/*
+ * In-process card mounting, doing what osso-mmc-mount.sh and mmc-mount do
+ * without spawning blkid, sed and mount:
+ *
+ * - the filesystem type is probed from the superblock
+ * - fsck is spawned directly and reaped from the main loop
+ * - the options come from MOUNT_OPTS_FILE, parsed once and re-read only
+ *   when it changes
+ * - mount(2) is called directly, read-only if the card refuses writes
+ * - the user directories are created on MyDocs and the memory card
+ *
+ * Anything the engine cannot do as the scripts would is refused by
+ * mount_engine_start() so that the caller runs the script instead: an
+ * installed blacklist hook, a policy file using shell expansion, an
+ * unknown filesystem, or one that mount(8) would pass to a mount.<type>
+ * helper (ntfs-3g, exfat-fuse) or the kernel has no driver loaded for.
+ */
+
+#define MOUNT_OPTS_FILE "/etc/default/mount-opts"
+#define MOUNT_BLACKLIST_HOOK "/etc/default/osso-mmc-blacklist.sh"
+#define MOUNT_USER_DIRS_FILE "/home/user/.config/user-dirs.dirs"
+#define MOUNT_FSCK_COMMAND "/sbin/fsck"
+#define MOUNT_FSCK_LOG "/var/log/fsck.log"
+/* fsck exit code bit: errors were left uncorrected */
+#define MOUNT_FSCK_UNCORRECTED 4
+
+/* Results, the exit codes of osso-mmc-mount.sh */
+#define MOUNT_ENGINE_RW 0
+#define MOUNT_ENGINE_FAILED 1
+#define MOUNT_ENGINE_RO 2
+
+/* Filesystem type of device from its superblock, NULL if unknown */
+const gchar *mount_engine_probe(const gchar *device);
+
+typedef void (*mount_engine_cb_t)(gint status, gpointer data);
+
+/*
+ * Mount device on mount_point, fstype may be NULL or "fat". Succeeds
+ * without doing anything if device is mounted already. Otherwise, if check
+ * is set and the policy asks for it (user_fsck), MOUNT_FSCK_COMMAND runs
+ * first, logged to MOUNT_FSCK_LOG as mmc-mount did; a card it could not
+ * repair is mounted read-only. The check has no time limit.
+ *
+ * FALSE if the engine cannot do it, see above. Otherwise cb gets one of
+ * the results from the main loop, never from within this function.
+ */
+gboolean mount_engine_start(const gchar *device, const gchar *mount_point,
+                            const gchar *fstype, gboolean check,
+                            mount_engine_cb_t cb, gpointer data);
+
+#endif /* __MOUNT_ENGINE_H__ */
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <glib.h>
+
+#include "mount-table.h"
+
+#define MOUNTINFO "/proc/self/mountinfo"
+
+static GPtrArray *entries = NULL;
+static GHashTable *by_device = NULL;        /* source -> MountEntry */
+static GHashTable *by_mount_point = NULL;   /* mount point -> MountEntry */
+static GHashTable *by_rdev = NULL;          /* &rdev -> MountEntry */
+static gboolean valid = FALSE;
+static int mountinfo_fd = -1;
+
+static void entry_free(gpointer p) {
+    MountEntry *e = p;
+
+    g_free(e->device);
+    g_free(e->mount_point);
+    g_free(e->fstype);
+    g_free(e->options);
+    g_free(e);
+}
+
+/* mountinfo escapes space, tab, newline and backslash as \ooo */
+static gchar *unescape(const gchar *s) {
+    gchar *out = g_malloc(strlen(s) + 1), *o = out;
+
+    while (*s) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+            s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *o++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+            s += 4;
+        } else {
+            *o++ = *s++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+/* "id parent maj:min root mount_point options [tags] - fstype source super" */
+static MountEntry *parse_line(const gchar *line) {
+    gchar **fields = g_strsplit(line, " ", -1);
+    guint n = g_strv_length(fields), sep;
+    MountEntry *e = NULL;
+    guint maj, min;
+
+    for (sep = 6; sep < n && strcmp(fields[sep], "-") != 0; sep++)
+        ;
+    if (sep + 2 < n && sscanf(fields[2], "%u:%u", &maj, &min) == 2) {
+        e = g_new0(MountEntry, 1);
+        e->mount_point = unescape(fields[4]);
+        e->options = g_strdup(fields[5]);
+        e->fstype = g_strdup(fields[sep + 1]);
+        e->device = unescape(fields[sep + 2]);
+        e->devno = makedev(maj, min);
+    }
+
+    g_strfreev(fields);
+    return e;
+}
+
+static gboolean read_fd(int fd, GString *buf) {
+    gchar chunk[4096];
+    ssize_t n;
+
+    g_string_truncate(buf, 0);
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        return FALSE;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+        g_string_append_len(buf, chunk, n);
+    return n == 0;
+}
+
+static void refresh(void) {
+    GString *buf = g_string_new(NULL);
+    gchar **lines;
+    gboolean ok;
+    guint i;
+
+    if (mountinfo_fd >= 0) {
+        ok = read_fd(mountinfo_fd, buf);
+    } else {
+        gchar *contents = NULL;
+
+        ok = g_file_get_contents(MOUNTINFO, &contents, NULL, NULL);
+        if (ok)
+            g_string_assign(buf, contents);
+        g_free(contents);
+    }
+    if (!ok)
+        fprintf(stderr, "Cannot read %s: %s\n", MOUNTINFO, g_strerror(errno));
+
+    if (!entries) {
+        entries = g_ptr_array_new_with_free_func(entry_free);
+        by_device = g_hash_table_new(g_str_hash, g_str_equal);
+        by_mount_point = g_hash_table_new(g_str_hash, g_str_equal);
+        /* dev_t is 64 bits, too wide for a pointer key everywhere */
+        by_rdev = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+    g_hash_table_remove_all(by_device);
+    g_hash_table_remove_all(by_mount_point);
+    g_hash_table_remove_all(by_rdev);
+    g_ptr_array_set_size(entries, 0);
+
+    lines = g_strsplit(buf->str, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        MountEntry *e = parse_line(lines[i]);
+        struct stat st;
+
+        if (!e)
+            continue;
+        g_ptr_array_add(entries, e);
+        /* later lines are mounted on top of earlier ones */
+        g_hash_table_replace(by_device, e->device, e);
+        g_hash_table_replace(by_mount_point, e->mount_point, e);
+        if (e->device[0] == '/' && stat(e->device, &st) == 0 &&
+            S_ISBLK(st.st_mode)) {
+            e->rdev = st.st_rdev;
+            g_hash_table_replace(by_rdev, &e->rdev, e);
+        }
+    }
+
+    g_strfreev(lines);
+    g_string_free(buf, TRUE);
+
+    /* without the watch nothing would tell about changes */
+    valid = ok && mountinfo_fd >= 0;
+}
+
+static void ensure(void) {
+    struct pollfd pfd = { .fd = mountinfo_fd, .events = POLLPRI };
+
+    /* a change the main loop has not dispatched yet, e.g. made by a
+     * script that has just exited */
+    if (valid && poll(&pfd, 1, 0) > 0)
+        valid = FALSE;
+    if (!valid)
+        refresh();
+}
+
+static gboolean changed_cb(GIOChannel *source, GIOCondition cond,
+                           gpointer data) {
+    valid = FALSE;
+    return TRUE;
+}
+
+gboolean mount_table_init(void) {
+    GIOChannel *ch;
+
+    if (mountinfo_fd >= 0)
+        return TRUE;
+
+    mountinfo_fd = open(MOUNTINFO, O_RDONLY | O_CLOEXEC);
+    if (mountinfo_fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", MOUNTINFO, g_strerror(errno));
+        return FALSE;
+    }
+
+    /* the kernel flags every change of the table with POLLPRI | POLLERR */
+    ch = g_io_channel_unix_new(mountinfo_fd);
+    g_io_add_watch(ch, G_IO_PRI | G_IO_ERR, changed_cb, NULL);
+    g_io_channel_unref(ch);
+
+    valid = FALSE;
+    return TRUE;
+}
+
+void mount_table_invalidate(void) {
+    valid = FALSE;
+}
+
+const MountEntry *mount_table_mount_of(const gchar *mount_point) {
+    ensure();
+    return g_hash_table_lookup(by_mount_point, mount_point);
+}
+
+const MountEntry *mount_table_find_device(const gchar *device) {
+    MountEntry *e;
+    struct stat st;
+
+    ensure();
+    e = g_hash_table_lookup(by_device, device);
+    if (e)
+        return e;
+
+    /* e.g. a /dev/disk/by-* link or a renamed node */
+    if (stat(device, &st) == 0 && S_ISBLK(st.st_mode)) {
+        gint64 rdev = st.st_rdev;
+
+        e = g_hash_table_lookup(by_rdev, &rdev);
+    }
+    return e;
+}
+
+gboolean mount_table_is_mounted(const gchar *device) {
+    return mount_table_find_device(device) != NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef __MOUNT_TABLE_H__
+#define __MOUNT_TABLE_H__
+
+#include <sys/types.h>
+#include <glib.h>
+
+/*
+ * Cache of the mount table, parsed from /proc/self/mountinfo and indexed
+ * by source device and by mount point.
+ *
+ * Once mount_table_init() has run, the table is re-read only when the
+ * kernel reports a change (POLLPRI on mountinfo) or after
+ * mount_table_invalidate(). Without it every query re-reads the file.
+ *
+ * Where several mounts share a device or a mount point, the last one, the
+ * one on top, is the one found.
+ */
+
+typedef struct {
+    gchar *device;          /* source, e.g. /dev/mmcblk0p1 */
+    gchar *mount_point;
+    gchar *fstype;
+    gchar *options;         /* per-mount options, e.g. rw,noatime */
+    dev_t devno;            /* st_dev of files on the mount */
+    gint64 rdev;            /* st_rdev of device, 0 if not a block device */
+} MountEntry;
+
+/* Start watching mountinfo from the main loop */
+gboolean mount_table_init(void);
+
+/* Re-read the table on the next query, for callers that have just mounted
+ * or unmounted something themselves */
+void mount_table_invalidate(void);
+
+/* The mount on mount_point, NULL if none. Valid until the next query
+ * after a change of the table. */
+const MountEntry *mount_table_mount_of(const gchar *mount_point);
+
+/* The mount of device, a /dev path or an alias of one, NULL if it is not
+ * mounted. Valid like mount_table_mount_of(). */
+const MountEntry *mount_table_find_device(const gchar *device);
+
+gboolean mount_table_is_mounted(const gchar *device);
+
+#endif /* __MOUNT_TABLE_H__ */
@@ -29,6 +29,7 @@ BLS=/etc/default/osso-mmc-blacklist.sh
 PDEV=$1  ;# preferred device (partition)
 MP=$2    ;# mount point
 FS=$3    ;# fstype
+HINT=$4  ;# "nofsck" if the card came back from USB unwritten
 
 # hook for blacklist etc. Shall care for logger and exit 0, in case
 test -x $BLS && source $BLS
@@ -57,7 +58,7 @@ fi
 #  fi
 #fi
 
-mmc-mount $PDEV $MP rw $FS
+mmc-mount $PDEV $MP rw "$FS" $HINT
 RC=$?
 logger "$0: mounting $PDEV read-write fs $FS to $MP, rc: $RC"
 
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "probe-cache.h"
+
+#define PROBE_CACHE_DIR "/run/ke-recv"
+#define PROBE_CACHE_FILE PROBE_CACHE_DIR "/probe-cache"
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+
+#define CACHE_GROUP "cache"
+#define BOOT_ID_KEY "BootId"
+/* Suffix of the key holding the identity of a cached path */
+#define ID_SUFFIX "Id"
+
+static GKeyFile *cache = NULL;
+static gboolean dirty = FALSE;
+
+static gchar *read_boot_id(void) {
+    gchar *id = NULL;
+
+    if (!g_file_get_contents(BOOT_ID_FILE, &id, NULL, NULL))
+        return NULL;
+
+    return g_strstrip(id);
+}
+
+/*
+ * Loads the cache on first use. A cache from a previous boot (or an
+ * unreadable one) is discarded and starts out empty.
+ */
+static GKeyFile *get_cache(void) {
+    gchar *boot_id, *cached_id;
+
+    if (cache)
+        return cache;
+
+    cache = g_key_file_new();
+    boot_id = read_boot_id();
+
+    if (g_key_file_load_from_file(cache, PROBE_CACHE_FILE, G_KEY_FILE_NONE,
+                                  NULL)) {
+        cached_id = g_key_file_get_string(cache, CACHE_GROUP, BOOT_ID_KEY,
+                                          NULL);
+        if (!boot_id || g_strcmp0(boot_id, cached_id) != 0) {
+            fprintf(stderr, "Discarding probe cache from another boot\n");
+            g_key_file_free(cache);
+            cache = g_key_file_new();
+        }
+        g_free(cached_id);
+    }
+
+    if (boot_id) {
+        g_key_file_set_string(cache, CACHE_GROUP, BOOT_ID_KEY, boot_id);
+        g_free(boot_id);
+    }
+
+    return cache;
+}
+
+/* "-" for a missing file. The mtime only counts for regular files, sysfs
+ * and device nodes may have theirs touched without changing identity. */
+static gchar *path_identity(const gchar *path) {
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return g_strdup("-");
+
+    return g_strdup_printf("%lu:%lu:%lu:%ld",
+                           (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+                           (unsigned long)st.st_rdev,
+                           S_ISREG(st.st_mode) ? (long)st.st_mtime : 0L);
+}
+
+gchar *probe_cache_get_path(const gchar *group, const gchar *key) {
+    GKeyFile *kf = get_cache();
+    gchar *path, *id_key, *cached_id, *id;
+
+    path = g_key_file_get_string(kf, group, key, NULL);
+    if (!path)
+        return NULL;
+
+    id_key = g_strconcat(key, ID_SUFFIX, NULL);
+    cached_id = g_key_file_get_string(kf, group, id_key, NULL);
+    g_free(id_key);
+
+    id = path_identity(path);
+    if (g_strcmp0(id, cached_id) != 0) {
+        fprintf(stderr, "Cached %s/%s (%s) changed\n", group, key, path);
+        g_free(path);
+        path = NULL;
+    }
+
+    g_free(id);
+    g_free(cached_id);
+
+    return path;
+}
+
+void probe_cache_set_path(const gchar *group, const gchar *key,
+                          const gchar *path) {
+    GKeyFile *kf = get_cache();
+    gchar *id_key, *id;
+
+    id_key = g_strconcat(key, ID_SUFFIX, NULL);
+    id = path_identity(path);
+
+    g_key_file_set_string(kf, group, key, path);
+    g_key_file_set_string(kf, group, id_key, id);
+    dirty = TRUE;
+
+    g_free(id);
+    g_free(id_key);
+}
+
+gchar *probe_cache_get_string(const gchar *group, const gchar *key) {
+    return g_key_file_get_string(get_cache(), group, key, NULL);
+}
+
+void probe_cache_set_string(const gchar *group, const gchar *key,
+                            const gchar *value) {
+    g_key_file_set_string(get_cache(), group, key, value);
+    dirty = TRUE;
+}
+
+void probe_cache_remove_group(const gchar *group) {
+    if (g_key_file_remove_group(get_cache(), group, NULL))
+        dirty = TRUE;
+}
+
+void probe_cache_save(void) {
+    GError *error = NULL;
+    gchar *data;
+    gsize len;
+
+    if (!cache || !dirty)
+        return;
+
+    if (g_mkdir_with_parents(PROBE_CACHE_DIR, 0755) != 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", PROBE_CACHE_DIR,
+                g_strerror(errno));
+        return;
+    }
+
+    data = g_key_file_to_data(cache, &len, NULL);
+    /* Written to a temporary file and renamed, never seen half written */
+    if (!g_file_set_contents(PROBE_CACHE_FILE, data, len, &error)) {
+        fprintf(stderr, "Cannot write probe cache: %s\n", error->message);
+        g_error_free(error);
+    } else {
+        dirty = FALSE;
+    }
+
+    g_free(data);
+}
@@ -0,0 +1,35 @@
+#ifndef __PROBE_CACHE_H__
+#define __PROBE_CACHE_H__
+
+#include <glib.h>
+
+/*
+ * Hardware discovery results kept in /run across ke-recv restarts.
+ *
+ * The cache is only used when it was written during the current boot, and
+ * every cached path is only returned if it still refers to the same file
+ * (device, inode, and device number for nodes) as when it was stored.
+ * Callers must still treat a returned path as a hint and fall back to
+ * their full probe if it turns out unusable.
+ */
+
+/* Returns the cached path for group/key, or NULL if missing or stale */
+gchar *probe_cache_get_path(const gchar *group, const gchar *key);
+
+/* Remember 'path' and its identity. A path that does not exist is stored
+ * as such and matches as long as it stays absent. */
+void probe_cache_set_path(const gchar *group, const gchar *key,
+                          const gchar *path);
+
+/* Plain values, tied to the boot but not to any file */
+gchar *probe_cache_get_string(const gchar *group, const gchar *key);
+void probe_cache_set_string(const gchar *group, const gchar *key,
+                            const gchar *value);
+
+/* Drop everything stored for group, e.g. after a cached device failed */
+void probe_cache_remove_group(const gchar *group);
+
+/* Write pending changes to disk */
+void probe_cache_save(void);
+
+#endif /* __PROBE_CACHE_H__ */
@@ -0,0 +1,188 @@
+/**
+  @file proc-spawn.c
+  Starting helper programs without fork()ing the whole process.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* pipe2(), posix_spawn_file_actions_addclosefrom_np() */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <glib.h>
+#include <osso-log.h>
+
+#include "proc-spawn.h"
+
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 34)
+#define HAVE_SPAWN_CLOSEFROM 1
+#endif
+#endif
+
+/* variables copied from our own environment, in addition to PATH */
+static const char *const spawn_env_keep[] = {
+        "LANG", "LANGUAGE", "LC_ALL", "LC_MESSAGES", "LC_CTYPE", NULL
+};
+
+static char **spawn_env = NULL;
+
+char *const *spawn_environ(void)
+{
+        GPtrArray *env;
+        int i;
+
+        if (spawn_env != NULL) {
+                return spawn_env;
+        }
+
+        env = g_ptr_array_new();
+        g_ptr_array_add(env, g_strdup("PATH=" SPAWN_PATH));
+        for (i = 0; spawn_env_keep[i] != NULL; ++i) {
+                const char *val = getenv(spawn_env_keep[i]);
+                if (val != NULL) {
+                        g_ptr_array_add(env, g_strdup_printf("%s=%s",
+                                        spawn_env_keep[i], val));
+                }
+        }
+        g_ptr_array_add(env, NULL);
+        spawn_env = (char **)g_ptr_array_free(env, FALSE);
+        return spawn_env;
+}
+
+#ifndef HAVE_SPAWN_CLOSEFROM
+/* Without closefrom in the file actions, make sure that descriptors some
+ * library opened without O_CLOEXEC (D-Bus, X, GConf) do not leak into the
+ * helpers. We never exec ourselves, so this is harmless to the process. */
+static void set_cloexec_from(int lowfd)
+{
+        DIR *dir;
+        struct dirent *ent;
+
+        dir = opendir("/proc/self/fd");
+        if (dir == NULL) {
+                return;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                char *end;
+                long fd = strtol(ent->d_name, &end, 10);
+                int flags;
+
+                if (*end != '\0' || end == ent->d_name || fd < lowfd ||
+                    fd == dirfd(dir)) {
+                        continue;
+                }
+                flags = fcntl(fd, F_GETFD);
+                if (flags >= 0 && !(flags & FD_CLOEXEC)) {
+                        fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+                }
+        }
+        closedir(dir);
+}
+#endif
+
+static pid_t spawn(const char *cmd, const char *const args[], int *stderr_fd,
+                   const char *log)
+{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t sigs;
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+        int fd[2] = {-1, -1};
+        pid_t pid = -1;
+        int ret;
+
+        if (stderr_fd != NULL && pipe2(fd, O_CLOEXEC) < 0) {
+                ULOG_ERR_F("pipe2() failed: %s", strerror(errno));
+                return -1;
+        }
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+
+#ifdef POSIX_SPAWN_USEVFORK
+        /* implied by glibc >= 2.24, which always uses CLONE_VM|CLONE_VFORK */
+        flags |= POSIX_SPAWN_USEVFORK;
+#endif
+        posix_spawnattr_setflags(&attr, flags);
+        sigemptyset(&sigs);
+        posix_spawnattr_setsigmask(&attr, &sigs);
+        sigfillset(&sigs);
+        posix_spawnattr_setsigdefault(&attr, &sigs);
+
+        if (stderr_fd != NULL) {
+                /* dup2() clears O_CLOEXEC on the copy */
+                posix_spawn_file_actions_adddup2(&actions, fd[1],
+                                                 STDERR_FILENO);
+        }
+        if (log != NULL) {
+                posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, log,
+                                                 O_WRONLY | O_CREAT |
+                                                 O_APPEND, 0644);
+                posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+                                                 STDERR_FILENO);
+        }
+#ifdef HAVE_SPAWN_CLOSEFROM
+        posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#else
+        set_cloexec_from(STDERR_FILENO + 1);
+#endif
+
+        ret = posix_spawn(&pid, cmd, &actions, &attr,
+                          (char *const *)args, spawn_environ());
+
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        if (stderr_fd != NULL) {
+                close(fd[1]);
+        }
+        if (ret != 0) {
+                ULOG_ERR_F("posix_spawn() of '%s' failed: %s", cmd,
+                           strerror(ret));
+                if (stderr_fd != NULL) {
+                        close(fd[0]);
+                }
+                errno = ret;
+                return -1;
+        }
+
+        ULOG_DEBUG_F("'%s' started (pid=%d)", cmd, pid);
+        if (stderr_fd != NULL) {
+                *stderr_fd = fd[0];
+        }
+        return pid;
+}
+
+pid_t spawn_prog(const char *cmd, const char *const args[], int *stderr_fd)
+{
+        return spawn(cmd, args, stderr_fd, NULL);
+}
+
+pid_t spawn_prog_logged(const char *cmd, const char *const args[],
+                        const char *log)
+{
+        return spawn(cmd, args, NULL, log);
+}
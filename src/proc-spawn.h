@@ -0,0 +1,66 @@
+/**
+  @file proc-spawn.h
+  Starting helper programs without fork()ing the whole process.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef PROC_SPAWN_H_
+#define PROC_SPAWN_H_
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* PATH given to the spawned programs */
+#define SPAWN_PATH "/usr/sbin:/usr/bin:/sbin:/bin"
+
+/**
+  Starts a program in a child process that shares the memory of the caller
+  until it execs (posix_spawn, i.e. vfork semantics), so the cost does not
+  grow with the size of the caller. The child gets signal dispositions
+  reset to their defaults, an empty signal mask, a minimal environment
+  (see spawn_environ()) and no file descriptors other than 0-2.
+  Does not wait for the child; the caller must reap it.
+  @param cmd absolute path of the program
+  @param args NULL-terminated argument vector, args[0] included
+  @param stderr_fd if not NULL, the child's stderr is connected to a pipe
+         whose (close-on-exec) reading end is returned here
+  @return PID of the child, or -1 on error with errno set
+*/
+pid_t spawn_prog(const char *cmd, const char *const args[], int *stderr_fd);
+
+/**
+  Like spawn_prog(), with the child's stdout and stderr appended to a
+  file.
+  @param log path of the file, created if needed
+*/
+pid_t spawn_prog_logged(const char *cmd, const char *const args[],
+                        const char *log);
+
+/**
+  @return the environment given to spawned programs: PATH=SPAWN_PATH and
+  the locale variables of the caller. Built on first use.
+*/
+char *const *spawn_environ(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PROC_SPAWN_H_ */
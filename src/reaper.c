@@ -0,0 +1,186 @@
+/**
+  @file reaper.c
+  Central reaping of child processes from the main loop.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <glib.h>
+#include <osso-log.h>
+
+#include "reaper.h"
+
+typedef struct {
+        pid_t pid;
+        int status;
+        reaper_cb_t cb;         /* NULL once unwatched */
+        gpointer data;
+} reaper_child_t;
+
+static GSList *children = NULL;
+static int sig_fd = -1;
+static guint sig_watch_id = 0;
+
+/* Reaps the exited watched children first and only then calls their
+ * callbacks, so that a callback may freely watch or unwatch children */
+static void reaper_scan(void)
+{
+        GSList *l, *next, *done = NULL;
+
+        for (l = children; l != NULL; l = next) {
+                reaper_child_t *c = l->data;
+                pid_t ret;
+
+                next = l->next;
+                do {
+                        ret = waitpid(c->pid, &c->status, WNOHANG);
+                } while (ret < 0 && errno == EINTR);
+
+                if (ret == 0) {
+                        continue;
+                } else if (ret < 0) {
+                        /* not our child (any more) */
+                        ULOG_ERR_F("waitpid(%d) failed: %s", c->pid,
+                                   strerror(errno));
+                        c->status = -1;
+                }
+                children = g_slist_delete_link(children, l);
+                done = g_slist_prepend(done, c);
+        }
+
+        done = g_slist_reverse(done);
+        for (l = done; l != NULL; l = l->next) {
+                reaper_child_t *c = l->data;
+
+                ULOG_DEBUG_F("child %d exited, status 0x%x", c->pid,
+                             c->status);
+                if (c->cb != NULL) {
+                        c->cb(c->pid, c->status, c->data);
+                }
+                g_free(c);
+        }
+        g_slist_free(done);
+}
+
+static gboolean reaper_sig_ready(GIOChannel *ch, GIOCondition cond,
+                                 gpointer data)
+{
+        struct signalfd_siginfo si;
+
+        if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+                ULOG_ERR_F("signalfd failed");
+                sig_watch_id = 0;
+                return FALSE;
+        }
+
+        /* several SIGCHLDs coalesce into one, so each read only tells
+         * that some child has exited */
+        while (read(sig_fd, &si, sizeof(si)) == sizeof(si))
+                ;
+        reaper_scan();
+        return TRUE;
+}
+
+gboolean reaper_init(void)
+{
+        GIOChannel *ch;
+        sigset_t mask;
+
+        if (sig_fd >= 0) {
+                return TRUE;
+        }
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+                ULOG_ERR_F("sigprocmask() failed: %s", strerror(errno));
+                return FALSE;
+        }
+        sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (sig_fd < 0) {
+                ULOG_ERR_F("signalfd() failed: %s", strerror(errno));
+                sigprocmask(SIG_UNBLOCK, &mask, NULL);
+                return FALSE;
+        }
+
+        ch = g_io_channel_unix_new(sig_fd);
+        sig_watch_id = g_io_add_watch(ch, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                      reaper_sig_ready, NULL);
+        g_io_channel_unref(ch);
+        return TRUE;
+}
+
+/* Used when reaper_init() failed or was not called */
+static void reaper_child_exited(GPid pid, gint status, gpointer data)
+{
+        reaper_child_t *c = data;
+
+        children = g_slist_remove(children, c);
+        g_spawn_close_pid(pid);
+        if (c->cb != NULL) {
+                c->cb(c->pid, status, c->data);
+        }
+        g_free(c);
+}
+
+void reaper_watch(pid_t pid, reaper_cb_t cb, gpointer data)
+{
+        reaper_child_t *c = g_new0(reaper_child_t, 1);
+
+        c->pid = pid;
+        c->cb = cb;
+        c->data = data;
+        children = g_slist_append(children, c);
+
+        if (sig_fd < 0) {
+                ULOG_WARN_F("reaper not initialised, using a child watch");
+                g_child_watch_add(pid, reaper_child_exited, c);
+        }
+        /* otherwise, if it has already exited, the SIGCHLD is still
+         * pending in the signalfd and the next scan picks it up */
+}
+
+void reaper_unwatch(pid_t pid)
+{
+        GSList *l;
+
+        for (l = children; l != NULL; l = l->next) {
+                reaper_child_t *c = l->data;
+                if (c->pid == pid) {
+                        c->cb = NULL;
+                }
+        }
+}
+
+guint reaper_get_count(void)
+{
+        GSList *l;
+        guint n = 0;
+
+        for (l = children; l != NULL; l = l->next) {
+                if (((reaper_child_t *)l->data)->cb != NULL) {
+                        ++n;
+                }
+        }
+        return n;
+}
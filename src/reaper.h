@@ -0,0 +1,73 @@
+/**
+  @file reaper.h
+  Central reaping of child processes from the main loop.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef REAPER_H_
+#define REAPER_H_
+
+#include <sys/types.h>
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+  Called from the main loop when a watched child has exited.
+  @param pid PID of the child, already reaped
+  @param status wait status as returned by waitpid(), or -1 if the child
+  could not be reaped
+  @param data user data given to reaper_watch()
+*/
+typedef void (*reaper_cb_t)(pid_t pid, int status, gpointer data);
+
+/**
+  Blocks SIGCHLD and starts receiving it through a signalfd in the default
+  main context. Must be called before any thread is created and before
+  the first child is started; g_child_watch_add() does not work after it.
+  @return false on error.
+*/
+gboolean reaper_init(void);
+
+/**
+  Reaps the given child when it exits and passes its status to cb. Only
+  watched children are reaped, so exec_prog() and the like can still
+  waitpid() for their own. Several children can be watched at once.
+  @param pid child started by this process
+  @param cb called once, from the main loop
+  @param data passed to cb
+*/
+void reaper_watch(pid_t pid, reaper_cb_t cb, gpointer data);
+
+/**
+  Forgets a watched child without calling its callback. The child is
+  still reaped when it exits.
+*/
+void reaper_unwatch(pid_t pid);
+
+/**
+  @return number of watched children that have not exited yet.
+*/
+guint reaper_get_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* REAPER_H_ */
@@ -0,0 +1,147 @@
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <glib.h>
+
+#include "rtnl.h"
+
+#define RTNL_BUF_SIZE 256
+
+typedef struct {
+    struct nlmsghdr n;
+    union {
+        struct ifinfomsg ifi;
+        struct ifaddrmsg ifa;
+    };
+    char attrs[64];
+} RtnlRequest;
+
+static void add_attr(struct nlmsghdr *n, int type, const void *data, int len) {
+    struct rtattr *rta = (struct rtattr *)((char *)n + NLMSG_ALIGN(n->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* Sends one request and waits for its ack, returns 0 or -errno */
+static int rtnl_talk(struct nlmsghdr *n) {
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    char buf[RTNL_BUF_SIZE];
+    struct nlmsghdr *h;
+    ssize_t len;
+    int fd, ret = -EIO;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+        return -errno;
+
+    n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    n->nlmsg_seq = 1;
+
+    if (sendto(fd, n, n->nlmsg_len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    do {
+        len = recv(fd, buf, sizeof(buf), 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (size_t)len);
+         h = NLMSG_NEXT(h, len)) {
+        if (h->nlmsg_type == NLMSG_ERROR) {
+            struct nlmsgerr *err = NLMSG_DATA(h);
+            /* error 0 is the acknowledgement */
+            ret = err->error;
+            break;
+        }
+    }
+
+out:
+    close(fd);
+    return ret;
+}
+
+int rtnl_link_set_up(const gchar *ifname, gboolean up) {
+    RtnlRequest req;
+    unsigned int index = if_nametoindex(ifname);
+
+    if (index == 0)
+        return -ENODEV;
+
+    memset(&req, 0, sizeof(req));
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = index;
+    req.ifi.ifi_change = IFF_UP;
+    req.ifi.ifi_flags = up ? IFF_UP : 0;
+
+    return rtnl_talk(&req.n);
+}
+
+int rtnl_link_rename(const gchar *ifname, const gchar *new_name) {
+    RtnlRequest req;
+    unsigned int index = if_nametoindex(ifname);
+    size_t len = strlen(new_name) + 1;
+
+    if (index == 0)
+        return -ENODEV;
+    if (len > IFNAMSIZ)
+        return -EINVAL;
+
+    memset(&req, 0, sizeof(req));
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = index;
+
+    add_attr(&req.n, IFLA_IFNAME, new_name, len);
+
+    return rtnl_talk(&req.n);
+}
+
+int rtnl_addr_ipv4(const gchar *ifname, const gchar *addr, guint prefix,
+                   gboolean add) {
+    RtnlRequest req;
+    struct in_addr local, brd;
+    unsigned int index = if_nametoindex(ifname);
+
+    if (index == 0)
+        return -ENODEV;
+    if (prefix > 32 || inet_pton(AF_INET, addr, &local) != 1)
+        return -EINVAL;
+
+    brd.s_addr = local.s_addr |
+                 htonl(prefix == 0 ? 0xffffffffU : (1U << (32 - prefix)) - 1);
+
+    memset(&req, 0, sizeof(req));
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+    req.n.nlmsg_type = add ? RTM_NEWADDR : RTM_DELADDR;
+    if (add)
+        req.n.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+    req.ifa.ifa_family = AF_INET;
+    req.ifa.ifa_prefixlen = prefix;
+    req.ifa.ifa_index = index;
+    req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+
+    add_attr(&req.n, IFA_LOCAL, &local, sizeof(local));
+    add_attr(&req.n, IFA_ADDRESS, &local, sizeof(local));
+    if (add && prefix < 31)
+        add_attr(&req.n, IFA_BROADCAST, &brd, sizeof(brd));
+
+    return rtnl_talk(&req.n);
+}
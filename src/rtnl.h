@@ -0,0 +1,25 @@
+#ifndef __RTNL_H__
+#define __RTNL_H__
+
+#include <glib.h>
+
+/*
+ * Minimal rtnetlink client for configuring the USB network interface
+ * without running ifconfig. Every call opens its own NETLINK_ROUTE socket
+ * and waits for the kernel's acknowledgement.
+ *
+ * All functions return 0 on success and a negative errno value on failure.
+ */
+
+/* Set or clear IFF_UP on the interface */
+int rtnl_link_set_up(const gchar *ifname, gboolean up);
+
+/* Rename the interface, which must be down */
+int rtnl_link_rename(const gchar *ifname, const gchar *new_name);
+
+/* Add (replacing an existing one) or remove an IPv4 address, with the
+ * broadcast address derived from the prefix like ifconfig does */
+int rtnl_addr_ipv4(const gchar *ifname, const gchar *addr, guint prefix,
+                   gboolean add);
+
+#endif /* __RTNL_H__ */
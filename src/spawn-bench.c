@@ -0,0 +1,134 @@
+/**
+  @file spawn-bench.c
+  Benchmark of fork()+execve() against spawn_prog(). Not installed.
+
+  Usage: spawn-bench [runs] [ballast MB]
+
+  Touches the given amount of private memory first, standing in for a
+  daemon with GTK, GConf and D-Bus mapped, then starts SPAWN_BENCH_PROG
+  the given number of times each way and prints the time from starting
+  the child until it has been reaped.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "proc-spawn.h"
+
+#define SPAWN_BENCH_PROG "/bin/true"
+#define DEFAULT_RUNS 200
+#define DEFAULT_BALLAST_MB 64
+
+typedef pid_t (*start_func_t)(const char *cmd, const char *const args[]);
+
+/* What exec_prog() did before proc-spawn */
+static pid_t start_fork(const char *cmd, const char *const args[])
+{
+        pid_t pid = fork();
+
+        if (pid == 0) {
+                execve(cmd, (char *const *)args, spawn_environ());
+                _exit(127);
+        }
+        return pid;
+}
+
+static pid_t start_spawn(const char *cmd, const char *const args[])
+{
+        return spawn_prog(cmd, args, NULL);
+}
+
+static int compare_times(const void *a, const void *b)
+{
+        gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, start_func_t start, int runs)
+{
+        const char *args[] = {SPAWN_BENCH_PROG, NULL};
+        gint64 *times = g_new(gint64, runs), total = 0;
+        int i;
+
+        /* warm up the page cache and the dynamic loader */
+        waitpid(start(SPAWN_BENCH_PROG, args), NULL, 0);
+
+        for (i = 0; i < runs; ++i) {
+                gint64 started = g_get_monotonic_time();
+                pid_t pid = start(SPAWN_BENCH_PROG, args);
+
+                if (pid < 0) {
+                        fprintf(stderr, "%s failed: %s\n", name,
+                                strerror(errno));
+                        exit(1);
+                }
+                waitpid(pid, NULL, 0);
+                times[i] = g_get_monotonic_time() - started;
+                total += times[i];
+        }
+
+        qsort(times, runs, sizeof(*times), compare_times);
+        printf("%-12s mean %6lld us  p50 %6lld us  p99 %6lld us\n", name,
+               (long long)(total / runs), (long long)times[runs / 2],
+               (long long)times[runs * 99 / 100]);
+        g_free(times);
+}
+
+int main(int argc, char *argv[])
+{
+        int runs = argc > 1 ? atoi(argv[1]) : DEFAULT_RUNS;
+        size_t ballast_mb = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                     : DEFAULT_BALLAST_MB;
+        size_t size = ballast_mb << 20;
+        void *ballast = NULL;
+
+        if (runs <= 0) {
+                fprintf(stderr, "Usage: %s [runs] [ballast MB]\n", argv[0]);
+                return 1;
+        }
+
+        if (size > 0) {
+                ballast = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (ballast == MAP_FAILED) {
+                        fprintf(stderr, "mmap failed: %s\n",
+                                strerror(errno));
+                        return 1;
+                }
+                /* fork() has to copy the page tables of touched pages */
+                memset(ballast, 1, size);
+        }
+
+        printf("%d runs of %s, %zu MB touched\n", runs, SPAWN_BENCH_PROG,
+               ballast_mb);
+        run("fork+execve", start_fork, runs);
+        run("posix_spawn", start_spawn, runs);
+
+        if (ballast != NULL) {
+                munmap(ballast, size);
+        }
+        return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef __UDEV_HELPER_BACKEND_H__
+#define __UDEV_HELPER_BACKEND_H__
+
+/*
+ * Interface between the udev-helper core and the uevent source. One backend
+ * is compiled in, see --with-uevent in configure.ac:
+ *
+ * - udev-helper-gudev.c uses libgudev
+ * - udev-helper-netlink.c reads NETLINK_KOBJECT_UEVENT directly
+ *
+ * Devices are identified by their full sysfs path (/sys/devices/...).
+ */
+
+/* Prepare for device enumeration. Returns 0 on success. */
+int uh_backend_init(void);
+
+/* Look up a device in 'subsystem' matching driver and/or name, see
+ * uh_match_device(). Returns a newly allocated sysfs path or NULL. */
+gchar *uh_backend_find_device(const gchar *subsystem, const gchar *driver,
+                              const gchar *name);
+
+/* Look up the first device in 'subsystem' that has the sysfs attribute
+ * 'attr' with a value accepted by 'match'. Returns a newly allocated sysfs
+ * path or NULL. */
+typedef gboolean (*UhAttrMatch)(const gchar *value);
+gchar *uh_backend_find_device_by_attr(const gchar *subsystem, const gchar *attr,
+                                      UhAttrMatch match);
+
+/* Enumeration is finished, release whatever it needed */
+void uh_backend_probe_done(void);
+
+/* Start delivering uevents for the NULL terminated list of subsystems to
+ * uh_handle_uevent(). 'paths' lists the sysfs paths the core is interested
+ * in, a backend may use it to filter early. Returns 0 on success. */
+int uh_backend_listen(const gchar **subsystems, const gchar **paths);
+
+void uh_backend_destroy(void);
+
+/* Returns the value of a uevent environment key such as
+ * POWER_SUPPLY_TYPE, or NULL if the event does not carry it */
+typedef const gchar *(*UhGetProperty)(gconstpointer event, const gchar *key);
+
+/* Implemented by the core */
+gboolean uh_match_device(const gchar *driver, const gchar *name,
+                         const gchar *driver_match, const gchar *name_match);
+/* 'event' is opaque to the core and only passed back to get_property,
+ * which may be NULL if there are no properties */
+void uh_handle_uevent(const gchar *action, const gchar *sysfs_path,
+                      UhGetProperty get_property, gconstpointer event);
+
+#endif /* __UDEV_HELPER_BACKEND_H__ */
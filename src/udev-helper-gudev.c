@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include <gudev/gudev.h>
+
+#include "udev-helper-backend.h"
+
+/*
+ * libgudev uevent source for udev-helper.
+ */
+
+/* 'probe' is only used for enumeration, 'client' listens for uevents on the
+ * subsystems of the active board */
+static GUdevClient* probe = NULL;
+static GUdevClient* client = NULL;
+
+int uh_backend_init(void) {
+    /* Enumeration only, don't subscribe to any uevents yet */
+    probe = g_udev_client_new(NULL);
+    if (!probe)
+        return 1;
+
+    return 0;
+}
+
+gchar *uh_backend_find_device(const gchar* subsystem_match, const gchar* driver_match, const gchar* name_match) {
+    GList *l, *e;
+    GUdevDevice *dev;
+    gchar *res = NULL;
+
+    l = g_udev_client_query_by_subsystem(probe, subsystem_match);
+    for (e = l; e; e = e->next) {
+        dev = (GUdevDevice*)e->data;
+
+        if (uh_match_device(g_udev_device_get_driver(dev),
+                            g_udev_device_get_name(dev),
+                            driver_match, name_match)) {
+            res = g_strdup(g_udev_device_get_sysfs_path(dev));
+            break;
+        }
+    }
+
+    g_list_free_full(l, g_object_unref);
+
+    return res;
+}
+
+gchar *uh_backend_find_device_by_attr(const gchar* subsystem, const gchar* attr, UhAttrMatch match) {
+    GList *l, *e;
+    GUdevDevice *dev;
+    const gchar *value;
+    gchar *res = NULL;
+
+    l = g_udev_client_query_by_subsystem(probe, subsystem);
+    for (e = l; e; e = e->next) {
+        dev = (GUdevDevice*)e->data;
+        value = g_udev_device_get_sysfs_attr(dev, attr);
+
+        if (value && match(value)) {
+            res = g_strdup(g_udev_device_get_sysfs_path(dev));
+            break;
+        }
+    }
+
+    g_list_free_full(l, g_object_unref);
+
+    return res;
+}
+
+void uh_backend_probe_done(void) {
+    if (probe) {
+        g_object_unref(probe);
+        probe = NULL;
+    }
+}
+
+static const gchar* get_property(gconstpointer event, const gchar* key) {
+    return g_udev_device_get_property((GUdevDevice*)event, key);
+}
+
+static void on_uevent(GUdevClient *client, const char *action, GUdevDevice *device) {
+    (void)client;
+
+    uh_handle_uevent(action, g_udev_device_get_sysfs_path(device),
+                     get_property, device);
+}
+
+int uh_backend_listen(const gchar** subsystems, const gchar** paths) {
+    (void)paths;
+
+    client = g_udev_client_new(subsystems);
+    if (!client)
+        return 1;
+
+    g_signal_connect(client, "uevent", G_CALLBACK(on_uevent), NULL);
+
+    return 0;
+}
+
+void uh_backend_destroy(void) {
+    uh_backend_probe_done();
+
+    if (client) {
+        g_object_unref(client);
+        client = NULL;
+    }
+}
@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/filter.h>
+#include <glib.h>
+
+#include "udev-helper-backend.h"
+
+/*
+ * Native uevent source for udev-helper: reads kernel uevents straight from
+ * a NETLINK_KOBJECT_UEVENT socket, without libudev/libgudev.
+ *
+ * A classic BPF filter attached to the socket drops every uevent whose
+ * DEVPATH is not one of the watched devices, so the kernel only wakes us up
+ * for events we act on. The SUBSYSTEM key is at no fixed offset, it is
+ * checked after receiving.
+ *
+ * Kernel uevent messages look like:
+ *   "change@/devices/...\0ACTION=change\0DEVPATH=/devices/...\0SUBSYSTEM=..."
+ */
+
+#define SYSFS_ROOT "/sys"
+#define UEVENT_BUFFER_SIZE 4096
+
+/* The kernel multicast group, as opposed to the one udevd re-broadcasts on */
+#define UEVENT_GROUP_KERNEL 1
+
+static const gchar* const uevent_actions[] = {
+    "add", "remove", "change", "move", "online", "offline", "bind", "unbind",
+};
+
+static int nl_fd = -1;
+static GIOChannel* nl_channel = NULL;
+static guint nl_watch_id = 0;
+static gchar** listen_subsystems = NULL;
+static gchar** listen_paths = NULL;
+
+int uh_backend_init(void) {
+    return 0;
+}
+
+static gchar* link_basename(const gchar* dir, const gchar* link) {
+    gchar path[PATH_MAX], target[PATH_MAX];
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, link);
+    len = readlink(path, target, sizeof(target) - 1);
+    if (len < 0)
+        return NULL;
+    target[len] = '\0';
+
+    return g_path_get_basename(target);
+}
+
+typedef gboolean (*DirMatch)(const gchar* path, const gchar* name, gconstpointer data);
+
+static gchar* find_in_dir(const gchar* dir_path, DirMatch match, gconstpointer data) {
+    DIR* dir;
+    struct dirent* entry;
+    gchar path[PATH_MAX], real[PATH_MAX];
+    gchar* res = NULL;
+
+    dir = opendir(dir_path);
+    if (!dir)
+        return NULL;
+
+    while (!res && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (match(path, entry->d_name, data) && realpath(path, real) != NULL)
+            res = g_strdup(real);
+    }
+
+    closedir(dir);
+
+    return res;
+}
+
+/* Class devices (power_supply, extcon) first, then bus devices (platform) */
+static gchar* find_in_subsystem(const gchar* subsystem, DirMatch match, gconstpointer data) {
+    gchar path[PATH_MAX];
+    gchar* res;
+
+    snprintf(path, sizeof(path), SYSFS_ROOT "/class/%s", subsystem);
+    res = find_in_dir(path, match, data);
+    if (res)
+        return res;
+
+    snprintf(path, sizeof(path), SYSFS_ROOT "/bus/%s/devices", subsystem);
+    return find_in_dir(path, match, data);
+}
+
+typedef struct {
+    const gchar* driver;
+    const gchar* name;
+} DriverMatch;
+
+static gboolean match_driver(const gchar* path, const gchar* name, gconstpointer data) {
+    const DriverMatch* m = data;
+    gchar* driver = link_basename(path, "driver");
+    gboolean ok;
+
+    ok = uh_match_device(driver, name, m->driver, m->name);
+    g_free(driver);
+
+    return ok;
+}
+
+gchar* uh_backend_find_device(const gchar* subsystem, const gchar* driver_match, const gchar* name_match) {
+    DriverMatch m = { .driver = driver_match, .name = name_match };
+
+    return find_in_subsystem(subsystem, match_driver, &m);
+}
+
+typedef struct {
+    const gchar* attr;
+    UhAttrMatch match;
+} AttrMatch;
+
+static gboolean match_attr(const gchar* path, const gchar* name, gconstpointer data) {
+    const AttrMatch* m = data;
+    gchar *attr_path, *value;
+    gboolean ok = FALSE;
+    (void)name;
+
+    attr_path = g_strconcat(path, "/", m->attr, NULL);
+    if (g_file_get_contents(attr_path, &value, NULL, NULL)) {
+        ok = m->match(value);
+        g_free(value);
+    }
+    g_free(attr_path);
+
+    return ok;
+}
+
+gchar* uh_backend_find_device_by_attr(const gchar* subsystem, const gchar* attr, UhAttrMatch match) {
+    AttrMatch m = { .attr = attr, .match = match };
+
+    return find_in_subsystem(subsystem, match_attr, &m);
+}
+
+void uh_backend_probe_done(void) {
+}
+
+/*
+ * BPF program construction. Every block is built on its own; a failed
+ * comparison jumps to the end of the block it is in. Jump offsets are
+ * 8 bit, so blocks are limited in size.
+ */
+
+/* Placeholder jump target, replaced by the block's length in bpf_close() */
+#define BPF_TO_END 0xff
+#define BPF_MAX_BLOCK 0xfe
+
+static void bpf_emit(GArray* prog, guint16 code, guint8 jt, guint8 jf, guint32 k) {
+    struct sock_filter ins = BPF_JUMP(code, k, jt, jf);
+    g_array_append_val(prog, ins);
+}
+
+/* Compare len bytes of s with the packet at offset k (relative to X when
+ * mode is BPF_IND) */
+static void bpf_compare(GArray* prog, guint16 mode, const gchar* s, guint len, guint32 k) {
+    const guchar* u = (const guchar*)s;
+    guint i = 0;
+
+    while (len - i >= 4) {
+        bpf_emit(prog, BPF_LD | BPF_W | mode, 0, 0, k + i);
+        bpf_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, BPF_TO_END,
+                 (u[i] << 24) | (u[i + 1] << 16) | (u[i + 2] << 8) | u[i + 3]);
+        i += 4;
+    }
+    if (len - i >= 2) {
+        bpf_emit(prog, BPF_LD | BPF_H | mode, 0, 0, k + i);
+        bpf_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, BPF_TO_END,
+                 (u[i] << 8) | u[i + 1]);
+        i += 2;
+    }
+    if (len - i == 1) {
+        bpf_emit(prog, BPF_LD | BPF_B | mode, 0, 0, k + i);
+        bpf_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, BPF_TO_END, u[i]);
+    }
+}
+
+/* Resolve the BPF_TO_END jumps of a finished block and append it to prog */
+static gboolean bpf_close(GArray* prog, GArray* block) {
+    guint i;
+
+    if (block->len > BPF_MAX_BLOCK) {
+        g_array_free(block, TRUE);
+        return FALSE;
+    }
+
+    for (i = 0; i < block->len; i++) {
+        struct sock_filter* ins = &g_array_index(block, struct sock_filter, i);
+        if (BPF_CLASS(ins->code) == BPF_JMP && ins->jf == BPF_TO_END)
+            ins->jf = block->len - i - 1;
+    }
+
+    g_array_append_vals(prog, block->data, block->len);
+    g_array_free(block, TRUE);
+
+    return TRUE;
+}
+
+/*
+ * For every action:
+ *   if packet starts with "<action>@":
+ *     X = strlen("<action>@")
+ *     for every path: if packet[X..] is "<devpath>\0" accept
+ *     reject
+ * reject
+ */
+static GArray* bpf_build(const gchar** paths) {
+    GArray* prog = g_array_new(FALSE, FALSE, sizeof(struct sock_filter));
+    guint i, j;
+
+    for (i = 0; i < G_N_ELEMENTS(uevent_actions); i++) {
+        GArray* action = g_array_new(FALSE, FALSE, sizeof(struct sock_filter));
+        gchar* prefix = g_strconcat(uevent_actions[i], "@", NULL);
+        guint prefix_len = strlen(prefix);
+
+        bpf_compare(action, BPF_ABS, prefix, prefix_len, 0);
+        g_free(prefix);
+        bpf_emit(action, BPF_LDX | BPF_W | BPF_IMM, 0, 0, prefix_len);
+
+        for (j = 0; paths[j]; j++) {
+            GArray* path = g_array_new(FALSE, FALSE, sizeof(struct sock_filter));
+            const gchar* devpath = paths[j] + strlen(SYSFS_ROOT);
+            guint devpath_len = strlen(devpath);
+
+            bpf_compare(path, BPF_IND, devpath, devpath_len, 0);
+            bpf_emit(path, BPF_LD | BPF_B | BPF_IND, 0, 0, devpath_len);
+            bpf_emit(path, BPF_JMP | BPF_JEQ | BPF_K, 0, BPF_TO_END, 0);
+            bpf_emit(path, BPF_RET | BPF_K, 0, 0, 0xffffffff);
+
+            if (!bpf_close(action, path)) {
+                g_array_free(action, TRUE);
+                g_array_free(prog, TRUE);
+                return NULL;
+            }
+        }
+        bpf_emit(action, BPF_RET | BPF_K, 0, 0, 0);
+
+        if (!bpf_close(prog, action)) {
+            g_array_free(prog, TRUE);
+            return NULL;
+        }
+    }
+    bpf_emit(prog, BPF_RET | BPF_K, 0, 0, 0);
+
+    return prog;
+}
+
+static void attach_filter(const gchar** paths) {
+    struct sock_fprog fprog;
+    GArray* prog;
+    guint i;
+
+    for (i = 0; paths[i]; i++) {
+        if (!g_str_has_prefix(paths[i], SYSFS_ROOT "/")) {
+            fprintf(stderr, "Not filtering uevents, odd path %s\n", paths[i]);
+            return;
+        }
+    }
+
+    prog = bpf_build(paths);
+    if (!prog) {
+        fprintf(stderr, "Not filtering uevents, paths too long\n");
+        return;
+    }
+
+    fprog.len = prog->len;
+    fprog.filter = (struct sock_filter*)prog->data;
+    if (setsockopt(nl_fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+        fprintf(stderr, "SO_ATTACH_FILTER failed: %s\n", strerror(errno));
+
+    g_array_free(prog, TRUE);
+}
+
+/* The environment part of a received uevent, a list of KEY=value strings */
+typedef struct {
+    const gchar* env;
+    const gchar* end;
+} UeventMsg;
+
+static const gchar* uevent_get(gconstpointer event, const gchar* key) {
+    const UeventMsg* msg = event;
+    const gchar* p = msg->env;
+    size_t key_len = strlen(key);
+
+    while (p < msg->end) {
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == '=')
+            return p + key_len + 1;
+        p += strlen(p) + 1;
+    }
+
+    return NULL;
+}
+
+static void handle_message(gchar* buf, gssize len) {
+    gchar path[PATH_MAX];
+    const gchar* subsystem;
+    gchar* devpath;
+    UeventMsg msg;
+
+    /* The buffer has room for the terminator, see read_uevents() */
+    buf[len] = '\0';
+
+    msg.env = buf + strlen(buf) + 1;
+    msg.end = buf + len;
+
+    devpath = strchr(buf, '@');
+    if (!devpath)
+        return;
+    *devpath++ = '\0';
+
+    subsystem = uevent_get(&msg, "SUBSYSTEM");
+    if (!subsystem || (listen_subsystems[0] &&
+        !g_strv_contains((const gchar* const*)listen_subsystems, subsystem)))
+        return;
+
+    snprintf(path, sizeof(path), SYSFS_ROOT "%s", devpath);
+    uh_handle_uevent(buf, path, uevent_get, &msg);
+}
+
+static gboolean read_uevents(GIOChannel* src, GIOCondition cond, gpointer data) {
+    gchar buf[UEVENT_BUFFER_SIZE + 1];
+    struct sockaddr_nl addr;
+    struct iovec iov = { .iov_base = buf, .iov_len = UEVENT_BUFFER_SIZE };
+    struct msghdr msg = {
+        .msg_name = &addr,
+        .msg_namelen = sizeof(addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    ssize_t len;
+    int i;
+    (void)src;
+    (void)cond;
+    (void)data;
+
+    for (;;) {
+        msg.msg_namelen = sizeof(addr);
+        len = recvmsg(nl_fd, &msg, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                /* We lost events, have every port re-read its state */
+                fprintf(stderr, "uevent socket overrun\n");
+                for (i = 0; listen_paths[i]; i++)
+                    uh_handle_uevent("change", listen_paths[i], NULL, NULL);
+                continue;
+            }
+            if (errno != EAGAIN)
+                fprintf(stderr, "recvmsg failed: %s\n", strerror(errno));
+            return TRUE;
+        }
+
+        /* Only trust the kernel */
+        if (addr.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC))
+            continue;
+
+        handle_message(buf, len);
+    }
+}
+
+int uh_backend_listen(const gchar** subsystems, const gchar** paths) {
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = UEVENT_GROUP_KERNEL,
+    };
+
+    nl_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                   NETLINK_KOBJECT_UEVENT);
+    if (nl_fd < 0) {
+        fprintf(stderr, "uevent socket failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    attach_filter(paths);
+
+    if (bind(nl_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "uevent bind failed: %s\n", strerror(errno));
+        close(nl_fd);
+        nl_fd = -1;
+        return 1;
+    }
+
+    listen_subsystems = g_strdupv((gchar**)subsystems);
+    listen_paths = g_strdupv((gchar**)paths);
+
+    nl_channel = g_io_channel_unix_new(nl_fd);
+    nl_watch_id = g_io_add_watch(nl_channel, G_IO_IN, read_uevents, NULL);
+
+    return 0;
+}
+
+void uh_backend_destroy(void) {
+    if (nl_watch_id) {
+        g_source_remove(nl_watch_id);
+        nl_watch_id = 0;
+    }
+
+    if (nl_channel) {
+        g_io_channel_unref(nl_channel);
+        nl_channel = NULL;
+    }
+
+    if (nl_fd >= 0) {
+        close(nl_fd);
+        nl_fd = -1;
+    }
+
+    g_strfreev(listen_subsystems);
+    listen_subsystems = NULL;
+    g_strfreev(listen_paths);
+    listen_paths = NULL;
+}
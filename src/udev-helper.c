@@ -2,11 +2,14 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <glib.h>
 
-#include <gudev/gudev.h>
-
 #include "udev-helper.h"
+#include "udev-helper-backend.h"
+#include "probe-cache.h"
 
 
 /*
@@ -30,10 +33,43 @@ typedef struct {
 
 typedef struct {
     const gchar* name;
-    const DeviceDriver usb_driver;
-    const DeviceDriver supply_driver;
+    DeviceDriver usb_driver;
+    DeviceDriver supply_driver;
+    /* Optional usb_role switch, reports the role directly */
+    DeviceDriver role_driver;
+} PortDrivers;
+
+/* Most boards have one, some have a separate role switch or Type-C port */
+#define UH_MAX_PORTS 4
+
+typedef struct {
+    const gchar* name;
+    /* Terminated by an entry without a name */
+    PortDrivers ports[UH_MAX_PORTS + 1];
+    /* Upper bound (ms) on how long we keep re-reading the state after a
+     * uevent before reporting whatever we have. 0 means UH_SETTLE_MAX_MS. */
+    guint settle_max_ms;
+    /* Device tree compatible strings of the board, or "dmi:<product>" for
+     * x86 machines, NULL terminated */
+    const gchar* const* compatible;
 } DeviceDrivers;
 
+/*
+ * Board profiles are picked by the machine's device tree compatible (or DMI
+ * product name) in one lookup. Entries from BOARDS_FILE take precedence
+ * over the built-in drivers[] table. If nothing matches, a generic probe
+ * looks for any USB power supply and any device with a musb style mode.
+ *
+ * A board has one or more ports, each with its own otg (musb mode) and
+ * supply devices. They are tracked independently: every port has its own
+ * cached state, settle timer and callback.
+ */
+#define BOARDS_FILE "/etc/ke-recv/boards.ini"
+#define DT_COMPATIBLE_FILE "/proc/device-tree/compatible"
+#define DMI_PRODUCT_FILE "/sys/class/dmi/id/product_name"
+/* Group in the probe cache, see probe-cache.h */
+#define PROBE_CACHE_GROUP "udev-helper"
+
 /*
  *
  * TODO:
@@ -41,7 +77,6 @@ typedef struct {
  * - Rework usb_plugin.c to use libusbgx [1]
  * - Test on device with proper otg detection (droid4, lime2) and add/implement
  *   USB_MODE_*
- * - Figure out how to free `client`
  * - Run through valgrind
  * - Fix naming of 'otg driver' -- should be UDC I think...
  *
@@ -53,307 +88,1421 @@ typedef struct {
     gint supply_mode;
 } PrivData;
 
-static gpointer user_data = NULL;
-static UhCallback user_callback = NULL;
+/* Default settle ceiling, matches the old fixed delay */
+#define UH_SETTLE_MAX_MS 1000
 
-static GUdevClient* client = NULL;
-static GUdevDevice* otg = NULL;
-static GUdevDevice* supply = NULL;
-static DeviceDrivers *active_device;
+/* Delays between consecutive state reads after a uevent. The last step is
+ * repeated until the board's settle ceiling is reached. */
+static const guint settle_steps[] = { 10, 25, 50, 100 };
+
+/*
+ * There is only ever one pending refresh per port. Uevents arriving while it is
+ * pending bump 'generation' and are absorbed into it instead of queueing
+ * another one; a sample only counts towards agreement if it was taken in
+ * the current generation.
+ */
+typedef struct {
+    guint id;          /* timeout source, 0 if not settling */
+    guint step;        /* index into settle_steps */
+    guint elapsed;     /* ms spent settling so far */
+    guint generation;  /* bumped on every relevant uevent */
+    gboolean sampled;  /* whether 'sample' holds a previous read */
+    guint sample_generation;
+    PrivData sample;
+
+    /* supply mode decoded from the last supply uevent, if it had one */
+    gboolean have_event_supply;
+    gint event_supply;
+
+    /* statistics, see uh_port_get_stats() */
+    guint events;
+    guint absorbed;
+    guint callbacks;
+} SettleData;
+
+/*
+ * The mode and type attributes are opened once when the devices are found
+ * and re-read with pread() at offset 0, which makes sysfs regenerate the
+ * value. A state query then costs one syscall per attribute and no
+ * allocations.
+ */
+typedef struct {
+    const gchar* name;
+    int fd;
+} SysfsAttr;
+
+/* Large enough for every value we classify */
+#define ATTR_BUF_SIZE 32
+
+static void attr_close(SysfsAttr* attr) {
+    if (attr->fd >= 0) {
+        close(attr->fd);
+        attr->fd = -1;
+    }
+}
+
+static void attr_open(SysfsAttr* attr, const gchar* sysfs_path) {
+    gchar path[PATH_MAX];
+
+    attr_close(attr);
+    if (!sysfs_path)
+        return;
+
+    snprintf(path, sizeof(path), "%s/%s", sysfs_path, attr->name);
+    attr->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (attr->fd < 0)
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+}
+
+/* Reads the attribute into buf without the trailing newline, returns the
+ * length or -1 */
+static int attr_read(const SysfsAttr* attr, gchar* buf, size_t size) {
+    ssize_t len;
+
+    if (attr->fd < 0)
+        return -1;
+
+    do {
+        len = pread(attr->fd, buf, size - 1, 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0)
+        return -1;
+
+    if (len > 0 && buf[len - 1] == '\n')
+        len--;
+    buf[len] = '\0';
+
+    return len;
+}
+
+/* b_idle, b_peripheral, b_host, a_idle, a_peripheral, a_host */
+static gint classify_usb_mode(const gchar* s, int len) {
+    gboolean b;
+
+    if (len < 6 || s[1] != '_')
+        return USB_MODE_UNKNOWN;
+
+    switch (s[0]) {
+    case 'a':
+        b = FALSE;
+        break;
+    case 'b':
+        b = TRUE;
+        break;
+    default:
+        return USB_MODE_UNKNOWN;
+    }
+
+    switch (s[2]) {
+    case 'i':
+        if (len == 6 && memcmp(s + 2, "idle", 4) == 0)
+            return b ? USB_MODE_B_IDLE : USB_MODE_A_IDLE;
+        break;
+    case 'p':
+        if (len == 12 && memcmp(s + 2, "peripheral", 10) == 0)
+            return b ? USB_MODE_B_PERIPHERAL : USB_MODE_A_PERIPHERAL;
+        break;
+    case 'h':
+        if (len == 6 && memcmp(s + 2, "host", 4) == 0)
+            return b ? USB_MODE_B_HOST : USB_MODE_A_HOST;
+        break;
+    }
+
+    return USB_MODE_UNKNOWN;
+}
+
+/* USB, USB_CDP, USB_DCP */
+static gint classify_supply_type(const gchar* s, int len) {
+    if (len < 3 || memcmp(s, "USB", 3) != 0)
+        return USB_SUPPLY_UNKNOWN;
+
+    switch (len) {
+    case 3:
+        return USB_SUPPLY_NONE;
+    case 7:
+        if (s[3] != '_' || s[6] != 'P')
+            break;
+        switch (s[4]) {
+        case 'C':
+            if (s[5] == 'D')
+                return USB_SUPPLY_CDP;
+            break;
+        case 'D':
+            if (s[5] == 'C')
+                return USB_SUPPLY_DCP;
+            break;
+        }
+        break;
+    }
+
+    return USB_SUPPLY_UNKNOWN;
+}
+
+/*
+ * Direct role and charger sources. Where a port has a usb_role switch, or
+ * its supply is an extcon device with USB/USB-HOST cables, the role is read
+ * from there instead of the musb mode, and uevents from them are reported
+ * right away without settling: the kernel updates those attributes before
+ * sending the uevent. extcon charger cables (SDP/CDP/DCP) give the supply
+ * type on boards without a power_supply node.
+ */
+
+/* none, host, device; "device" is only a cable if VBUS says so */
+static gint classify_role(const gchar* s, int len) {
+    if (len == 4 && memcmp(s, "host", 4) == 0)
+        return USB_MODE_A_HOST;
+    if (len == 6 && memcmp(s, "device", 6) == 0)
+        return USB_MODE_B_PERIPHERAL;
+    if (len == 4 && memcmp(s, "none", 4) == 0)
+        return USB_MODE_B_IDLE;
+
+    return USB_MODE_UNKNOWN;
+}
+
+enum {
+    CABLE_NONE = 0,
+    CABLE_USB,
+    CABLE_USB_HOST,
+    CABLE_SDP,
+    CABLE_CDP,
+    CABLE_DCP,
+};
+
+static gint classify_cable(const gchar* s, int len) {
+    if (len == 3 && memcmp(s, "USB", 3) == 0)
+        return CABLE_USB;
+    if (len == 8 && memcmp(s, "USB-HOST", 8) == 0)
+        return CABLE_USB_HOST;
+    if (len == 3 && memcmp(s, "SDP", 3) == 0)
+        return CABLE_SDP;
+    if (len == 3 && memcmp(s, "CDP", 3) == 0)
+        return CABLE_CDP;
+    if (len == 3 && memcmp(s, "DCP", 3) == 0)
+        return CABLE_DCP;
+
+    return CABLE_NONE;
+}
 
-static PrivData cache = { .usb_mode = USB_MODE_UNKNOWN,
-                          .supply_mode = USB_SUPPLY_UNKNOWN };
+/* extcon supports 32 cables per device, boards use a handful */
+#define UH_MAX_CABLES 8
+
+typedef struct {
+    gint kind;
+    SysfsAttr state;
+} ExtconCable;
+
+struct uh_port {
+    gchar* name;
+    /* sysfs paths of the port's devices */
+    gchar* otg;
+    gchar* supply;
+    gchar* role;
+    SysfsAttr usb_mode_attr;
+    SysfsAttr supply_type_attr;
+    SysfsAttr supply_online_attr;
+    SysfsAttr role_attr;
+
+    /* extcon cables we understand, if the supply is an extcon device */
+    ExtconCable cables[UH_MAX_CABLES];
+    guint n_cables;
+    gboolean role_cables;
+
+    PrivData cache;
+    PrivData reported;
+    SettleData settle;
+
+    UhCallback callback;
+    gpointer user_data;
+};
+
+static DeviceDrivers *active_device;
+static uh_port_t* ports[UH_MAX_PORTS];
+static guint n_ports = 0;
 
 static DeviceDrivers drivers[] = {
     {
         .name = "Nokia N900",
-        .usb_driver = {
-            .present = TRUE,
-            .subsystem = "platform",
-            .driver = "musb-hdrc",
-            .name = NULL,
-        },
-        .supply_driver = {
-            .present = TRUE,
-            .subsystem = "power_supply",
-            .driver = NULL,
-            .name = "isp1704",
+        .ports = {
+            {
+                .name = "usb",
+                .usb_driver = {
+                    .present = TRUE,
+                    .subsystem = "platform",
+                    .driver = "musb-hdrc",
+                    .name = NULL,
+                },
+                .supply_driver = {
+                    .present = TRUE,
+                    .subsystem = "power_supply",
+                    .driver = NULL,
+                    .name = "isp1704",
+                },
+            },
         },
+        .settle_max_ms = 500,
+        .compatible = (const gchar* const[]) { "nokia,omap3-n900", NULL },
     },
     {
         .name = "LIME2",
-        .usb_driver = {
-            .present = TRUE,
-            .subsystem = "platform",
-            .driver = "musb-hdrc",
-            .name = NULL,
+        .ports = {
+            {
+                .name = "usb",
+                .usb_driver = {
+                    .present = TRUE,
+                    .subsystem = "platform",
+                    .driver = "musb-hdrc",
+                    .name = NULL,
+                },
+                /* The extcon USB/USB-HOST cables give the role right away,
+                 * the musb mode is only used if they are missing */
+                .supply_driver = {
+                    .present = TRUE,
+                    .subsystem = "extcon",
+                    .driver = NULL,
+                    .name = "extcon0",
+                },
+            },
         },
-        /* We can't read the mode from extcon, but at least we can use this to
-         * trigger on cable plugs and report on musb modes */
-        .supply_driver = {
-            .present = TRUE,
-            .subsystem = "extcon",
-            .driver = NULL,
-            .name = "extcon0",
+        .settle_max_ms = 1000,
+        .compatible = (const gchar* const[]) {
+            "olimex,a20-olinuxino-lime2",
+            "olimex,a20-olinuxino-lime2-emmc",
+            NULL
         },
     },
     {
         .name = "PinePhone Devkit 1.x",
-        .usb_driver = {
-            .present = TRUE,
-            .subsystem = "platform",
-            .driver = "musb-hdrc",
-            .name = NULL,
+        .ports = {
+            {
+                .name = "usb",
+                .usb_driver = {
+                    .present = TRUE,
+                    .subsystem = "platform",
+                    .driver = "musb-hdrc",
+                    .name = NULL,
+                },
+                /* The extcon USB/USB-HOST cables give the role right away,
+                 * the musb mode is only used if they are missing */
+                .supply_driver = {
+                    .present = TRUE,
+                    .subsystem = "extcon",
+                    .driver = NULL,
+                    .name = "extcon1",
+                },
+            },
         },
-        /* We can't read the mode from extcon, but at least we can use this to
-         * trigger on cable plugs and report on musb modes */
-        .supply_driver = {
-            .present = TRUE,
-            .subsystem = "extcon",
-            .driver = NULL,
-            .name = "extcon1",
+        .settle_max_ms = 1000,
+        .compatible = (const gchar* const[]) {
+            "pine64,pinephone-1.0",
+            "pine64,pinephone-1.1",
+            NULL
         },
     },
     {
         .name = "Motorola Droid 4",
-        .usb_driver = {
-            .present = TRUE,
-            .subsystem = "platform",
-            .driver = "musb-hdrc",
-            .name = NULL,
+        .ports = {
+            {
+                .name = "usb",
+                .usb_driver = {
+                    .present = TRUE,
+                    .subsystem = "platform",
+                    .driver = "musb-hdrc",
+                    .name = NULL,
+                },
+                .supply_driver = {
+                    .present = TRUE,
+                    .subsystem = "power_supply",
+                    .driver = NULL,
+                    .name = "battery",
+                },
+            },
         },
-        /* We can't read the mode from extcon, but at least we can use this to
-         * trigger on cable plugs and report on musb modes */
-        .supply_driver = {
-            .present = TRUE,
-            .subsystem = "power_supply",
-            .driver = NULL,
-            .name = "battery",
+        /* The battery node sends uevents on every capacity change */
+        .settle_max_ms = 250,
+        .compatible = (const gchar* const[]) { "motorola,droid4", NULL },
+    },
+};
+
+/* Used when no profile matches, see probe_generic() */
+static DeviceDrivers generic_device = {
+    .name = "Generic",
+    .ports = {
+        {
+            .name = "usb",
+            .usb_driver = {
+                .present = TRUE,
+                .subsystem = "platform",
+            },
+            .supply_driver = {
+                .present = TRUE,
+                .subsystem = "power_supply",
+            },
         },
     },
 };
-/* TODO: Also add generic best-effort later on, perhaps with attr matching? */
-
-
-static gint read_usb_mode(void) {
-    const gchar* otg_sysfs_path = g_udev_device_get_sysfs_path(otg);
-    gchar* path;
-    gchar *strmode = NULL;
-    int mode;
-
-    mode = USB_MODE_UNKNOWN;
-
-    path = g_strconcat(otg_sysfs_path, "/mode", NULL);
-    gboolean ok = g_file_get_contents(path, &strmode, NULL, NULL);
-    if (ok) {
-        if (strcmp(strmode, "b_idle\n") == 0) {
-            mode = USB_MODE_B_IDLE;
-        } else if (strcmp(strmode, "b_peripheral\n") == 0) {
-            mode = USB_MODE_B_PERIPHERAL;
-        } else if (strcmp(strmode, "b_host\n") == 0) {
-            mode = USB_MODE_B_HOST;
-        } else if (strcmp(strmode, "a_idle\n") == 0) {
-            mode = USB_MODE_A_IDLE;
-        } else if (strcmp(strmode, "a_peripheral\n") == 0) {
-            mode = USB_MODE_A_PERIPHERAL;
-        } else if (strcmp(strmode, "a_host\n") == 0) {
-            mode = USB_MODE_A_HOST;
-        }
 
-        free(strmode);
+/* compatible string -> DeviceDrivers */
+static GHashTable* profiles = NULL;
+/* DeviceDrivers loaded from BOARDS_FILE */
+static GSList* loaded_profiles = NULL;
+
+
+static gint read_usb_mode(uh_port_t* port) {
+    gchar buf[ATTR_BUF_SIZE];
+    int len;
+
+    len = attr_read(&port->usb_mode_attr, buf, sizeof(buf));
+    if (len < 0)
+        return USB_MODE_UNKNOWN;
+
+    return classify_usb_mode(buf, len);
+}
+
+static gint read_supply_mode(uh_port_t* port) {
+    gchar buf[ATTR_BUF_SIZE];
+    int len;
+
+    len = attr_read(&port->supply_type_attr, buf, sizeof(buf));
+    if (len < 0)
+        return USB_SUPPLY_UNKNOWN;
+
+    return classify_supply_type(buf, len);
+}
+
+/* Opens the state of every cable.N we understand below an extcon device */
+static void open_cables(uh_port_t* port) {
+    gchar path[PATH_MAX];
+    gchar* name;
+    guint i;
+
+    for (i = 0; port->n_cables < UH_MAX_CABLES; i++) {
+        ExtconCable* cable = &port->cables[port->n_cables];
+        gint kind;
+
+        snprintf(path, sizeof(path), "%s/cable.%u/name", port->supply, i);
+        if (!g_file_get_contents(path, &name, NULL, NULL))
+            break;
+        g_strstrip(name);
+        kind = classify_cable(name, strlen(name));
+        g_free(name);
+        if (kind == CABLE_NONE)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/cable.%u", port->supply, i);
+        cable->kind = kind;
+        cable->state.name = "state";
+        cable->state.fd = -1;
+        attr_open(&cable->state, path);
+        if (cable->state.fd < 0)
+            continue;
+
+        if (kind == CABLE_USB || kind == CABLE_USB_HOST)
+            port->role_cables = TRUE;
+        port->n_cables++;
     }
-    free(path);
+}
+
+static void close_cables(uh_port_t* port) {
+    guint i;
 
-    return mode;
+    for (i = 0; i < port->n_cables; i++)
+        attr_close(&port->cables[i].state);
+    port->n_cables = 0;
+    port->role_cables = FALSE;
 }
 
-static gint read_supply_mode(void) {
-    const gchar* supply_sysfs_path = g_udev_device_get_sysfs_path(supply);
-    gchar* path;
-    gchar *strmode = NULL;
-    int mode;
+/* Bitmask of the attached CABLE_* */
+static guint read_cables(uh_port_t* port) {
+    gchar buf[ATTR_BUF_SIZE];
+    guint i, attached = 0;
+
+    for (i = 0; i < port->n_cables; i++) {
+        if (attr_read(&port->cables[i].state, buf, sizeof(buf)) == 1 &&
+            buf[0] == '1')
+            attached |= 1 << port->cables[i].kind;
+    }
 
-    mode = USB_SUPPLY_UNKNOWN;
+    return attached;
+}
 
-    path = g_strconcat(supply_sysfs_path, "/type", NULL);
-    gboolean ok = g_file_get_contents(path, &strmode, NULL, NULL);
-    if (ok) {
-        if (strcmp(strmode, "USB_CDP\n") == 0) {
-            mode = USB_SUPPLY_CDP;
-        } else if (strcmp(strmode, "USB_DCP\n") == 0) {
-            mode = USB_SUPPLY_DCP;
-        } else if (strcmp(strmode, "USB\n") == 0) {
-            mode = USB_SUPPLY_NONE;
-        }
+/*
+ * Whether something is feeding VBUS: a USB or charger cable on extcon, or
+ * the power supply being online. FALSE if the port has neither source.
+ */
+static gboolean vbus_present(uh_port_t* port, guint cables) {
+    gchar buf[ATTR_BUF_SIZE];
+
+    if (cables & ((1 << CABLE_USB) | (1 << CABLE_SDP) | (1 << CABLE_CDP) |
+                  (1 << CABLE_DCP)))
+        return TRUE;
+    return port->supply_online_attr.fd >= 0 &&
+           attr_read(&port->supply_online_attr, buf, sizeof(buf)) == 1 &&
+           buf[0] == '1';
+}
+
+/* Whether uevents of this port can be acted on without settling */
+static gboolean port_is_direct(const uh_port_t* port) {
+    return port->role_attr.fd >= 0 || port->role_cables;
+}
 
-        free(strmode);
+/*
+ * extcon and usb_role only tell host from device side: their USB cable and
+ * "device" role are set for a wall charger as well. A data host is only
+ * assumed when the musb mode, an SDP/CDP cable or the supply type says so.
+ */
+static gint device_mode(uh_port_t* port, guint cables, gint supply_mode) {
+    gint mode;
+
+    if (!vbus_present(port, cables) || supply_mode == USB_SUPPLY_DCP)
+        return USB_MODE_B_IDLE;
+
+    mode = read_usb_mode(port);
+    if (mode == USB_MODE_B_IDLE || mode == USB_MODE_B_PERIPHERAL)
+        return mode;
+
+    if (supply_mode == USB_SUPPLY_CDP ||
+        (supply_mode == USB_SUPPLY_NONE &&
+         (!port->n_cables || (cables & (1 << CABLE_SDP)))))
+        return USB_MODE_B_PERIPHERAL;
+
+    return USB_MODE_B_IDLE;
+}
+
+/* Reads the current state from the most direct source available */
+static void read_current(uh_port_t* port, PrivData* data) {
+    gchar buf[ATTR_BUF_SIZE];
+    guint cables = 0;
+    int len;
+
+    if (port->n_cables)
+        cables = read_cables(port);
+
+    if (port->settle.have_event_supply) {
+        data->supply_mode = port->settle.event_supply;
+    } else if (port->n_cables) {
+        if (cables & (1 << CABLE_DCP))
+            data->supply_mode = USB_SUPPLY_DCP;
+        else if (cables & (1 << CABLE_CDP))
+            data->supply_mode = USB_SUPPLY_CDP;
+        else if (cables & ((1 << CABLE_SDP) | (1 << CABLE_USB)))
+            data->supply_mode = USB_SUPPLY_NONE;
+        else
+            data->supply_mode = USB_SUPPLY_UNKNOWN;
+    } else if (port->supply) {
+        data->supply_mode = read_supply_mode(port);
+    } else {
+        data->supply_mode = USB_SUPPLY_UNKNOWN;
     }
-    free(path);
 
-    return mode;
+    data->usb_mode = USB_MODE_UNKNOWN;
+    if (port->role_attr.fd >= 0) {
+        len = attr_read(&port->role_attr, buf, sizeof(buf));
+        if (len >= 0)
+            data->usb_mode = classify_role(buf, len);
+        if (data->usb_mode == USB_MODE_B_PERIPHERAL)
+            data->usb_mode = device_mode(port, cables, data->supply_mode);
+    } else if (port->role_cables) {
+        if (cables & (1 << CABLE_USB_HOST))
+            data->usb_mode = USB_MODE_A_HOST;
+        else if (cables & (1 << CABLE_USB))
+            data->usb_mode = device_mode(port, cables, data->supply_mode);
+        else
+            data->usb_mode = USB_MODE_B_IDLE;
+    }
+    if (data->usb_mode == USB_MODE_UNKNOWN)
+        data->usb_mode = read_usb_mode(port);
 }
 
-static GUdevDevice* find_device(const gchar* subsystem_match, const gchar* driver_match, const gchar* name_match) {
-    GList *l, *e;
-    GUdevDevice *dev, *res = NULL;
+gboolean uh_match_device(const gchar* driver, const gchar* name,
+                         const gchar* driver_match, const gchar* name_match) {
+    if (driver && name && driver_match && name_match) {
+        return (strcmp(driver, driver_match) == 0) &&
+               (strcmp(name, name_match) == 0);
+    } else if (driver && driver_match && (strcmp(driver, driver_match) == 0)) {
+        return TRUE;
+    } else if (name && name_match && (strcmp(name, name_match) == 0)) {
+        return TRUE;
+    }
 
-    l = g_udev_client_query_by_subsystem(client, subsystem_match);
-    for (e = l; e; e = e->next) {
-        const gchar* driver;
-        const gchar* name;
+    return FALSE;
+}
 
-        dev = (GUdevDevice*)e->data;
-        driver = g_udev_device_get_driver(dev);
-        name = g_udev_device_get_name(dev);
+/*
+ * sysfs path -> PortWatch, for the devices whose uevents we act on. A
+ * device shared by several ports (e.g. one battery node) chains them.
+ */
+typedef struct PortWatch {
+    uh_port_t* port;
+    gint what;
+    struct PortWatch* next;
+} PortWatch;
+
+static GHashTable* watched = NULL;
+
+enum {
+    UH_WATCH_OTG = 1,
+    UH_WATCH_SUPPLY,
+    UH_WATCH_ROLE,
+};
 
-        if (driver && name && driver_match && name_match) {
-            if ((strcmp(driver, driver_match) == 0) &&
-                (strcmp(name, name_match) == 0)) {
-                res = dev;
-                goto DONE;
-            }
-        } else if (driver && driver_match && (strcmp(driver, driver_match) == 0)) {
-            res = dev;
-            goto DONE;
-        } else if (name && name_match && (strcmp(name, name_match) == 0)) {
-            res = dev;
-            goto DONE;
-        }
+static void free_watch(gpointer data) {
+    PortWatch* w = data;
+
+    while (w) {
+        PortWatch* next = w->next;
+        g_free(w);
+        w = next;
     }
+}
+
+static void add_string(const gchar** list, int* n, const gchar* s) {
+    int i;
 
-DONE:
-    g_list_free(l);
+    if (!s)
+        return;
 
-    return res;
+    for (i = 0; i < *n; i++)
+        if (strcmp(list[i], s) == 0)
+            return;
+
+    list[(*n)++] = s;
 }
 
-static int setup_udev(void) {
-    const gchar *subsystems[] = { NULL};
-    client = g_udev_client_new(subsystems);
-    if (!client)
-        return 1;
+static void watch_device(uh_port_t* port, const gchar* sysfs_path, gint what) {
+    PortWatch *w, *head;
 
-    return 0;
+    if (!sysfs_path)
+        return;
+
+    w = g_new0(PortWatch, 1);
+    w->port = port;
+    w->what = what;
+
+    head = g_hash_table_lookup(watched, sysfs_path);
+    if (head) {
+        w->next = head->next;
+        head->next = w;
+    } else {
+        g_hash_table_insert(watched, g_strdup(sysfs_path), w);
+    }
 }
 
-static int find_devices(void) {
+/* Subscribe only to the subsystems and devices the active board uses */
+static int setup_listener(void) {
+    const gchar* subsystems[3 * UH_MAX_PORTS + 2] = { NULL };
+    const gchar* paths[3 * UH_MAX_PORTS + 1] = { NULL };
+    const PortDrivers* p;
+    int n = 0, m = 0;
+    guint i;
+
+    for (p = active_device->ports; p->name; p++) {
+        if (p->supply_driver.present)
+            add_string(subsystems, &n, p->supply_driver.subsystem);
+        if (p->usb_driver.present)
+            add_string(subsystems, &n, p->usb_driver.subsystem);
+        if (p->role_driver.present)
+            add_string(subsystems, &n, p->role_driver.subsystem);
+    }
+
+    watched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                    free_watch);
+    for (i = 0; i < n_ports; i++) {
+        watch_device(ports[i], ports[i]->supply, UH_WATCH_SUPPLY);
+        watch_device(ports[i], ports[i]->otg, UH_WATCH_OTG);
+        watch_device(ports[i], ports[i]->role, UH_WATCH_ROLE);
+        add_string(paths, &m, ports[i]->supply);
+        add_string(paths, &m, ports[i]->otg);
+        add_string(paths, &m, ports[i]->role);
+    }
+
+    /* The generic profile only knows of a role switch once it found one */
+    for (i = 0; i < n_ports; i++)
+        if (ports[i]->role)
+            add_string(subsystems, &n, "usb_role");
+
+    return uh_backend_listen(subsystems, paths);
+}
+
+static void load_driver(GKeyFile* kf, const gchar* group, const gchar* prefix, DeviceDriver* d) {
+    gchar* key;
+
+    key = g_strconcat(prefix, "Subsystem", NULL);
+    d->subsystem = g_key_file_get_string(kf, group, key, NULL);
+    g_free(key);
+    key = g_strconcat(prefix, "Driver", NULL);
+    d->driver = g_key_file_get_string(kf, group, key, NULL);
+    g_free(key);
+    key = g_strconcat(prefix, "Name", NULL);
+    d->name = g_key_file_get_string(kf, group, key, NULL);
+    g_free(key);
+
+    d->present = d->subsystem != NULL;
+}
+
+static void free_driver(DeviceDriver* d) {
+    g_free((gchar*)d->subsystem);
+    g_free((gchar*)d->driver);
+    g_free((gchar*)d->name);
+}
+
+static void free_profile(gpointer data) {
+    DeviceDrivers* d = data;
+    PortDrivers* p;
+
+    g_free((gchar*)d->name);
+    for (p = d->ports; p->name; p++) {
+        g_free((gchar*)p->name);
+        free_driver(&p->usb_driver);
+        free_driver(&p->supply_driver);
+        free_driver(&p->role_driver);
+    }
+    g_strfreev((gchar**)d->compatible);
+    g_free(d);
+}
+
+static void add_profile(DeviceDrivers* d) {
+    const gchar* const* c;
+
+    /* First one wins, the file is loaded before the built-in table */
+    for (c = d->compatible; c && *c; c++) {
+        if (!g_hash_table_contains(profiles, *c))
+            g_hash_table_insert(profiles, (gpointer)*c, d);
+    }
+}
+
+/*
+ * [Board name]
+ * Compatible=vendor,board;dmi:Product Name;
+ * UsbSubsystem=platform
+ * UsbDriver=musb-hdrc
+ * SupplySubsystem=power_supply
+ * SupplyName=isp1704
+ * RoleSubsystem=usb_role
+ * RoleName=musb-role-switch
+ * SettleMaxMs=500
+ *
+ * Boards with several ports list them and prefix the keys with the port:
+ *
+ * Ports=otg;typec;
+ * otg.UsbSubsystem=platform
+ * typec.SupplySubsystem=power_supply
+ * ...
+ */
+static DeviceDrivers* load_profile(GKeyFile* kf, const gchar* group) {
+    DeviceDrivers* d = g_new0(DeviceDrivers, 1);
+    gchar** names;
+    gchar* prefix;
+    gsize n, i;
+
+    d->name = g_strdup(group);
+    d->settle_max_ms = g_key_file_get_integer(kf, group, "SettleMaxMs", NULL);
+    d->compatible = (const gchar* const*)
+        g_key_file_get_string_list(kf, group, "Compatible", NULL, NULL);
+
+    names = g_key_file_get_string_list(kf, group, "Ports", &n, NULL);
+    if (!names) {
+        d->ports[0].name = g_strdup("usb");
+        load_driver(kf, group, "Usb", &d->ports[0].usb_driver);
+        load_driver(kf, group, "Supply", &d->ports[0].supply_driver);
+        load_driver(kf, group, "Role", &d->ports[0].role_driver);
+        return d;
+    }
+
+    if (n > UH_MAX_PORTS) {
+        fprintf(stderr, "%s: only using the first %d ports\n", group,
+                UH_MAX_PORTS);
+        n = UH_MAX_PORTS;
+    }
+
+    for (i = 0; i < n; i++) {
+        PortDrivers* p = &d->ports[i];
+
+        p->name = g_strdup(names[i]);
+        prefix = g_strconcat(names[i], ".Usb", NULL);
+        load_driver(kf, group, prefix, &p->usb_driver);
+        g_free(prefix);
+        prefix = g_strconcat(names[i], ".Supply", NULL);
+        load_driver(kf, group, prefix, &p->supply_driver);
+        g_free(prefix);
+        prefix = g_strconcat(names[i], ".Role", NULL);
+        load_driver(kf, group, prefix, &p->role_driver);
+        g_free(prefix);
+    }
+    g_strfreev(names);
+
+    return d;
+}
+
+static void load_profiles(void) {
+    GKeyFile* kf;
+    gchar** groups;
     int i;
-    DeviceDrivers *d;
-    gboolean ok = FALSE;
 
-    for (i = 0; i < G_N_ELEMENTS(drivers); i++) {
+    profiles = g_hash_table_new(g_str_hash, g_str_equal);
+
+    kf = g_key_file_new();
+    if (g_key_file_load_from_file(kf, BOARDS_FILE, G_KEY_FILE_NONE, NULL)) {
+        groups = g_key_file_get_groups(kf, NULL);
+        for (i = 0; groups[i]; i++) {
+            DeviceDrivers* d = load_profile(kf, groups[i]);
+
+            loaded_profiles = g_slist_prepend(loaded_profiles, d);
+            add_profile(d);
+        }
+        g_strfreev(groups);
+    }
+    g_key_file_free(kf);
+
+    for (i = 0; i < G_N_ELEMENTS(drivers); i++)
+        add_profile(&drivers[i]);
+}
+
+static void free_profiles(void) {
+    if (profiles) {
+        g_hash_table_destroy(profiles);
+        profiles = NULL;
+    }
+    g_slist_free_full(loaded_profiles, free_profile);
+    loaded_profiles = NULL;
+}
+
+static DeviceDrivers* lookup_profile(void) {
+    DeviceDrivers* d = NULL;
+    gchar *contents, *p, *key;
+    gsize len;
+
+    /* NUL separated, most specific first */
+    if (g_file_get_contents(DT_COMPATIBLE_FILE, &contents, &len, NULL)) {
+        for (p = contents; !d && p < contents + len; p += strlen(p) + 1)
+            d = g_hash_table_lookup(profiles, p);
+        g_free(contents);
+        if (d)
+            return d;
+    }
+
+    if (g_file_get_contents(DMI_PRODUCT_FILE, &contents, NULL, NULL)) {
+        key = g_strconcat("dmi:", g_strstrip(contents), NULL);
+        d = g_hash_table_lookup(profiles, key);
+        g_free(key);
+        g_free(contents);
+    }
+
+    return d;
+}
+
+static uh_port_t* port_new(const gchar* name, gchar* otg, gchar* supply, gchar* role) {
+    uh_port_t* port = g_new0(uh_port_t, 1);
+
+    port->name = g_strdup(name);
+    port->otg = otg;
+    port->supply = supply;
+    port->role = role;
+    port->usb_mode_attr.name = "mode";
+    port->usb_mode_attr.fd = -1;
+    port->supply_type_attr.name = "type";
+    port->supply_type_attr.fd = -1;
+    port->supply_online_attr.name = "online";
+    port->supply_online_attr.fd = -1;
+    port->role_attr.name = "role";
+    port->role_attr.fd = -1;
+    port->cache.usb_mode = USB_MODE_UNKNOWN;
+    port->cache.supply_mode = USB_SUPPLY_UNKNOWN;
+    port->reported = port->cache;
+
+    return port;
+}
+
+static void port_free(uh_port_t* port) {
+    if (port->settle.id)
+        g_source_remove(port->settle.id);
+    attr_close(&port->usb_mode_attr);
+    attr_close(&port->supply_type_attr);
+    attr_close(&port->supply_online_attr);
+    attr_close(&port->role_attr);
+    close_cables(port);
+    g_free(port->otg);
+    g_free(port->supply);
+    g_free(port->role);
+    g_free(port->name);
+    g_free(port);
+}
+
+static void clear_devices(void) {
+    guint i;
+
+    for (i = 0; i < n_ports; i++)
+        port_free(ports[i]);
+    n_ports = 0;
+}
+
+static void add_port(const gchar* name, gchar* otg, gchar* supply, gchar* role) {
+    ports[n_ports++] = port_new(name, otg, supply, role);
+}
+
+static gchar* find_driver(const DeviceDriver* d) {
+    return uh_backend_find_device(d->subsystem, d->driver, d->name);
+}
+
+/* Ports whose devices are missing are left out, the board only fails if
+ * none is left */
+static gboolean probe_device(DeviceDrivers* d) {
+    const PortDrivers* p;
+    gchar *otg, *supply, *role;
+
+    clear_devices();
+
+    fprintf(stderr, "Probing for drivers for %s\n", d->name);
+
+    for (p = d->ports; p->name; p++) {
         otg = NULL;
         supply = NULL;
+        role = NULL;
 
-        d = &drivers[i];
-        fprintf(stderr, "Probing for drivers for %s\n", d->name);
-
-        if (d->supply_driver.present == TRUE) {
-            supply = find_device(d->supply_driver.subsystem,
-                                 d->supply_driver.driver,
-                                 d->supply_driver.name);
+        if (p->supply_driver.present == TRUE) {
+            supply = find_driver(&p->supply_driver);
             if (!supply) {
-                fprintf(stderr, "Cannot find supply for %s\n", d->name);
+                fprintf(stderr, "Cannot find supply for %s port %s\n",
+                        d->name, p->name);
                 continue;
             }
-            fprintf(stderr, "Found supply\n");
+            fprintf(stderr, "Found supply for port %s\n", p->name);
         }
 
-        if (d->usb_driver.present == TRUE) {
-            otg = find_device(d->usb_driver.subsystem,
-                              d->usb_driver.driver,
-                              d->usb_driver.name);
+        if (p->usb_driver.present == TRUE) {
+            otg = find_driver(&p->usb_driver);
             if (!otg) {
-                fprintf(stderr, "Cannot find otg for %s\n", d->name);
+                fprintf(stderr, "Cannot find otg for %s port %s\n",
+                        d->name, p->name);
+                g_free(supply);
                 continue;
             }
-            fprintf(stderr, "Found otg\n");
+            fprintf(stderr, "Found otg for port %s\n", p->name);
         }
 
-        active_device = d;
-        ok = TRUE;
-        break;
+        if (p->role_driver.present == TRUE) {
+            role = find_driver(&p->role_driver);
+            if (!role) {
+                fprintf(stderr, "Cannot find role switch for %s port %s\n",
+                        d->name, p->name);
+                g_free(supply);
+                g_free(otg);
+                continue;
+            }
+            fprintf(stderr, "Found role switch for port %s\n", p->name);
+        }
+
+        add_port(p->name, otg, supply, role);
+    }
+
+    return n_ports > 0;
+}
+
+static gboolean is_usb_mode(const gchar* value) {
+    int len = strlen(value);
+
+    if (len > 0 && value[len - 1] == '\n')
+        len--;
+    return classify_usb_mode(value, len) != USB_MODE_UNKNOWN;
+}
+
+static gboolean is_usb_role(const gchar* value) {
+    int len = strlen(value);
+
+    if (len > 0 && value[len - 1] == '\n')
+        len--;
+    return classify_role(value, len) != USB_MODE_UNKNOWN;
+}
+
+static gboolean is_usb_supply(const gchar* value) {
+    int len = strlen(value);
+
+    if (len > 0 && value[len - 1] == '\n')
+        len--;
+    return classify_supply_type(value, len) != USB_SUPPLY_UNKNOWN;
+}
+
+/* Best effort: any USB power supply plus any device with a musb mode
+ * and/or any usb_role switch */
+static gboolean probe_generic(void) {
+    const PortDrivers* p = &generic_device.ports[0];
+    gchar *otg, *supply, *role;
+
+    clear_devices();
+
+    fprintf(stderr, "Probing for generic drivers\n");
+
+    supply = uh_backend_find_device_by_attr(p->supply_driver.subsystem,
+                                            "type", is_usb_supply);
+    otg = uh_backend_find_device_by_attr(p->usb_driver.subsystem,
+                                         "mode", is_usb_mode);
+    role = uh_backend_find_device_by_attr("usb_role", "role", is_usb_role);
+    if (!supply || (!otg && !role)) {
+        fprintf(stderr, "Cannot find generic %s\n",
+                supply ? "otg or role switch" : "supply");
+        g_free(supply);
+        g_free(otg);
+        g_free(role);
+        return FALSE;
+    }
+
+    add_port(p->name, otg, supply, role);
+
+    return TRUE;
+}
+
+static DeviceDrivers* find_profile_by_name(const gchar* name) {
+    GSList* l;
+    int i;
+
+    if (g_strcmp0(name, generic_device.name) == 0)
+        return &generic_device;
+
+    for (l = loaded_profiles; l; l = l->next) {
+        DeviceDrivers* d = l->data;
+
+        if (g_strcmp0(name, d->name) == 0)
+            return d;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(drivers); i++) {
+        if (g_strcmp0(name, drivers[i].name) == 0)
+            return &drivers[i];
+    }
+
+    return NULL;
+}
+
+static const PortDrivers* find_port_drivers(const DeviceDrivers* d, const gchar* name) {
+    const PortDrivers* p;
+
+    for (p = d->ports; p->name; p++)
+        if (strcmp(p->name, name) == 0)
+            return p;
+
+    return NULL;
+}
+
+/* Cached path of a port device, "<port>.<what>". A device that was not
+ * found when the cache was written has no key; a stale one fails. */
+static gboolean get_cached_device(const PortDrivers* p, const gchar* what, gchar** path) {
+    gchar *key, *value;
+
+    key = g_strconcat(p->name, ".", what, NULL);
+    value = probe_cache_get_string(PROBE_CACHE_GROUP, key);
+    *path = value ? probe_cache_get_path(PROBE_CACHE_GROUP, key) : NULL;
+    g_free(value);
+    g_free(key);
+
+    return !value || *path != NULL;
+}
+
+/*
+ * Reuse what an earlier instance found during this boot. The cache is
+ * only trusted if the boards file and every cached device node are still
+ * the same ones.
+ */
+static DeviceDrivers* probe_cached(void) {
+    DeviceDrivers* d = NULL;
+    gchar *board, *boards, *names = NULL;
+    gchar **list, **name;
+    gchar *otg, *supply, *role;
+
+    clear_devices();
+
+    board = probe_cache_get_string(PROBE_CACHE_GROUP, "Board");
+    boards = probe_cache_get_path(PROBE_CACHE_GROUP, "Boards");
+    if (board && boards) {
+        d = find_profile_by_name(board);
+        names = probe_cache_get_string(PROBE_CACHE_GROUP, "Ports");
+    }
+    g_free(board);
+    g_free(boards);
+
+    if (!d || !names) {
+        g_free(names);
+        return NULL;
+    }
+
+    list = g_strsplit(names, ";", UH_MAX_PORTS);
+    g_free(names);
+
+    for (name = list; *name && **name; name++) {
+        const PortDrivers* p = find_port_drivers(d, *name);
+
+        if (!p)
+            break;
+        if (!get_cached_device(p, "Otg", &otg))
+            break;
+        if (!get_cached_device(p, "Supply", &supply)) {
+            g_free(otg);
+            break;
+        }
+        if (!get_cached_device(p, "Role", &role)) {
+            g_free(supply);
+            g_free(otg);
+            break;
+        }
+
+        add_port(p->name, otg, supply, role);
+    }
+
+    /* All or nothing */
+    if (*name && **name) {
+        clear_devices();
+        d = NULL;
     }
+    g_strfreev(list);
 
-    if (ok) {
-        cache.usb_mode = read_usb_mode();
-        if (active_device->supply_driver.present)
-            cache.supply_mode = read_supply_mode();
-        return 0;
+    if (!d || n_ports == 0)
+        return NULL;
+
+    fprintf(stderr, "Using cached drivers for %s\n", d->name);
+
+    return d;
+}
+
+static void save_probe_cache(DeviceDrivers* d) {
+    GString* names = g_string_new(NULL);
+    gchar* key;
+    guint i;
+
+    probe_cache_remove_group(PROBE_CACHE_GROUP);
+    probe_cache_set_string(PROBE_CACHE_GROUP, "Board", d->name);
+    probe_cache_set_path(PROBE_CACHE_GROUP, "Boards", BOARDS_FILE);
+
+    for (i = 0; i < n_ports; i++) {
+        g_string_append_printf(names, "%s;", ports[i]->name);
+        if (ports[i]->otg) {
+            key = g_strconcat(ports[i]->name, ".Otg", NULL);
+            probe_cache_set_path(PROBE_CACHE_GROUP, key, ports[i]->otg);
+            g_free(key);
+        }
+        if (ports[i]->supply) {
+            key = g_strconcat(ports[i]->name, ".Supply", NULL);
+            probe_cache_set_path(PROBE_CACHE_GROUP, key, ports[i]->supply);
+            g_free(key);
+        }
+        if (ports[i]->role) {
+            key = g_strconcat(ports[i]->name, ".Role", NULL);
+            probe_cache_set_path(PROBE_CACHE_GROUP, key, ports[i]->role);
+            g_free(key);
+        }
     }
+    probe_cache_set_string(PROBE_CACHE_GROUP, "Ports", names->str);
+    g_string_free(names, TRUE);
 
-    return 1;
+    probe_cache_save();
 }
 
-static gboolean update_info() {
-    cache.supply_mode = read_supply_mode();
-    cache.usb_mode = read_usb_mode();
-    fprintf(stderr, "usb_mode: %d; supply_mode: %d\n", cache.usb_mode, cache.supply_mode);
+static int find_devices(void) {
+    DeviceDrivers *d;
+    gboolean ok = FALSE;
+    guint i;
+
+    load_profiles();
 
-    if ((user_callback)) {
-        user_callback(cache.usb_mode, cache.supply_mode, user_data);
+    d = probe_cached();
+    if (d)
+        goto found;
+
+    d = lookup_profile();
+    if (d) {
+        ok = probe_device(d);
+    } else {
+        fprintf(stderr, "No board profile for this machine\n");
+    }
+
+    if (!ok) {
+        d = &generic_device;
+        ok = probe_generic();
+    }
+
+    if (!ok) {
+        probe_cache_remove_group(PROBE_CACHE_GROUP);
+        probe_cache_save();
+        return 1;
     }
 
+    save_probe_cache(d);
+
+found:
+    active_device = d;
+
+    for (i = 0; i < n_ports; i++) {
+        uh_port_t* port = ports[i];
+
+        attr_open(&port->usb_mode_attr, port->otg);
+        attr_open(&port->role_attr, port->role);
+        /* extcon devices have cables instead of a type */
+        if (port->supply)
+            open_cables(port);
+        if (port->n_cables == 0) {
+            attr_open(&port->supply_type_attr, port->supply);
+            attr_open(&port->supply_online_attr, port->supply);
+        }
+
+        read_current(port, &port->cache);
+        port->reported = port->cache;
+        fprintf(stderr, "%s: %s role source, %u extcon cables\n", port->name,
+                port->role_attr.fd >= 0 ? "usb_role" :
+                port->role_cables ? "extcon" : "musb mode", port->n_cables);
+    }
+
+    return 0;
+}
+
+static guint settle_ceiling(void) {
+    if (active_device->settle_max_ms)
+        return active_device->settle_max_ms;
+    return UH_SETTLE_MAX_MS;
+}
+
+static void settle_done(uh_port_t* port, const PrivData *data) {
+    SettleData* settle = &port->settle;
+
+    settle->id = 0;
+    settle->have_event_supply = FALSE;
+    port->cache = *data;
+    fprintf(stderr, "%s: usb_mode: %d; supply_mode: %d (settled in %u ms, "
+            "%u events absorbed so far)\n", port->name, port->cache.usb_mode,
+            port->cache.supply_mode, settle->elapsed, settle->absorbed);
+
+    /* Only tell the user about real changes */
+    if (port->cache.usb_mode == port->reported.usb_mode &&
+        port->cache.supply_mode == port->reported.supply_mode)
+        return;
+    port->reported = port->cache;
+
+    if ((port->callback)) {
+        settle->callbacks++;
+        port->callback(port, port->cache.usb_mode, port->cache.supply_mode,
+                       port->user_data);
+    }
+}
+
+/*
+ * Re-read the state on a short backoff until two consecutive reads of the
+ * same generation agree. A uevent means something changed, so a stable
+ * read that still equals the last reported state keeps us polling (the
+ * musb mode can lag the supply node) until the board's ceiling is hit.
+ */
+static gboolean settle_cb(gpointer data) {
+    uh_port_t* port = data;
+    SettleData* settle = &port->settle;
+    PrivData now;
+    guint delay;
+
+    settle->elapsed += settle_steps[settle->step];
+    read_current(port, &now);
+
+    if (settle->sampled &&
+        settle->sample_generation == settle->generation &&
+        now.usb_mode == settle->sample.usb_mode &&
+        now.supply_mode == settle->sample.supply_mode &&
+        (now.usb_mode != port->reported.usb_mode ||
+         now.supply_mode != port->reported.supply_mode)) {
+        settle_done(port, &now);
+        return G_SOURCE_REMOVE;
+    }
+
+    settle->sample = now;
+    settle->sample_generation = settle->generation;
+    settle->sampled = TRUE;
+
+    if (settle->step < G_N_ELEMENTS(settle_steps) - 1)
+        settle->step++;
+    delay = settle_steps[settle->step];
+
+    /* The ceiling counts from the first event of a burst, so a flapping
+     * node cannot postpone the refresh forever */
+    if (settle->elapsed + delay > settle_ceiling()) {
+        settle_done(port, &now);
+        return G_SOURCE_REMOVE;
+    }
+
+    settle->id = g_timeout_add(delay, settle_cb, port);
     return G_SOURCE_REMOVE;
 }
 
-static void on_uevent(GUdevClient *client, const char *action, GUdevDevice *device) {
-    (void)client;
+/* For direct sources: the attributes are already up to date */
+static void refresh_now(uh_port_t* port) {
+    PrivData now;
+
+    if (port->settle.id) {
+        g_source_remove(port->settle.id);
+        port->settle.absorbed++;
+    }
+    port->settle.events++;
+    port->settle.elapsed = 0;
+
+    read_current(port, &now);
+    settle_done(port, &now);
+}
+
+static void settle_start(uh_port_t* port) {
+    SettleData* settle = &port->settle;
+
+    settle->events++;
+    settle->generation++;
+
+    if (settle->id) {
+        /* Fold this event into the pending refresh, but make it take
+         * fresh samples again */
+        settle->absorbed++;
+        settle->sampled = FALSE;
+        return;
+    }
+
+    settle->step = 0;
+    settle->elapsed = 0;
+    settle->sampled = FALSE;
+    settle->id = g_timeout_add(settle_steps[0], settle_cb, port);
+}
+
+/*
+ * POWER_SUPPLY_USB_TYPE lists all types with the active one in brackets,
+ * e.g. "Unknown SDP [DCP] CDP"; older kernels only have POWER_SUPPLY_TYPE.
+ */
+static gboolean decode_supply_event(UhGetProperty get_property, gconstpointer event, gint* mode) {
+    const gchar *value, *start, *end;
+
+    value = get_property(event, "POWER_SUPPLY_USB_TYPE");
+    if (value && (start = strchr(value, '[')) && (end = strchr(start, ']'))) {
+        start++;
+        if (end - start == 3 && memcmp(start, "SDP", 3) == 0)
+            *mode = USB_SUPPLY_NONE;
+        else if (end - start == 3 && memcmp(start, "CDP", 3) == 0)
+            *mode = USB_SUPPLY_CDP;
+        else if (end - start == 3 && memcmp(start, "DCP", 3) == 0)
+            *mode = USB_SUPPLY_DCP;
+        else
+            *mode = USB_SUPPLY_UNKNOWN;
+        return TRUE;
+    }
+
+    value = get_property(event, "POWER_SUPPLY_TYPE");
+    if (value) {
+        *mode = classify_supply_type(value, strlen(value));
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+void uh_handle_uevent(const gchar* action, const gchar* sysfs_path,
+                      UhGetProperty get_property, gconstpointer event) {
+    PortWatch* w;
+    gboolean have_supply = FALSE;
+    gint supply_mode = USB_SUPPLY_UNKNOWN;
     (void)action;
 
-    const gchar* sysfs_path = g_udev_device_get_sysfs_path(device);
-    const gchar* supply_sysfs_path;
+    if (!watched || !sysfs_path)
+        return;
+
+    w = g_hash_table_lookup(watched, sysfs_path);
+    if (!w)
+        return;
+
+    /* power_supply uevents carry the new type, which saves re-reading it
+     * and cannot lag behind. extcon ones don't, and neither do the
+     * synthetic events a backend sends after losing some. */
+    if (get_property)
+        have_supply = decode_supply_event(get_property, event, &supply_mode);
 
-    if (active_device->supply_driver.present)
-        supply_sysfs_path = g_udev_device_get_sysfs_path(supply);
+    for (; w; w = w->next) {
+        if (w->what == UH_WATCH_SUPPLY) {
+            w->port->settle.have_event_supply = have_supply;
+            w->port->settle.event_supply = supply_mode;
+        }
+
+        if (port_is_direct(w->port) &&
+            (w->what == UH_WATCH_ROLE ||
+             (w->what == UH_WATCH_SUPPLY && w->port->n_cables))) {
+            refresh_now(w->port);
+            continue;
+        }
 
-    if (active_device->supply_driver.present && (strcmp(supply_sysfs_path, sysfs_path) == 0)) {
-        /* Not all values update fast enough, and we're not in a hurry */
-        g_timeout_add(1000, update_info, NULL);
+        /* Not all values update at once, wait for them to settle */
+        settle_start(w->port);
     }
-    return;
 }
 
 int uh_init() {
     int ret = 1;
-    client = NULL;
-    user_data = NULL;
-    user_callback = NULL;
 
-    ret = setup_udev();
+    ret = uh_backend_init();
     if (ret) {
-        fprintf(stderr, "setup_udev failed\n");
+        fprintf(stderr, "uh_backend_init failed\n");
         return ret;
     }
     ret = find_devices();
+    uh_backend_probe_done();
     if (ret) {
         fprintf(stderr, "find_devices failed\n");
         return ret;
     }
 
-    g_signal_connect(client, "uevent", G_CALLBACK(on_uevent), NULL);
+    ret = setup_listener();
+    if (ret) {
+        fprintf(stderr, "setup_listener failed\n");
+        return ret;
+    }
 
     return ret;
 }
 
 int uh_destroy() {
-    if (client) {
-        /* TODO: Figure out how to free - just unref ? */
+    uh_backend_destroy();
+
+    if (watched) {
+        g_hash_table_destroy(watched);
+        watched = NULL;
     }
 
+    clear_devices();
+    active_device = NULL;
+    free_profiles();
+
     return 0;
 }
 
-void uh_set_callback(UhCallback cb, gpointer data) {
-    user_data = data;
-    user_callback = cb;
+guint uh_get_port_count(void) {
+    return n_ports;
+}
+
+uh_port_t* uh_get_port(guint index) {
+    if (index >= n_ports)
+        return NULL;
+
+    return ports[index];
+}
+
+const gchar* uh_port_get_name(const uh_port_t* port) {
+    return port->name;
+}
+
+void uh_port_set_callback(uh_port_t* port, UhCallback cb, gpointer data) {
+    port->user_data = data;
+    port->callback = cb;
 
     return;
 }
 
-void uh_query_state(gint* usb_mode, gint* supply_mode) {
-    *supply_mode = read_supply_mode();
-    *usb_mode = read_usb_mode();
+void uh_port_get_stats(const uh_port_t* port, guint* events, guint* absorbed, guint* callbacks) {
+    if (events)
+        *events = port->settle.events;
+    if (absorbed)
+        *absorbed = port->settle.absorbed;
+    if (callbacks)
+        *callbacks = port->settle.callbacks;
+}
+
+void uh_port_query_state(uh_port_t* port, gint* usb_mode, gint* supply_mode) {
+    PrivData now;
+
+    read_current(port, &now);
+    *usb_mode = now.usb_mode;
+    *supply_mode = now.supply_mode;
 }
 
 /* TODO */
@@ -365,19 +1514,22 @@ char *uh_get_device_name() {
 /* TODO: g_udev_device_has_sysfs_attr can be used to see if something has attrs
  * like vbus and mode */
 
-static gboolean pc_connected() {
-    return (cache.usb_mode == USB_MODE_B_PERIPHERAL) || (cache.usb_mode == USB_MODE_A_PERIPHERAL);
+static gboolean pc_connected(const uh_port_t* port) {
+    return (port->cache.usb_mode == USB_MODE_B_PERIPHERAL) || (port->cache.usb_mode == USB_MODE_A_PERIPHERAL);
 }
 
-static void test_callback(gboolean pc_connected, gpointer data) {
-    fprintf(stderr, "test_callback: PC connected: %d - %p.\n", pc_connected, data);
+static void test_callback(uh_port_t* port, gint usb_mode, gint supply_mode, gpointer data) {
+    fprintf(stderr, "test_callback: %s: PC connected: %d - %p.\n", port->name, pc_connected(port), data);
 }
 
 static int main_loop(void) {
     static GMainLoop *loop = NULL;
 
+    guint i;
+
     uh_init();
-    uh_set_callback((UhCallback)test_callback, (void*)42);
+    for (i = 0; i < uh_get_port_count(); i++)
+        uh_port_set_callback(uh_get_port(i), test_callback, (void*)42);
 
     loop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(loop);
@@ -1,12 +1,27 @@
 #ifndef __UDEV_HELPER_H__
 #define __UDEV_HELPER_H__
-typedef void (*UhCallback)(gint, gint, gpointer);
+
+/* One USB port of the board: an otg/UDC device reporting the musb mode and
+ * a supply device signalling cable changes */
+typedef struct uh_port uh_port_t;
+
+typedef void (*UhCallback)(uh_port_t*, gint, gint, gpointer);
 
 
 int uh_init(void);
 int uh_destroy(void);
-void uh_set_callback(UhCallback cb, gpointer data);
-void uh_query_state(gint*, gint*);
+
+/* The ports found by uh_init(), valid until uh_destroy() */
+guint uh_get_port_count(void);
+uh_port_t* uh_get_port(guint index);
+const gchar* uh_port_get_name(const uh_port_t* port);
+
+void uh_port_set_callback(uh_port_t* port, UhCallback cb, gpointer data);
+void uh_port_query_state(uh_port_t* port, gint*, gint*);
+/* Number of relevant uevents seen, how many of them were folded into an
+ * already pending refresh, and how many callbacks were made */
+void uh_port_get_stats(const uh_port_t* port, guint* events, guint* absorbed,
+                       guint* callbacks);
 
 /* TODO: Implement this */
 char *uh_get_device_name(void);
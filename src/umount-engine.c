@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mount.h>
+#include <glib.h>
+
+#include "umount-engine.h"
+#include "holders.h"
+#include "busy-mount.h"
+#include "mount-table.h"
+#include "proc-spawn.h"
+#include "reaper.h"
+
+/* retry interval while files are open and fanotify cannot be used,
+ * doubled up to the maximum */
+#define RETRY_MIN_MS 20
+#define RETRY_MAX_MS 250
+
+typedef struct {
+    gchar *mount_point;
+    gboolean lazy;
+    gboolean gvfs_tried;
+    gint64 deadline;
+    guint retry_ms;
+    BusyMount *busy;        /* waiting for closes */
+    guint deadline_id;
+    gint status;
+    umount_engine_cb_t cb;
+    gpointer data;
+} UmountOp;
+
+static umount_engine_notify_t notify_cb = NULL;
+
+void umount_engine_set_notify(umount_engine_notify_t notify) {
+    notify_cb = notify;
+}
+
+static gboolean is_mount_point(const gchar *path) {
+    return mount_table_mount_of(path) != NULL;
+}
+
+static gboolean op_finish(gpointer data) {
+    UmountOp *op = data;
+
+    if (op->status == UMOUNT_ENGINE_OK)
+        mount_table_invalidate();
+
+    busy_mount_unwatch(op->busy);
+    if (op->deadline_id)
+        g_source_remove(op->deadline_id);
+    if (op->cb)
+        op->cb(op->status, op->data);
+    g_free(op->mount_point);
+    g_free(op);
+    return FALSE;
+}
+
+static void op_failed(UmountOp *op) {
+    int err = errno;    /* before the scan overwrites it */
+    GPtrArray *holders = holders_scan(op->mount_point);
+
+    fprintf(stderr, "Cannot unmount %s: %s\n", op->mount_point,
+            g_strerror(err));
+    if (holders) {
+        holders_log(op->mount_point, holders);
+        g_ptr_array_unref(holders);
+    }
+    op->status = UMOUNT_ENGINE_FAILED;
+}
+
+/* TRUE if the unmount is over, either way */
+static gboolean op_attempt(UmountOp *op) {
+    if (umount2(op->mount_point, 0) == 0) {
+        op->status = UMOUNT_ENGINE_OK;
+    } else if (errno == EINVAL && !is_mount_point(op->mount_point)) {
+        /* went away meanwhile */
+        op->status = UMOUNT_ENGINE_OK;
+    } else if (errno != EBUSY) {
+        op_failed(op);
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void op_closed(BusyMount *bm, gpointer data) {
+    UmountOp *op = data;
+
+    if (op_attempt(op))
+        op_finish(op);
+}
+
+static gboolean op_deadline(gpointer data) {
+    UmountOp *op = data;
+
+    op->deadline_id = 0;
+    if (!op_attempt(op))
+        op_failed(op);
+    op_finish(op);
+    return FALSE;
+}
+
+static void op_wait(UmountOp *op) {
+    GArray *pids;
+    GString *list;
+    guint i;
+
+    op->busy = busy_mount_watch(op->mount_point, op_closed, op);
+    if (!op->busy)
+        return;
+
+    pids = busy_mount_get_pids(op->busy);
+    list = g_string_new(NULL);
+    for (i = 0; i < pids->len; i++)
+        g_string_append_printf(list, " %d", (int)g_array_index(pids, pid_t, i));
+    fprintf(stderr, "%s: waiting for %u open files, pids%s\n",
+            op->mount_point, busy_mount_get_count(op->busy), list->str);
+    g_string_free(list, TRUE);
+    g_array_unref(pids);
+
+    op->deadline_id = g_timeout_add(
+        MAX(0, (op->deadline - g_get_monotonic_time()) / 1000), op_deadline,
+        op);
+}
+
+static gboolean op_try(gpointer data);
+
+static void op_gvfs_done(pid_t pid, int status, gpointer data) {
+    UmountOp *op = data;
+
+    /* the wait for closes starts now */
+    op->deadline = g_get_monotonic_time() +
+                   (gint64)UMOUNT_ENGINE_DEADLINE_MS * 1000;
+    op_try(op);
+}
+
+/* FALSE if UMOUNT_ENGINE_GVFS_COMMAND did not start */
+static gboolean op_gvfs_unmount(UmountOp *op) {
+    const gchar *args[] = {
+        UMOUNT_ENGINE_GVFS_COMMAND, op->mount_point, NULL
+    };
+    pid_t pid;
+
+    if (access(UMOUNT_ENGINE_GVFS_COMMAND, X_OK) != 0)
+        return FALSE;
+
+    pid = spawn_prog_logged(UMOUNT_ENGINE_GVFS_COMMAND, args, "/dev/null");
+    if (pid < 0)
+        return FALSE;
+
+    reaper_watch(pid, op_gvfs_done, op);
+    return TRUE;
+}
+
+static gboolean op_try(gpointer data) {
+    UmountOp *op = data;
+
+    if (op_attempt(op)) {
+        op_finish(op);
+        return FALSE;
+    }
+
+    /* busy: let GVFS get the files closed first */
+    if (!op->gvfs_tried) {
+        op->gvfs_tried = TRUE;
+        if (op_gvfs_unmount(op))
+            return FALSE;
+    }
+
+    if (op->lazy) {
+        fprintf(stderr, "lazy umount for %s\n", op->mount_point);
+        if (umount2(op->mount_point, MNT_DETACH) == 0)
+            op->status = UMOUNT_ENGINE_OK;
+        else
+            op_failed(op);
+        op_finish(op);
+        return FALSE;
+    }
+
+    /* wait for the files to be closed, told by fanotify if possible */
+    if (!op->busy && op->retry_ms == RETRY_MIN_MS)
+        op_wait(op);
+    if (op->busy)
+        return FALSE;
+
+    if (g_get_monotonic_time() < op->deadline) {
+        g_timeout_add(op->retry_ms, op_try, op);
+        op->retry_ms = MIN(op->retry_ms * 2, RETRY_MAX_MS);
+        return FALSE;
+    }
+
+    op_failed(op);
+    op_finish(op);
+    return FALSE;
+}
+
+void umount_engine_start(const gchar *mount_point, gboolean lazy,
+                         umount_engine_cb_t cb, gpointer data) {
+    UmountOp *op = g_new0(UmountOp, 1);
+
+    op->mount_point = g_strdup(mount_point);
+    op->lazy = lazy;
+    op->retry_ms = RETRY_MIN_MS;
+    op->cb = cb;
+    op->data = data;
+
+    if (!is_mount_point(mount_point)) {
+        op->status = UMOUNT_ENGINE_OK;
+        g_idle_add(op_finish, op);
+        return;
+    }
+
+    if (notify_cb)
+        notify_cb(mount_point);
+
+    op->deadline = g_get_monotonic_time() +
+                   (gint64)UMOUNT_ENGINE_DEADLINE_MS * 1000;
+    /* give the notified applications a main loop iteration */
+    g_idle_add(op_try, op);
+}
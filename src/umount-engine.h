@@ -0,0 +1,38 @@
+#ifndef __UMOUNT_ENGINE_H__
+#define __UMOUNT_ENGINE_H__
+
+#include <glib.h>
+
+/*
+ * In-process card unmounting, replacing osso-mmc-umount.sh.
+ *
+ * Applications are told first (see umount_engine_set_notify()). If the
+ * card is busy, UMOUNT_ENGINE_GVFS_COMMAND unmounts it the GIO way like the
+ * script did, which has GVFS ask its clients to close their files. If it
+ * is still mounted after that, the unmount is retried as files on the card
+ * are closed (see busy-mount.h) until it succeeds or
+ * UMOUNT_ENGINE_DEADLINE_MS has passed, instead of sleeping a fixed second.
+ * Without fanotify it is retried at short intervals. A lazy unmount
+ * detaches the mount (MNT_DETACH) instead of waiting. When the unmount
+ * fails, the processes holding the card are logged.
+ */
+
+#define UMOUNT_ENGINE_DEADLINE_MS 5000
+#define UMOUNT_ENGINE_GVFS_COMMAND "/usr/bin/mmc-unmount"
+
+/* Results, the exit codes of osso-mmc-umount.sh */
+#define UMOUNT_ENGINE_OK 0
+#define UMOUNT_ENGINE_FAILED 1
+
+typedef void (*umount_engine_cb_t)(gint status, gpointer data);
+typedef void (*umount_engine_notify_t)(const gchar *mount_point);
+
+/* Called before every unmount so that applications can close their files */
+void umount_engine_set_notify(umount_engine_notify_t notify);
+
+/* Unmount mount_point. Succeeds if nothing is mounted there. cb is always
+ * called later from the main loop. */
+void umount_engine_start(const gchar *mount_point, gboolean lazy,
+                         umount_engine_cb_t cb, gpointer data);
+
+#endif /* __UMOUNT_ENGINE_H__ */
@@ -0,0 +1,611 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <net/if.h>
+#include <glib.h>
+
+#include "usb-gadget.h"
+#include "rtnl.h"
+#include "usb-lun.h"
+
+#define USB_LANG_DIR "strings/0x409"
+#define USB_CONFIG_DIR "configs/c.1"
+
+static const gchar *const net_functions[] = { PCSUITE_FUNCTION, NULL };
+static const gchar *const storage_functions[] = {
+    MASS_STORAGE_FUNCTION, NULL
+};
+static const gchar *const net_storage_functions[] = {
+    PCSUITE_FUNCTION, MASS_STORAGE_FUNCTION, NULL
+};
+
+/* Indexed by the USB_GADGET_* function bits */
+static const UsbGadgetDef compositions[] = {
+    [USB_GADGET_NET] = {
+        .name = "ke-recv-pcsuite",
+        .vendor_id = 0x0421,
+        .product_id = 0x01c8,
+        .manufacturer = "Nokia",
+        .product = "N900 (PC-Suite Mode)",
+        .functions = net_functions,
+    },
+    [USB_GADGET_STORAGE] = {
+        .name = "ke-recv-storage",
+        .vendor_id = 0x0421,
+        .product_id = 0x01c7,
+        .manufacturer = "Nokia",
+        .product = "N900 (Storage Mode)",
+        .functions = storage_functions,
+        .luns = MASS_STORAGE_LUNS,
+    },
+    [USB_GADGET_NET | USB_GADGET_STORAGE] = {
+        .name = "ke-recv-pcsuite-storage",
+        .vendor_id = 0x0421,
+        .product_id = 0x01c8,
+        .manufacturer = "Nokia",
+        .product = "N900 (PC-Suite Mode)",
+        .functions = net_storage_functions,
+        .luns = MASS_STORAGE_LUNS,
+    },
+};
+
+static gboolean prestaged = FALSE;
+/* functions in use, and the composition bound for them (0 for none) */
+static guint active_functions = 0;
+static guint bound_functions = 0;
+
+gboolean usb_gadget_write_attr(const gchar *dir, const gchar *attr,
+                               const gchar *value) {
+    gchar *path = g_build_filename(dir, attr, NULL);
+    size_t len = strlen(value);
+    gboolean ok = FALSE;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ok = write(fd, value, len) == (ssize_t)len;
+        if (!ok)
+            fprintf(stderr, "Cannot write '%s' to %s: %s\n", value, path,
+                    g_strerror(errno));
+        close(fd);
+    } else {
+        fprintf(stderr, "Cannot open %s: %s\n", path, g_strerror(errno));
+    }
+
+    g_free(path);
+    return ok;
+}
+
+gchar *usb_gadget_read_attr(const gchar *dir, const gchar *attr) {
+    gchar *path = g_build_filename(dir, attr, NULL);
+    gchar *value = NULL;
+
+    if (g_file_get_contents(path, &value, NULL, NULL))
+        g_strstrip(value);
+
+    g_free(path);
+    return value;
+}
+
+static gboolean make_dir(const gchar *path) {
+    if (mkdir(path, 0755) == 0 || errno == EEXIST)
+        return TRUE;
+
+    fprintf(stderr, "Cannot create %s: %s\n", path, g_strerror(errno));
+    return FALSE;
+}
+
+gboolean usb_gadget_available(void) {
+    gchar *udc;
+
+    if (!g_file_test(USB_GADGET_CONFIGFS, G_FILE_TEST_IS_DIR))
+        return FALSE;
+
+    udc = usb_gadget_get_udc();
+    g_free(udc);
+    return udc != NULL;
+}
+
+gchar *usb_gadget_get_udc(void) {
+    GDir *dir = g_dir_open(USB_UDC_CLASS_DIR, 0, NULL);
+    gchar *udc = NULL;
+
+    if (dir) {
+        const gchar *name = g_dir_read_name(dir);
+        if (name)
+            udc = g_strdup(name);
+        g_dir_close(dir);
+    }
+
+    return udc;
+}
+
+gboolean usb_gadget_create(const UsbGadgetDef *def) {
+    gchar *gadget, *lang, *config, *config_lang, *tmp;
+    gboolean ok = FALSE;
+    int i;
+
+    gadget = g_build_filename(USB_GADGET_CONFIGFS, def->name, NULL);
+    lang = g_build_filename(gadget, USB_LANG_DIR, NULL);
+    config = g_build_filename(gadget, USB_CONFIG_DIR, NULL);
+    config_lang = g_build_filename(config, USB_LANG_DIR, NULL);
+
+    /* configfs creates the parents' attributes with the directories */
+    if (!make_dir(gadget) || !make_dir(lang) || !make_dir(config) ||
+        !make_dir(config_lang))
+        goto out;
+
+    tmp = g_strdup_printf("0x%04x", def->vendor_id);
+    ok = usb_gadget_write_attr(gadget, "idVendor", tmp);
+    g_free(tmp);
+    tmp = g_strdup_printf("0x%04x", def->product_id);
+    ok = ok && usb_gadget_write_attr(gadget, "idProduct", tmp);
+    g_free(tmp);
+
+    ok = ok && usb_gadget_write_attr(lang, "manufacturer", def->manufacturer);
+    ok = ok && usb_gadget_write_attr(lang, "product", def->product);
+    ok = ok && usb_gadget_write_attr(config_lang, "configuration",
+                                     def->product);
+    if (!ok)
+        goto out;
+
+    for (i = 0; def->functions[i]; i++) {
+        gchar *function = g_build_filename(gadget, "functions",
+                                           def->functions[i], NULL);
+        gchar *link = g_build_filename(config, def->functions[i], NULL);
+
+        ok = make_dir(function);
+        if (ok && g_str_has_prefix(def->functions[i], "mass_storage."))
+            ok = usb_lun_create(function, def->luns);
+        if (ok && symlink(function, link) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Cannot link %s: %s\n", link, g_strerror(errno));
+            ok = FALSE;
+        }
+
+        g_free(function);
+        g_free(link);
+        if (!ok)
+            break;
+    }
+
+out:
+    g_free(gadget);
+    g_free(lang);
+    g_free(config);
+    g_free(config_lang);
+    return ok;
+}
+
+/* Unbind every gadget except 'keep' that is bound to udc */
+static void release_udc(const gchar *udc, const gchar *keep) {
+    GDir *dir = g_dir_open(USB_GADGET_CONFIGFS, 0, NULL);
+    const gchar *name;
+
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name(dir))) {
+        gchar *gadget, *bound;
+
+        if (g_strcmp0(name, keep) == 0)
+            continue;
+
+        gadget = g_build_filename(USB_GADGET_CONFIGFS, name, NULL);
+        bound = usb_gadget_read_attr(gadget, "UDC");
+        if (g_strcmp0(bound, udc) == 0) {
+            fprintf(stderr, "Unbinding gadget %s from %s\n", name, udc);
+            usb_gadget_write_attr(gadget, "UDC", "\n");
+        }
+        g_free(bound);
+        g_free(gadget);
+    }
+
+    g_dir_close(dir);
+}
+
+gboolean usb_gadget_bind(const gchar *name) {
+    gchar *gadget, *udc, *bound;
+    gboolean ok;
+
+    udc = usb_gadget_get_udc();
+    if (!udc) {
+        fprintf(stderr, "No UDC to bind gadget %s to\n", name);
+        return FALSE;
+    }
+
+    gadget = g_build_filename(USB_GADGET_CONFIGFS, name, NULL);
+    bound = usb_gadget_read_attr(gadget, "UDC");
+
+    if (g_strcmp0(bound, udc) == 0) {
+        ok = TRUE;
+    } else {
+        release_udc(udc, name);
+        ok = usb_gadget_write_attr(gadget, "UDC", udc);
+    }
+
+    g_free(bound);
+    g_free(gadget);
+    g_free(udc);
+    return ok;
+}
+
+gboolean usb_gadget_unbind(const gchar *name) {
+    gchar *gadget, *bound;
+    gboolean ok = TRUE;
+
+    gadget = g_build_filename(USB_GADGET_CONFIGFS, name, NULL);
+    bound = usb_gadget_read_attr(gadget, "UDC");
+    if (bound && *bound)
+        ok = usb_gadget_write_attr(gadget, "UDC", "\n");
+
+    g_free(bound);
+    g_free(gadget);
+    return ok;
+}
+
+gchar *usb_gadget_get_ifname(const gchar *name, const gchar *function) {
+    gchar *dir, *ifname;
+
+    dir = g_build_filename(USB_GADGET_CONFIGFS, name, "functions", function,
+                           NULL);
+    ifname = usb_gadget_read_attr(dir, "ifname");
+    g_free(dir);
+
+    /* "(unnamed net_device)" until the kernel has registered it */
+    if (ifname && (*ifname == '\0' || *ifname == '(')) {
+        g_free(ifname);
+        ifname = NULL;
+    }
+
+    return ifname;
+}
+
+/* Give the network functions of all compositions the MAC addresses of the
+ * first, so the host sees the same interface whichever one is bound. They
+ * can only be set while a function is not bound, so an adopted gadget may
+ * keep its own. */
+static void share_net_addrs(void) {
+    static const gchar *const attrs[] = { "dev_addr", "host_addr", NULL };
+    gchar *first = g_build_filename(USB_GADGET_CONFIGFS,
+                                    compositions[USB_GADGET_NET].name,
+                                    "functions", PCSUITE_FUNCTION, NULL);
+    guint i, j;
+
+    for (i = USB_GADGET_NET + 1; i < G_N_ELEMENTS(compositions); i++) {
+        gchar *function;
+
+        if (!compositions[i].name || !(i & USB_GADGET_NET))
+            continue;
+
+        function = g_build_filename(USB_GADGET_CONFIGFS, compositions[i].name,
+                                    "functions", PCSUITE_FUNCTION, NULL);
+        for (j = 0; attrs[j]; j++) {
+            gchar *want = usb_gadget_read_attr(first, attrs[j]);
+            gchar *have = usb_gadget_read_attr(function, attrs[j]);
+
+            if (want && g_strcmp0(want, have) != 0)
+                usb_gadget_write_attr(function, attrs[j], want);
+            g_free(want);
+            g_free(have);
+        }
+        g_free(function);
+    }
+
+    g_free(first);
+}
+
+gboolean usb_gadget_prestage(void) {
+    gint64 start = g_get_monotonic_time();
+    guint i;
+
+    if (!usb_gadget_available()) {
+        fprintf(stderr, "No configfs USB gadget support\n");
+        return FALSE;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(compositions); i++) {
+        if (compositions[i].name && !usb_gadget_create(&compositions[i]))
+            return FALSE;
+    }
+    share_net_addrs();
+
+    prestaged = TRUE;
+    fprintf(stderr, "USB gadgets staged in %lld us\n",
+            (long long)(g_get_monotonic_time() - start));
+    return TRUE;
+}
+
+static gchar *storage_function(guint functions) {
+    return g_build_filename(USB_GADGET_CONFIGFS, compositions[functions].name,
+                            "functions", MASS_STORAGE_FUNCTION, NULL);
+}
+
+/* Move the medium of one LUN to an empty one with the same "ro" and
+ * "removable" flags. The host must never get write access to a device
+ * that is exported read-only, so a LUN whose "ro" cannot be carried over
+ * keeps its medium and the move fails. */
+static gboolean move_lun_file(const gchar *from, const gchar *to) {
+    gchar *file = usb_lun_get_file(from);
+    gint ro, removable;
+    gboolean ok;
+
+    if (!file)
+        return TRUE;
+
+    ro = usb_lun_get_flag(from, "ro");
+    removable = usb_lun_get_flag(from, "removable");
+
+    /* ro can only be changed without a medium */
+    ok = ro >= 0 && usb_lun_set_file(to, NULL) &&
+         usb_lun_set_flag(to, "ro", ro) && usb_lun_get_flag(to, "ro") == ro;
+    if (ok && removable >= 0)
+        usb_lun_set_flag(to, "removable", removable);
+
+    ok = ok && usb_lun_set_file(from, NULL);
+    if (ok && !usb_lun_set_file(to, file)) {
+        usb_lun_set_file(from, file);
+        ok = FALSE;
+    }
+    if (!ok)
+        fprintf(stderr, "Cannot move %s from %s to %s\n", file, from, to);
+
+    g_free(file);
+    return ok;
+}
+
+/* Move the exported files from one composition's LUNs to another's, which
+ * must not be bound yet so that LUNs can be added to it */
+static gboolean move_lun_files(guint from, guint to) {
+    gchar *from_function = storage_function(from);
+    gchar *to_function = storage_function(to);
+    GPtrArray *from_luns = usb_lun_find(from_function), *to_luns;
+    gboolean ok;
+    guint i;
+
+    ok = usb_lun_create(to_function, from_luns->len);
+    to_luns = usb_lun_find(to_function);
+
+    for (i = 0; ok && i < from_luns->len && i < to_luns->len; i++)
+        ok = move_lun_file(g_ptr_array_index(from_luns, i),
+                           g_ptr_array_index(to_luns, i));
+
+    g_ptr_array_unref(from_luns);
+    g_ptr_array_unref(to_luns);
+    g_free(from_function);
+    g_free(to_function);
+    return ok;
+}
+
+/* Interface of the network function in the bound composition */
+static gchar *pcsuite_ifname(void) {
+    gchar *ifname = NULL;
+
+    if (bound_functions & USB_GADGET_NET)
+        ifname = usb_gadget_get_ifname(compositions[bound_functions].name,
+                                       PCSUITE_FUNCTION);
+
+    return ifname ? ifname : g_strdup(PCSUITE_IFNAME);
+}
+
+/*
+ * Every composition has its own network function, so each registers its
+ * own interface once it has been bound. Names are swapped so that the one
+ * of the bound composition is always PCSUITE_IFNAME, which is what
+ * /etc/default/usbnetwork and the host side setup expect. The interface
+ * holding the name must be down.
+ */
+static void claim_pcsuite_ifname(const gchar *ifname) {
+    gboolean taken = if_nametoindex(PCSUITE_IFNAME) != 0;
+    int ret = 0;
+
+    if (strcmp(ifname, PCSUITE_IFNAME) == 0)
+        return;
+
+    if (taken)
+        ret = rtnl_link_rename(PCSUITE_IFNAME, PCSUITE_IFNAME_SPARE);
+    if (ret == 0)
+        ret = rtnl_link_rename(ifname, PCSUITE_IFNAME);
+    if (taken)
+        rtnl_link_rename(PCSUITE_IFNAME_SPARE, ret == 0 ? ifname
+                                                        : PCSUITE_IFNAME);
+
+    if (ret != 0)
+        fprintf(stderr, "Cannot rename %s to %s: %s\n", ifname,
+                PCSUITE_IFNAME, g_strerror(-ret));
+}
+
+/* Bring the network interface of the bound composition up with
+ * PCSUITE_IP_ADDR, returning its name */
+static gchar *pcsuite_up(void) {
+    gchar *ifname = pcsuite_ifname();
+    int ret;
+
+    claim_pcsuite_ifname(ifname);
+    g_free(ifname);
+    ifname = pcsuite_ifname();
+
+    ret = rtnl_link_set_up(ifname, TRUE);
+    if (ret == 0)
+        ret = rtnl_addr_ipv4(ifname, PCSUITE_IP_ADDR, PCSUITE_IP_PREFIX, TRUE);
+
+    if (ret != 0) {
+        fprintf(stderr, "Cannot configure %s: %s\n", ifname,
+                g_strerror(-ret));
+        g_free(ifname);
+        return NULL;
+    }
+    return ifname;
+}
+
+static int pcsuite_down(const gchar *ifname) {
+    rtnl_addr_ipv4(ifname, PCSUITE_IP_ADDR, PCSUITE_IP_PREFIX, FALSE);
+    return rtnl_link_set_up(ifname, FALSE);
+}
+
+gboolean usb_gadget_set_functions(guint functions) {
+    gboolean move_luns, move_net;
+    gchar *ifname = NULL;
+    gint64 start;
+
+    if (!prestaged || functions >= G_N_ELEMENTS(compositions))
+        return FALSE;
+
+    if (functions == 0 || functions == bound_functions) {
+        active_functions = functions;
+        return TRUE;
+    }
+
+    start = g_get_monotonic_time();
+    /* the exported devices go along with the mass storage function */
+    move_luns = (bound_functions & functions & USB_GADGET_STORAGE) != 0;
+    if (move_luns && !move_lun_files(bound_functions, functions)) {
+        move_lun_files(functions, bound_functions);
+        return FALSE;
+    }
+
+    if (!usb_gadget_bind(compositions[functions].name)) {
+        if (move_luns)
+            move_lun_files(functions, bound_functions);
+        return FALSE;
+    }
+
+    /* the network configuration goes along with the network function */
+    move_net = (active_functions & functions & USB_GADGET_NET) != 0;
+    if (move_net) {
+        ifname = pcsuite_ifname();
+        pcsuite_down(ifname);
+        g_free(ifname);
+    }
+
+    active_functions = bound_functions = functions;
+    if (move_net) {
+        ifname = pcsuite_up();
+        g_free(ifname);
+    }
+
+    fprintf(stderr, "Switched USB gadget to %s in %lld us\n",
+            compositions[functions].name,
+            (long long)(g_get_monotonic_time() - start));
+    return TRUE;
+}
+
+guint usb_gadget_get_functions(void) {
+    return active_functions;
+}
+
+gboolean usb_gadget_pcsuite_enable(void) {
+    gint64 start = g_get_monotonic_time(), switched;
+    gchar *ifname;
+
+    if (!usb_gadget_set_functions(active_functions | USB_GADGET_NET))
+        return FALSE;
+    switched = g_get_monotonic_time();
+
+    ifname = pcsuite_up();
+    if (!ifname)
+        return FALSE;
+
+    fprintf(stderr, "PC Suite network up on %s in %lld us (gadget %lld us)\n",
+            ifname, (long long)(g_get_monotonic_time() - start),
+            (long long)(switched - start));
+    g_free(ifname);
+    return TRUE;
+}
+
+gboolean usb_gadget_pcsuite_disable(void) {
+    gchar *ifname = pcsuite_ifname();
+    int ret;
+
+    /* Like the script, only the network goes down. The gadget stays
+     * bound so that the host keeps seeing a device. */
+    active_functions &= ~USB_GADGET_NET;
+    ret = pcsuite_down(ifname);
+    if (ret != 0 && ret != -ENODEV) {
+        fprintf(stderr, "Cannot take %s down: %s\n", ifname,
+                g_strerror(-ret));
+        g_free(ifname);
+        return FALSE;
+    }
+
+    g_free(ifname);
+    return TRUE;
+}
+
+gboolean usb_gadget_storage_enable(const gchar *const *devices,
+                                   gboolean ro) {
+    guint n = devices ? g_strv_length((gchar **)devices) : 0;
+    gboolean ok = TRUE;
+    gchar *function;
+    GPtrArray *luns;
+    guint i;
+
+    if (!usb_gadget_set_functions(active_functions | USB_GADGET_STORAGE))
+        return FALSE;
+
+    function = storage_function(bound_functions);
+    luns = usb_lun_find(function);
+
+    if (luns->len < n) {
+        const gchar *name = compositions[bound_functions].name;
+
+        /* LUNs can only be added while the gadget is unbound */
+        ok = usb_gadget_unbind(name) && usb_lun_create(function, n);
+        ok = usb_gadget_bind(name) && ok;
+        g_ptr_array_unref(luns);
+        luns = usb_lun_find(function);
+    }
+
+    for (i = 0; i < luns->len; i++) {
+        const gchar *lun = g_ptr_array_index(luns, i);
+
+        /* ro can only be changed without a medium */
+        ok = usb_lun_set_file(lun, NULL) && ok;
+        if (i < n) {
+            ok = usb_lun_set_flag(lun, "ro", ro) &&
+                 usb_lun_set_file(lun, devices[i]) && ok;
+        }
+    }
+
+    g_ptr_array_unref(luns);
+    g_free(function);
+    return ok && n <= i;
+}
+
+gboolean usb_gadget_storage_disable(const gchar *const *devices) {
+    gboolean ok = TRUE, in_use = FALSE;
+    gchar *function;
+    GPtrArray *luns;
+    guint i;
+
+    if (!prestaged)
+        return FALSE;
+
+    if (bound_functions & USB_GADGET_STORAGE) {
+        function = storage_function(bound_functions);
+        luns = usb_lun_find(function);
+
+        for (i = 0; i < luns->len; i++) {
+            const gchar *lun = g_ptr_array_index(luns, i);
+            gchar *file = usb_lun_get_file(lun);
+
+            if (!file)
+                continue;
+            if (!devices || g_strv_contains(devices, file))
+                ok = usb_lun_set_file(lun, NULL) && ok;
+            else
+                in_use = TRUE;
+            g_free(file);
+        }
+
+        g_ptr_array_unref(luns);
+        g_free(function);
+    }
+
+    if (!in_use)
+        active_functions &= ~USB_GADGET_STORAGE;
+    return ok;
+}
@@ -0,0 +1,100 @@
+#ifndef __USB_GADGET_H__
+#define __USB_GADGET_H__
+
+#include <glib.h>
+
+/*
+ * USB gadgets set up directly through configfs, replacing the
+ * hildon-usb-gadget-* helper scripts where the kernel supports it.
+ *
+ * A gadget is described by a UsbGadgetDef. Creating it is idempotent:
+ * existing directories and links are reused, so a gadget left behind by an
+ * earlier run (or another tool using the same name) is simply adopted.
+ *
+ * Every composition ke-recv uses is created once by usb_gadget_prestage().
+ * Switching modes then only moves the UDC from one gadget to another, so
+ * the host sees a single disconnect/enumerate cycle.
+ */
+
+#define USB_GADGET_CONFIGFS "/sys/kernel/config/usb_gadget"
+#define USB_UDC_CLASS_DIR "/sys/class/udc"
+
+/* Function bits of the pre-staged compositions */
+#define USB_GADGET_NET (1 << 0)
+#define USB_GADGET_STORAGE (1 << 1)
+
+/* PC Suite network, as configured by pcsuite-enable.sh before */
+#define PCSUITE_FUNCTION "ecm.usb0"
+#define PCSUITE_IFNAME "usb0"
+/* what the interface of an unbound composition is renamed to while
+ * another one takes PCSUITE_IFNAME */
+#define PCSUITE_IFNAME_SPARE "usb0-spare"
+#define PCSUITE_IP_ADDR "192.168.42.2"
+#define PCSUITE_IP_PREFIX 24
+
+#define MASS_STORAGE_FUNCTION "mass_storage.0"
+/* LUNs staged up front: internal and external card, like g_file_storage
+ * on the N900. More are added when more devices are exported. */
+#define MASS_STORAGE_LUNS 2
+
+typedef struct {
+    const gchar *name;              /* directory in USB_GADGET_CONFIGFS */
+    guint16 vendor_id;
+    guint16 product_id;
+    const gchar *manufacturer;
+    const gchar *product;
+    const gchar *const *functions;  /* "<type>.<instance>", NULL terminated */
+    guint luns;                     /* initial LUNs of mass_storage, if any */
+} UsbGadgetDef;
+
+/* sysfs/configfs attribute dir/attr, without surrounding whitespace, or
+ * NULL if it cannot be read */
+gchar *usb_gadget_read_attr(const gchar *dir, const gchar *attr);
+
+/* Write value to the attribute, logging failures */
+gboolean usb_gadget_write_attr(const gchar *dir, const gchar *attr,
+                               const gchar *value);
+
+/* TRUE if configfs is mounted and the system has a UDC */
+gboolean usb_gadget_available(void);
+
+/* Name of the UDC to bind gadgets to, NULL if there is none */
+gchar *usb_gadget_get_udc(void);
+
+/* Create the gadget directory tree of def, without binding it */
+gboolean usb_gadget_create(const UsbGadgetDef *def);
+
+/* Bind the named gadget to the UDC, unbinding any other gadget using it */
+gboolean usb_gadget_bind(const gchar *name);
+
+/* Unbind the named gadget; succeeds if it was not bound */
+gboolean usb_gadget_unbind(const gchar *name);
+
+/* Network interface of an ecm/rndis/ncm function, NULL if unknown */
+gchar *usb_gadget_get_ifname(const gchar *name, const gchar *function);
+
+/* Create all compositions. FALSE if configfs gadgets cannot be used, the
+ * functions below then fail and the caller falls back to the scripts. */
+gboolean usb_gadget_prestage(void);
+
+/* Bind the composition with the given USB_GADGET_* functions. 0 only
+ * records that nothing is in use and leaves the bound gadget alone. */
+gboolean usb_gadget_set_functions(guint functions);
+
+/* USB_GADGET_* functions currently in use */
+guint usb_gadget_get_functions(void);
+
+/*
+ * PC Suite network mode: add the network function and bring its
+ * interface up with PCSUITE_IP_ADDR, or take it down again.
+ */
+gboolean usb_gadget_pcsuite_enable(void);
+gboolean usb_gadget_pcsuite_disable(void);
+
+/* Add the mass storage function exporting the given devices, one per LUN
+ * and read-only to the host if ro is set, or stop exporting them, all if
+ * devices is NULL */
+gboolean usb_gadget_storage_enable(const gchar *const *devices, gboolean ro);
+gboolean usb_gadget_storage_disable(const gchar *const *devices);
+
+#endif /* __USB_GADGET_H__ */
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "usb-lun.h"
+#include "usb-gadget.h"
+
+/* Legacy gadgets on kernels without the udc class */
+static const gchar *const legacy_gadget_dirs[] = {
+    "/sys/devices/platform/musb_hdrc/gadget",
+    "/sys/bus/platform/devices/musb-hdrc.0.auto/gadget",
+    NULL
+};
+
+/* LUN number of a directory entry named prefix<N>, -1 if it is not one */
+static gint lun_number(const gchar *name, const gchar *prefix) {
+    gchar *end;
+    glong n;
+
+    if (!g_str_has_prefix(name, prefix))
+        return -1;
+
+    name += strlen(prefix);
+    n = strtol(name, &end, 10);
+    if (end == name || *end != '\0' || n < 0 || n > G_MAXINT)
+        return -1;
+
+    return (gint)n;
+}
+
+static gint compare_luns(gconstpointer a, gconstpointer b) {
+    const gchar *x = *(const gchar *const *)a, *y = *(const gchar *const *)b;
+    const gchar *nx = strrchr(x, '/'), *ny = strrchr(y, '/');
+    gsize px = nx - x, py = ny - y;
+    gint r;
+
+    /* same parent: by LUN number, which is the trailing digits */
+    if (px == py && strncmp(x, y, px) == 0) {
+        while (*nx && !g_ascii_isdigit(*nx))
+            nx++;
+        while (*ny && !g_ascii_isdigit(*ny))
+            ny++;
+        r = atoi(nx) - atoi(ny);
+        if (r != 0)
+            return r;
+    }
+
+    return strcmp(x, y);
+}
+
+/* Add the LUN directories in dir whose names are one of prefixes + N */
+static void add_luns(GPtrArray *luns, const gchar *dir,
+                     const gchar *const *prefixes) {
+    GDir *d = g_dir_open(dir, 0, NULL);
+    const gchar *name;
+
+    if (!d)
+        return;
+
+    while ((name = g_dir_read_name(d))) {
+        gint i;
+
+        for (i = 0; prefixes[i]; i++) {
+            if (lun_number(name, prefixes[i]) >= 0) {
+                g_ptr_array_add(luns, g_build_filename(dir, name, NULL));
+                break;
+            }
+        }
+    }
+
+    g_dir_close(d);
+}
+
+GPtrArray *usb_lun_find(const gchar *function) {
+    static const gchar *const prefixes[] = { "lun.", NULL };
+    GPtrArray *luns = g_ptr_array_new_with_free_func(g_free);
+
+    add_luns(luns, function, prefixes);
+    g_ptr_array_sort(luns, compare_luns);
+    return luns;
+}
+
+static void find_legacy(GPtrArray *luns) {
+    static const gchar *const prefixes[] = { "gadget-lun", "lun", NULL };
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    GPtrArray *dirs = g_ptr_array_new_with_free_func(g_free);
+    GDir *d;
+    guint i;
+
+    for (i = 0; legacy_gadget_dirs[i]; i++)
+        g_ptr_array_add(dirs, g_strdup(legacy_gadget_dirs[i]));
+
+    d = g_dir_open(USB_UDC_CLASS_DIR, 0, NULL);
+    if (d) {
+        const gchar *name;
+
+        while ((name = g_dir_read_name(d)))
+            g_ptr_array_add(dirs, g_build_filename(USB_UDC_CLASS_DIR, name,
+                                                   "device", "gadget", NULL));
+        g_dir_close(d);
+    }
+
+    for (i = 0; i < dirs->len; i++) {
+        /* the same gadget is reachable through several of these */
+        gchar *real = realpath(g_ptr_array_index(dirs, i), NULL);
+
+        if (!real)
+            continue;
+        if (g_hash_table_contains(seen, real)) {
+            free(real);
+            continue;
+        }
+        g_hash_table_add(seen, g_strdup(real));
+        add_luns(luns, real, prefixes);
+        free(real);
+    }
+
+    g_ptr_array_unref(dirs);
+    g_hash_table_destroy(seen);
+}
+
+static void find_configfs(GPtrArray *luns) {
+    GDir *gadgets = g_dir_open(USB_GADGET_CONFIGFS, 0, NULL);
+    const gchar *gadget;
+
+    if (!gadgets)
+        return;
+
+    while ((gadget = g_dir_read_name(gadgets))) {
+        gchar *functions = g_build_filename(USB_GADGET_CONFIGFS, gadget,
+                                            "functions", NULL);
+        GDir *d = g_dir_open(functions, 0, NULL);
+        const gchar *name;
+
+        while (d && (name = g_dir_read_name(d))) {
+            gchar *function;
+            GPtrArray *found;
+            guint i;
+
+            if (!g_str_has_prefix(name, "mass_storage."))
+                continue;
+
+            function = g_build_filename(functions, name, NULL);
+            found = usb_lun_find(function);
+            for (i = 0; i < found->len; i++)
+                g_ptr_array_add(luns, g_strdup(g_ptr_array_index(found, i)));
+            g_ptr_array_unref(found);
+            g_free(function);
+        }
+
+        if (d)
+            g_dir_close(d);
+        g_free(functions);
+    }
+
+    g_dir_close(gadgets);
+}
+
+GPtrArray *usb_lun_find_all(void) {
+    GPtrArray *luns = g_ptr_array_new_with_free_func(g_free);
+
+    find_legacy(luns);
+    find_configfs(luns);
+    g_ptr_array_sort(luns, compare_luns);
+    return luns;
+}
+
+gboolean usb_lun_create(const gchar *function, guint count) {
+    gboolean ok = TRUE;
+    guint i;
+
+    for (i = 0; ok && i < count; i++) {
+        gchar *lun = g_strdup_printf("%s/lun.%u", function, i);
+
+        /* lun.0 comes with the function */
+        if (mkdir(lun, 0755) == 0) {
+            ok = usb_gadget_write_attr(lun, "removable", "1");
+        } else if (errno != EEXIST) {
+            fprintf(stderr, "Cannot create %s: %s\n", lun, g_strerror(errno));
+            ok = FALSE;
+        }
+        g_free(lun);
+    }
+
+    return ok;
+}
+
+gchar *usb_lun_get_file(const gchar *lun) {
+    gchar *file = usb_gadget_read_attr(lun, "file");
+
+    if (file && *file == '\0') {
+        g_free(file);
+        file = NULL;
+    }
+    return file;
+}
+
+gboolean usb_lun_set_file(const gchar *lun, const gchar *file) {
+    /* an empty line ejects the medium */
+    return usb_gadget_write_attr(lun, "file", file && *file ? file : "\n");
+}
+
+gint usb_lun_get_flag(const gchar *lun, const gchar *attr) {
+    gchar *value = usb_gadget_read_attr(lun, attr);
+    gint flag = -1;
+
+    if (value && *value)
+        flag = atoi(value) != 0;
+
+    g_free(value);
+    return flag;
+}
+
+gboolean usb_lun_set_flag(const gchar *lun, const gchar *attr,
+                          gboolean value) {
+    return usb_gadget_write_attr(lun, attr, value ? "1" : "0");
+}
+
+gboolean usb_lun_any_in_use(void) {
+    GPtrArray *luns = usb_lun_find_all();
+    gboolean used = FALSE;
+    guint i;
+
+    for (i = 0; !used && i < luns->len; i++) {
+        gchar *file = usb_lun_get_file(g_ptr_array_index(luns, i));
+
+        used = file != NULL;
+        g_free(file);
+    }
+
+    g_ptr_array_unref(luns);
+    return used;
+}
@@ -0,0 +1,43 @@
+#ifndef __USB_LUN_H__
+#define __USB_LUN_H__
+
+#include <glib.h>
+
+/*
+ * Mass storage LUNs of USB gadgets, inspected and configured through their
+ * sysfs/configfs attributes. Both kinds are found:
+ *
+ * - legacy g_file_storage/g_mass_storage LUNs below the gadget device of
+ *   a UDC (gadget-lunN or lunN)
+ * - configfs LUNs,
+ *   USB_GADGET_CONFIGFS/<gadget>/functions/mass_storage.<name>/lun.N
+ *
+ * A LUN is identified by its directory. There is no limit on the number of
+ * LUNs, configfs functions get as many as usb_lun_create() is asked for.
+ */
+
+/* Directories of all LUNs of all gadgets, freed with g_ptr_array_unref() */
+GPtrArray *usb_lun_find_all(void);
+
+/* LUNs of one configfs mass_storage function directory, in LUN order */
+GPtrArray *usb_lun_find(const gchar *function);
+
+/* Make sure lun.0 to lun.<count - 1> exist. configfs only allows this while
+ * the gadget is not bound. New LUNs are made removable. */
+gboolean usb_lun_create(const gchar *function, guint count);
+
+/* Backing file of the LUN, NULL if there is no medium */
+gchar *usb_lun_get_file(const gchar *lun);
+
+/* Load file into the LUN, or eject the medium if file is NULL */
+gboolean usb_lun_set_file(const gchar *lun, const gchar *file);
+
+/* Boolean attributes such as "ro" and "removable", -1 if unreadable.
+ * "ro" can only be changed while the LUN has no medium. */
+gint usb_lun_get_flag(const gchar *lun, const gchar *attr);
+gboolean usb_lun_set_flag(const gchar *lun, const gchar *attr, gboolean value);
+
+/* TRUE if any LUN has a backing file, i.e. something is shared over USB */
+gboolean usb_lun_any_in_use(void);
+
+#endif /* __USB_LUN_H__ */
@@ -0,0 +1,287 @@
+/**
+  @file usb-mode.c
+  Card and USB mode jobs of ke-recv, queued with the exec-func job queue.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#include "ke-recv.h"
+#include "exec-func.h"
+#include "usb-mode.h"
+#include "usb-gadget.h"
+#include "usb-lun.h"
+#include "write-mark.h"
+#include "mount-engine.h"
+#include "umount-engine.h"
+#include "usb-share.h"
+
+/* FIXME: space for two arguments only */
+static const char* unload_args[] = {UNLOAD_USB_DRIVER_COMMAND,
+                                    NULL, NULL, NULL};
+
+/* args of MMC_UMOUNT_COMMAND: mount point, anything for a lazy unmount */
+static gboolean umount_native(const char *const args[],
+                              exec_done_cb_t done, gpointer done_data)
+{
+        umount_engine_start(args[1], args[2] != NULL, done, done_data);
+        return TRUE;
+}
+
+void run_normal_umount(const mmc_info_t *mmc, gboolean whole_card,
+                       exec_done_cb_t cb, gpointer data)
+{
+        const char* umount_args[] = {MMC_UMOUNT_COMMAND, NULL,
+                                     NULL, NULL};
+        umount_args[1] = mmc->mount_point;
+        if (whole_card) {
+                umount_args[2] = mmc->whole_device;
+        } 
+
+        exec_native_deferred_async_on(EXEC_LANE_DEFAULT, umount_native,
+                                      MMC_UMOUNT_COMMAND, umount_args,
+                                      UMOUNT_TIMEOUT_MS, cb, data);
+}
+
+/* the first partition */
+static const volume_list_t *first_volume(const mmc_info_t *mmc)
+{
+        const volume_list_t *l;
+
+        for (l = &mmc->volumes; l != NULL; l = l->next) {
+                if (l->udi != NULL && l->volume_number == 1) {
+                        return l;
+                }
+        }
+        return NULL;
+}
+
+static const char *first_partition(const mmc_info_t *mmc)
+{
+        const volume_list_t *v = first_volume(mmc);
+
+        return v != NULL ? v->dev_name : NULL;
+}
+
+/* args of MMC_MOUNT_COMMAND: device, mount point, fstype, fsck hint */
+static gboolean mount_native(const char *const args[],
+                             exec_done_cb_t done, gpointer done_data)
+{
+        gboolean check = args[4] == NULL
+                         || strcmp(args[4], MMC_MOUNT_SKIP_FSCK) != 0;
+
+        return mount_engine_start(args[1], args[2], args[3], check,
+                                  done, done_data);
+}
+
+static gboolean queue_mount(exec_lane_t lane, const mmc_info_t *mmc,
+                            exec_done_cb_t cb, gpointer data)
+{
+        const char* mount_args[6] = {MMC_MOUNT_COMMAND, NULL, NULL,
+                                     NULL, NULL, NULL};
+        const volume_list_t *v;
+
+        v = first_volume(mmc);
+        if (v == NULL || v->dev_name == NULL) {
+                ULOG_ERR_F("device name for first partition not found");
+                return FALSE;
+        }
+
+        mount_args[1] = v->dev_name;
+        mount_args[2] = mmc->mount_point;
+        mount_args[3] = v->fstype != NULL ? v->fstype : "";
+        /* whichever of the two was exported, both marks are dropped */
+        if (write_mark_take_clean(v->dev_name) |
+            write_mark_take_clean(mmc->whole_device)) {
+                ULOG_INFO_F("%s not written over USB, skipping fsck",
+                            v->dev_name);
+                mount_args[4] = MMC_MOUNT_SKIP_FSCK;
+        }
+        /* the engine or the script checks the card after making sure it
+         * is not mounted or blacklisted */
+        exec_native_deferred_async_on(lane, mount_native, MMC_MOUNT_COMMAND,
+                                      mount_args, MOUNT_TIMEOUT_MS, cb, data);
+        return TRUE;
+}
+
+gboolean run_mount(const mmc_info_t *mmc, exec_done_cb_t cb, gpointer data)
+{
+        return queue_mount(EXEC_LANE_DEFAULT, mmc, cb, data);
+}
+
+typedef struct {
+        const mmc_info_t *mmc;
+        exec_join_t *join;
+} usb_return_t;
+
+static gboolean release_lun_native(const char *const args[])
+{
+        if (!usb_gadget_storage_disable(args + 1)) {
+                return FALSE;
+        }
+        write_mark_unshare(args + 1);
+        return TRUE;
+}
+
+static void usb_released(int status, gpointer data)
+{
+        usb_return_t *ret = data;
+        const mmc_info_t *mmc = ret->mmc;
+        exec_lane_t lane = mmc->internal_card ? EXEC_LANE_INT_MMC
+                                              : EXEC_LANE_EXT_MMC;
+
+        /* the host may still be using the card, do not mount it */
+        if (status != 0) {
+                ULOG_ERR_F("could not release %s from USB: %d",
+                           mmc->name, status);
+        } else if (!queue_mount(lane, mmc, exec_join_done,
+                                exec_join_add(ret->join))) {
+                exec_join_done(-1, ret->join);
+        }
+
+        /* after queuing the mount so that the join cannot finish early */
+        exec_join_done(status, ret->join);
+        g_free(ret);
+}
+
+void run_usb_return(const mmc_info_t *mmc, exec_join_t *join)
+{
+        const char* args[] = {UNLOAD_USB_DRIVER_COMMAND, NULL, NULL, NULL};
+        exec_lane_t lane = mmc->internal_card ? EXEC_LANE_INT_MMC
+                                              : EXEC_LANE_EXT_MMC;
+        usb_return_t *ret = g_new0(usb_return_t, 1);
+
+        /* whichever of the two was exported */
+        args[1] = mmc->whole_device;
+        args[2] = first_partition(mmc);
+        if (args[1] == NULL) {
+                args[1] = args[2];
+                args[2] = NULL;
+        }
+
+        ret->mmc = mmc;
+        ret->join = exec_join_add(join);
+        exec_native_async_on(lane, release_lun_native,
+                             UNLOAD_USB_DRIVER_COMMAND, args,
+                             USB_DRIVER_TIMEOUT_MS, usb_released, ret);
+}
+
+/* args: nominal command, mount point */
+static int share_return_native(const char *const args[])
+{
+        return usb_share_ro_return(args[1]) ? 0 : 1;
+}
+
+void run_usb_share_return(exec_join_t *join)
+{
+        /* never run, the job always finishes in process */
+        const char* args[] = {UNLOAD_USB_DRIVER_COMMAND, NULL, NULL};
+        GPtrArray *mount_points = usb_share_ro_get_mount_points();
+        guint i;
+
+        for (i = 0; i < mount_points->len; ++i) {
+                const char *mp = g_ptr_array_index(mount_points, i);
+                exec_lane_t lane =
+                        strcmp(mp, USB_SHARE_INTERNAL_MOUNT_POINT) == 0
+                        ? EXEC_LANE_INT_MMC : EXEC_LANE_EXT_MMC;
+
+                args[1] = mp;
+                exec_native_status_async_on(lane, share_return_native,
+                                            args[0], args,
+                                            USB_DRIVER_TIMEOUT_MS,
+                                            exec_join_done,
+                                            exec_join_add(join));
+        }
+        g_ptr_array_unref(mount_points);
+}
+
+static gboolean load_usb_driver_native(const char *const args[])
+{
+        int i;
+
+        for (i = 1; args[i] != NULL; ++i) {
+                write_mark_share(args[i]);
+        }
+        return usb_gadget_storage_enable(args + 1, FALSE);
+}
+
+void load_usb_driver(const char **arg, exec_done_cb_t cb, gpointer data)
+{
+        const char **load_args;
+        int i = 1, j = 0;
+
+        load_args = g_new0(const char *, g_strv_length((gchar **)arg) + 2);
+        load_args[0] = LOAD_USB_DRIVER_COMMAND;
+        for (; arg[j] != NULL; ++i, ++j) {
+                load_args[i] = arg[j];
+        }
+        load_args[i] = NULL;
+
+        exec_native_async(load_usb_driver_native, LOAD_USB_DRIVER_COMMAND,
+                          load_args, USB_DRIVER_TIMEOUT_MS, cb, data);
+        g_free(load_args);
+}
+
+gboolean unload_usb_driver(const char **arg)
+{
+        int ret = -1, i = 1, j = 0;
+
+        for (; arg && arg[j] != NULL; ++i, ++j) {
+                unload_args[i] = arg[j];
+        }
+        unload_args[i] = NULL;
+
+        if (usb_gadget_storage_disable(arg)) {
+                write_mark_unshare(arg);
+                return TRUE;
+        }
+        ret = exec_prog(UNLOAD_USB_DRIVER_COMMAND, unload_args);
+	if (ret != 0) {
+                return FALSE;
+	} else {
+                write_mark_unshare(arg);
+                return TRUE;
+        }
+}
+
+static gboolean enable_pcsuite_native(const char *const args[])
+{
+        return usb_gadget_pcsuite_enable();
+}
+
+static gboolean disable_pcsuite_native(const char *const args[])
+{
+        return usb_gadget_pcsuite_disable();
+}
+
+void enable_pcsuite(exec_done_cb_t cb, gpointer data)
+{
+        static const char *args[] = {ENABLE_PCSUITE_COMMAND, NULL};
+        exec_native_async(enable_pcsuite_native, args[0], args,
+                          PCSUITE_TIMEOUT_MS, cb, data);
+}
+
+void disable_pcsuite(exec_done_cb_t cb, gpointer data)
+{
+        static const char *args[] = {DISABLE_PCSUITE_COMMAND, NULL};
+        exec_native_async(disable_pcsuite_native, args[0], args,
+                          PCSUITE_TIMEOUT_MS, cb, data);
+}
+
+gboolean usb_driver_is_used(void)
+{
+        return usb_lun_any_in_use();
+}
@@ -0,0 +1,142 @@
+/**
+  @file usb-mode.h
+  Card and USB mode jobs of ke-recv, queued with the exec-func job queue.
+  Only the daemon links these: they pull in the USB gadget and mount
+  code, which the other programs sharing exec-func.c do not need.
+
+  This file is part of ke-recv.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODE_H_
+#define USB_MODE_H_
+
+#include "exec-func.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MMC_MOUNT_COMMAND "/usr/sbin/osso-mmc-mount.sh"
+#define MMC_UMOUNT_COMMAND "/usr/sbin/osso-mmc-umount.sh"
+/* last argument of MMC_MOUNT_COMMAND: the card is known to be clean */
+#define MMC_MOUNT_SKIP_FSCK "nofsck"
+#define LOAD_USB_DRIVER_COMMAND "/usr/sbin/osso-usb-mass-storage-enable.sh"
+#define UNLOAD_USB_DRIVER_COMMAND "/usr/sbin/osso-usb-mass-storage-disable.sh"
+#define ENABLE_PCSUITE_COMMAND "/usr/sbin/pcsuite-enable.sh"
+#define DISABLE_PCSUITE_COMMAND "/usr/sbin/pcsuite-disable.sh"
+/* Per-job time limits of the asynchronous helpers. Mounting may run
+ * fsck -a for as long as a large card takes, and killing the script would
+ * orphan it, so it has none. */
+#define MOUNT_TIMEOUT_MS 0
+#define UMOUNT_TIMEOUT_MS 30000
+#define USB_DRIVER_TIMEOUT_MS 30000
+#define PCSUITE_TIMEOUT_MS 30000
+
+/**
+  Unmount the card asynchronously with the unmount engine. Applications
+  are notified first and the unmount waits for their files to be closed.
+  @param mmc memory card
+  @param whole_card whether the whole card (all partitions)
+         should be unmounted.
+  @param cb completion callback, status 0 on success.
+  @param data passed to cb
+*/
+void run_normal_umount(const mmc_info_t *mmc, gboolean whole_card,
+                       exec_done_cb_t cb, gpointer data);
+
+/**
+  Execute umount with the -l option.
+*/
+void run_lazy_umount(void);
+
+/**
+  Mount the card asynchronously, in process with the mount engine when
+  possible, otherwise with MMC_MOUNT_COMMAND. The file system check is
+  skipped if the card came back from USB mass storage mode unwritten.
+  Status 0 means mounted read-write, 1 failed and 2 mounted read-only.
+  @param mmc memory card
+  @param cb completion callback, status 0 on success.
+  @param data passed to cb
+  @return false if the command could not be queued, cb is not called then.
+*/
+gboolean run_mount(const mmc_info_t *mmc, exec_done_cb_t cb, gpointer data);
+
+/**
+  Give a card back after USB mass storage mode: release its LUN, then
+  mount it, on the card's own lane so that the internal and external
+  card are handled concurrently. The mount is skipped if the LUN could
+  not be released.
+  @param mmc memory card
+  @param join join the jobs are added to
+*/
+void run_usb_return(const mmc_info_t *mmc, exec_join_t *join);
+
+/**
+  Give the cards back after read-only USB sharing: stop exporting each
+  shared mount and make it writable again, on the card's own lane like
+  run_usb_return().
+  @param join join the jobs are added to
+*/
+void run_usb_share_return(exec_join_t *join);
+
+/**
+  Load the USB driver for listed devices asynchronously. Uses the
+  pre-staged configfs gadgets when possible.
+  Logs errors in case of failure.
+  @param arg device names in a NULL-terminated array.
+  @param cb completion callback, status 0 on success.
+  @param data passed to cb
+*/
+void load_usb_driver(const char **arg, exec_done_cb_t cb, gpointer data);
+
+/**
+  Unload the USB driver for listed devices. Uses the pre-staged configfs
+  gadgets when possible.
+  Logs errors in case of failure.
+  @param arg device names in a NULL-terminated array, or NULL to unload
+  them all.
+  @return true on success.
+*/
+gboolean unload_usb_driver(const char **arg);
+
+/**
+  Enable PC Suite mode asynchronously. Switches to the pre-staged network
+  gadget when possible, otherwise runs ENABLE_PCSUITE_COMMAND.
+  Logs errors in case of failure.
+  @param cb completion callback, status 0 on success.
+  @param data passed to cb
+*/
+void enable_pcsuite(exec_done_cb_t cb, gpointer data);
+
+/**
+  Disable PC Suite mode asynchronously, takes the network interface down.
+  Logs errors in case of failure.
+  @param cb completion callback, status 0 on success.
+  @param data passed to cb
+*/
+void disable_pcsuite(exec_done_cb_t cb, gpointer data);
+
+/**
+  @return true if USB driver is used, i.e. any legacy or configfs mass
+  storage LUN has a backing file, false otherwise.
+*/
+gboolean usb_driver_is_used(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* USB_MODE_H_ */
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mount.h>
+#include <glib.h>
+
+#include "usb-share.h"
+#include "usb-gadget.h"
+#include "mount-table.h"
+
+typedef struct {
+    gchar *mount_point;
+    gchar *device;
+    unsigned long flags;    /* per-mount flags to keep over the remounts */
+} SharedMount;
+
+/* Mounts remounted read-only by usb_share_ro_enable() */
+static GPtrArray *shared = NULL;
+
+static void shared_mount_free(gpointer p) {
+    SharedMount *m = p;
+
+    g_free(m->mount_point);
+    g_free(m->device);
+    g_free(m);
+}
+
+static unsigned long mount_flags(const gchar *options) {
+    static const struct {
+        const gchar *name;
+        unsigned long flag;
+    } known[] = {
+        { "nosuid", MS_NOSUID },
+        { "nodev", MS_NODEV },
+        { "noexec", MS_NOEXEC },
+        { "noatime", MS_NOATIME },
+        { "nodiratime", MS_NODIRATIME },
+        { "relatime", MS_RELATIME },
+        { "sync", MS_SYNCHRONOUS },
+    };
+    gchar **opts = g_strsplit(options, ",", -1);
+    unsigned long flags = 0;
+    guint i, j;
+
+    for (i = 0; opts[i]; i++)
+        for (j = 0; j < G_N_ELEMENTS(known); j++)
+            if (strcmp(opts[i], known[j].name) == 0)
+                flags |= known[j].flag;
+
+    g_strfreev(opts);
+    return flags;
+}
+
+static SharedMount *find_mount(const gchar *mount_point) {
+    const MountEntry *e = mount_table_mount_of(mount_point);
+    SharedMount *m;
+
+    if (!e || e->device[0] != '/')
+        return NULL;
+
+    m = g_new0(SharedMount, 1);
+    m->mount_point = g_strdup(mount_point);
+    m->device = g_strdup(e->device);
+    m->flags = mount_flags(e->options);
+    return m;
+}
+
+static gboolean remount_rw(SharedMount *m) {
+    if (mount(m->device, m->mount_point, NULL, MS_REMOUNT | m->flags,
+              NULL) != 0) {
+        fprintf(stderr, "Cannot remount %s read-write: %s\n",
+                m->mount_point, g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean usb_share_ro_enable(void) {
+    static const gchar *const mount_points[] = USB_SHARE_MOUNT_POINTS;
+    GPtrArray *devices;
+    guint i;
+
+    usb_share_ro_disable();
+    shared = g_ptr_array_new_with_free_func(shared_mount_free);
+
+    for (i = 0; mount_points[i]; i++) {
+        SharedMount *m = find_mount(mount_points[i]);
+
+        if (!m)
+            continue;
+
+        /* fails with EBUSY while files are open for writing */
+        if (mount(m->device, m->mount_point, NULL,
+                  MS_REMOUNT | MS_RDONLY | m->flags, NULL) != 0) {
+            fprintf(stderr, "Cannot remount %s read-only: %s\n",
+                    m->mount_point, g_strerror(errno));
+            shared_mount_free(m);
+            continue;
+        }
+        g_ptr_array_add(shared, m);
+    }
+    mount_table_invalidate();
+
+    if (shared->len == 0) {
+        g_ptr_array_unref(shared);
+        shared = NULL;
+        return FALSE;
+    }
+
+    devices = g_ptr_array_new();
+    for (i = 0; i < shared->len; i++)
+        g_ptr_array_add(devices,
+                        ((SharedMount *)g_ptr_array_index(shared, i))->device);
+    g_ptr_array_add(devices, NULL);
+
+    if (!usb_gadget_storage_enable((const gchar *const *)devices->pdata,
+                                   TRUE)) {
+        g_ptr_array_unref(devices);
+        usb_share_ro_disable();
+        return FALSE;
+    }
+
+    g_ptr_array_unref(devices);
+    return TRUE;
+}
+
+void usb_share_ro_disable(void) {
+    guint i;
+
+    if (!shared)
+        return;
+
+    /* the host must be gone before the filesystems can change again */
+    for (i = 0; i < shared->len; i++) {
+        const gchar *device[] = {
+            ((SharedMount *)g_ptr_array_index(shared, i))->device, NULL
+        };
+
+        usb_gadget_storage_disable(device);
+    }
+
+    for (i = 0; i < shared->len; i++)
+        remount_rw(g_ptr_array_index(shared, i));
+    mount_table_invalidate();
+
+    g_ptr_array_unref(shared);
+    shared = NULL;
+}
+
+GPtrArray *usb_share_ro_get_mount_points(void) {
+    GPtrArray *mount_points = g_ptr_array_new_with_free_func(g_free);
+    guint i;
+
+    for (i = 0; shared && i < shared->len; i++) {
+        SharedMount *m = g_ptr_array_index(shared, i);
+
+        g_ptr_array_add(mount_points, g_strdup(m->mount_point));
+    }
+    return mount_points;
+}
+
+gboolean usb_share_ro_return(const gchar *mount_point) {
+    const gchar *device[] = { NULL, NULL };
+    SharedMount *m = NULL;
+    gboolean ok;
+    guint i;
+
+    for (i = 0; shared && i < shared->len; i++) {
+        m = g_ptr_array_index(shared, i);
+        if (strcmp(m->mount_point, mount_point) == 0)
+            break;
+        m = NULL;
+    }
+    if (!m)
+        return TRUE;
+
+    /* the host must be gone before the filesystem can change again */
+    device[0] = m->device;
+    if (!usb_gadget_storage_disable(device))
+        return FALSE;
+
+    ok = remount_rw(m);
+    mount_table_invalidate();
+
+    g_ptr_array_remove(shared, m);
+    if (shared->len == 0) {
+        g_ptr_array_unref(shared);
+        shared = NULL;
+    }
+    return ok;
+}
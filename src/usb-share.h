@@ -0,0 +1,39 @@
+#ifndef __USB_SHARE_H__
+#define __USB_SHARE_H__
+
+#include <glib.h>
+
+/*
+ * Read-only USB sharing of mounted cards.
+ *
+ * Instead of unmounting a card before exporting it, its filesystem is
+ * remounted read-only locally and the device is exported on a LUN with
+ * ro=1. Local applications keep reading their files and the host can
+ * copy them off, but nobody can write, so neither side sees the other
+ * change the filesystem under it.
+ *
+ * Needs the pre-staged configfs gadgets (see usb-gadget.h).
+ */
+
+/* Mount points offered for sharing, exported in this order */
+#define USB_SHARE_INTERNAL_MOUNT_POINT "/home/user/MyDocs"
+#define USB_SHARE_MOUNT_POINTS \
+    { USB_SHARE_INTERNAL_MOUNT_POINT, "/media/mmc1", NULL }
+
+/* Remount every mounted share point read-only and export it. Points that
+ * cannot be remounted (e.g. files open for writing) are skipped. FALSE if
+ * nothing could be shared. */
+gboolean usb_share_ro_enable(void);
+
+/* Stop exporting and make the shared mounts writable again */
+void usb_share_ro_disable(void);
+
+/* Mount points shared now, freed with g_ptr_array_unref() */
+GPtrArray *usb_share_ro_get_mount_points(void);
+
+/* usb_share_ro_disable() for one mount point, so that the cards can be
+ * given back independently. The mount stays read-only and shared if its
+ * LUN cannot be released. Succeeds if mount_point is not shared. */
+gboolean usb_share_ro_return(const gchar *mount_point);
+
+#endif /* __USB_SHARE_H__ */
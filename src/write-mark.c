@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "write-mark.h"
+
+typedef struct {
+    guint64 shared;     /* sectors written when exported */
+    gboolean clean;     /* unexported without any writes */
+    gboolean active;    /* still exported */
+} WriteMark;
+
+/* /dev path -> WriteMark */
+static GHashTable *marks = NULL;
+
+/*
+ * Sectors written from the stat file of the device. Disks and partitions
+ * of current kernels have 11 or more fields with the count in the 7th,
+ * partitions of old kernels only reads, read sectors, writes and write
+ * sectors.
+ */
+static gboolean read_sectors_written(const gchar *device, guint64 *sectors) {
+    gchar *path, *contents = NULL;
+    guint64 f[7];
+    gint n;
+
+    path = g_strdup_printf("/sys/class/block/%s/stat",
+                           strrchr(device, '/') ? strrchr(device, '/') + 1
+                                                : device);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return FALSE;
+    }
+
+    n = sscanf(contents, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+               " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+               " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+               " %" G_GUINT64_FORMAT,
+               &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6]);
+    g_free(contents);
+    g_free(path);
+
+    if (n == 7)
+        *sectors = f[6];
+    else if (n == 4)
+        *sectors = f[3];
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+void write_mark_share(const gchar *device) {
+    WriteMark *mark;
+    guint64 sectors;
+
+    if (!marks)
+        marks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      g_free);
+
+    if (!read_sectors_written(device, &sectors)) {
+        g_hash_table_remove(marks, device);
+        return;
+    }
+
+    mark = g_new0(WriteMark, 1);
+    mark->shared = sectors;
+    mark->active = TRUE;
+    g_hash_table_replace(marks, g_strdup(device), mark);
+}
+
+static void unshare_one(const gchar *device, WriteMark *mark) {
+    guint64 sectors;
+
+    if (!mark->active)
+        return;
+
+    mark->active = FALSE;
+    mark->clean = read_sectors_written(device, &sectors) &&
+                  sectors == mark->shared;
+    if (!mark->clean)
+        fprintf(stderr, "%s was written over USB\n", device);
+}
+
+void write_mark_unshare(const gchar *const *devices) {
+    GHashTableIter iter;
+    gpointer key, value;
+    guint i;
+
+    if (!marks)
+        return;
+
+    if (devices) {
+        for (i = 0; devices[i]; i++) {
+            WriteMark *mark = g_hash_table_lookup(marks, devices[i]);
+
+            if (mark)
+                unshare_one(devices[i], mark);
+        }
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, marks);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        unshare_one(key, value);
+}
+
+gboolean write_mark_take_clean(const gchar *device) {
+    WriteMark *mark;
+    gboolean clean;
+
+    if (!marks || !device)
+        return FALSE;
+
+    mark = g_hash_table_lookup(marks, device);
+    if (!mark || mark->active)
+        return FALSE;
+
+    clean = mark->clean;
+    g_hash_table_remove(marks, device);
+    return clean;
+}
@@ -0,0 +1,30 @@
+#ifndef __WRITE_MARK_H__
+#define __WRITE_MARK_H__
+
+#include <glib.h>
+
+/*
+ * Write watermarks of devices shared over USB.
+ *
+ * The sectors-written counter of the block device (/sys/class/block/<dev>/
+ * stat) is recorded when a device is exported and again when it comes
+ * back. If the counter did not move, the host never wrote to it and the
+ * filesystem is exactly as clean as when it was unmounted, so the check
+ * before mounting it again can be skipped.
+ *
+ * Any doubt (counter unreadable, device not seen at both ends, another
+ * share in between) counts as written.
+ */
+
+/* Record the counter of device, a /dev path, before exporting it */
+void write_mark_share(const gchar *device);
+
+/* Record the counter after the export ended. NULL devices means all that
+ * are shared. */
+void write_mark_unshare(const gchar *const *devices);
+
+/* TRUE if device came back from USB unwritten. The mark is dropped, so
+ * only the first mount after a share gets the hint. */
+gboolean write_mark_take_clean(const gchar *device);
+
+#endif /* __WRITE_MARK_H__ */